@@ -1,5 +1,6 @@
-// Compile: clang -O3 -msse4.2 -maes  FastUnzirka_v7++_Final.c -o FastUnzirka_v7++_Final
+// Compile: clang -O3 -msse4.2 -maes -fopenmp FastUnzirka_v7++_Final.c -o FastUnzirka_v7++_Final (add -fPIC -DZIRKA_LIBRARY -c for libzirka, see libzirka.h)
 
+#define _GNU_SOURCE // copy_file_range
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
@@ -9,17 +10,43 @@
 #include <unistd.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h> // FICLONERANGE
 #include <immintrin.h>
+#include <omp.h>
+#include <errno.h>
+#include <stdarg.h>
+#include "libzirka.h"
 
 #define CHUNK_SIZE 4096 //384 
 #define MAGIC_BYTE 255
+#define TAG_SIZE 13      // [255][8B offset][4B chk]: CHUNK_SIZE bytes
+#define LONG_TAG_SIZE 17 // [255][8B offset][4B chk][4B length]: 'length' bytes (extended match)
 #define INITIAL_OUTPUT_SIZE (1024ULL * 1024ULL * 1024ULL) 
+#define LZ_MAGIC "ZIRKALZ1"  // Framed archive written with --lz
+#define LZ_MIN_MATCH 4
+#define LZ_BLOCK_MAX (1U << 20) // The encoder's LZ_BLOCK: no frame holds more
+#define SEEK_MAGIC "ZIRKAIX1" // <archive>.idx written with --seekable
+#define SEEK_SCAN_INTERVAL (256ULL * 1024) // Checkpoint spacing when there is no .idx
+#define SEEK_CACHE 8         // Decompressed LZ frames kept around by the range resolver
+#define RESTORE_PIECE (64ULL * 1024 * 1024) // Tag stream resolved between two progress reports
+#define SUM_MAGIC "ZIRKASUM" // Checksum footer: [8B magic][16B tree hash][4B leaf size][4B Pippip of the 28 bytes before]
+#define SUM_FOOTER_SIZE 32
+#define FORMAT_MAGIC "ZIRKAV8"  // Marker of archives v7 decoders cannot read: [255][8B "ZIRKAV8\0"][4B Pippip of it][4B flags]
+#define FORMAT_HEADER_SIZE 17
+#define FORMAT_LONG_TAGS 1u     // Tags may carry a length (LONG_TAG_SIZE)
+#define FORMAT_CHECKSUM 2u      // The archive ends with the checksum footer
+#define FORMAT_LZ 4u            // The tag stream is framed (LZ_MAGIC)
+#define FORMAT_KNOWN (FORMAT_LONG_TAGS | FORMAT_CHECKSUM | FORMAT_LZ)
+#define STREAM_WINDOW (8ULL * 1024 * 1024) // Streaming restore: output bytes buffered between two writes
+#define KERNEL_COPY_MIN (64ULL * 1024) // --reflink: literal runs this long go from the archive by copy_file_range
+#define KEEP_LIMIT (1024ULL * 1024 * 1024) // Streaming restore: referenced bytes kept in RAM before they go to a temp file
 
 #define _PADr_KAZE(x, n) ( ((x) << (n))>>(n) )
 #define _PAD_KAZE(x, n) ( ((x) << (n)) )
 
 // Too weak due to ChunkA2 and ChunkB2 not AESed... 2026-Feb-14, strengthened
-void FNV1A_Pippip_Yurii_OOO_128bit_AES_TriXZi_Mikayla_forte (const char *str, size_t wrdlen, uint32_t seed, void *output) {
+static void FNV1A_Pippip_Yurii_OOO_128bit_AES_TriXZi_Mikayla_forte (const char *str, size_t wrdlen, uint32_t seed, void *output) {
     __m128i chunkA;
     __m128i chunkA2;
     __m128i chunkB;
@@ -148,92 +175,1002 @@ void FNV1A_Pippip_Yurii_OOO_128bit_AES_TriXZi_Mikayla_forte (const char *str, si
     //#endif
 }
 
-// --- THE FIX: MATCHING ENCODER HASH ---
-// This hashes the 8-byte offset value, exactly like Zirka_v7.c does
-uint32_t calc_fnv_off(uint64_t offset) {
-    uint8_t data[8]; 
-    memcpy(data, &offset, 8);
-    uint32_t h = 2166136261u;
-    for (int i=0; i<8; i++) { 
-        h ^= data[i]; 
-        h *= 16777619u; 
+// --- LZ FRAMES (--lz archives) ---
+// Inverse of the encoder's lz_compress: [token][literal length...][literals][2B offset][match length...].
+// Returns false on a corrupt block instead of reading or writing outside it.
+static bool lz_decompress(const uint8_t* src, uint32_t n, uint8_t* dst, uint32_t raw_len) {
+    uint32_t ip = 0, op = 0;
+    while (ip < n) {
+        uint8_t token = src[ip++];
+        uint32_t nlit = token >> 4;
+        if (nlit == 15) {
+            uint8_t b;
+            do { if (ip >= n) return false; b = src[ip++]; nlit += b; } while (b == 255);
+        }
+        if (nlit > n - ip || nlit > raw_len - op) return false;
+        memcpy(dst + op, src + ip, nlit);
+        ip += nlit;
+        op += nlit;
+        if (ip == n) break; // The last sequence has no match
+        if (ip + 2 > n) return false;
+        uint32_t off = src[ip] | (uint32_t)src[ip + 1] << 8;
+        ip += 2;
+        uint32_t mlen = (token & 15) + LZ_MIN_MATCH;
+        if ((token & 15) == 15) {
+            uint8_t b;
+            do { if (ip >= n) return false; b = src[ip++]; mlen += b; } while (b == 255);
+        }
+        if (off == 0 || off > op || mlen > raw_len - op) return false;
+        for (uint32_t k = 0; k < mlen; k++) dst[op + k] = dst[op - off + k]; // Overlapping copies repeat the pattern
+        op += mlen;
     }
-    return h;
+    return op == raw_len;
 }
 
-int main(int argc, char* argv[]) {
-    if (argc < 2) { printf("Usage: %s <file.zirka>\n", argv[0]); return 1; }
+// --- ARCHIVES ---
+// An archive as the resolvers see it: the tag stream (mapped directly, or behind LZ frames), the checkpoints of
+// its .idx (read on the first range request), and where a full restore currently goes.
+typedef struct { uint64_t opos, zpos; } SeekPoint;
+typedef struct { uint64_t from, to, at; } SourceRange; // Output bytes [from, to) some tag copies, kept at 'at' while streaming
 
-    // 1. Open and Map Input
-    int fd_in = open(argv[1], O_RDONLY);
-    if (fd_in < 0) { perror("Input error"); return 1; }
-    struct stat sb;
-    fstat(fd_in, &sb);
-    uint8_t* in_map = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd_in, 0);
+struct ZirkaArchive {
+    int fd;                 // -1 for a caller's buffer
+    bool own_fd, own_map;
+    uint8_t* map;
+    uint64_t size;
+    uint64_t head;          // Bytes of the format marker in front of everything else (0: a v7 archive)
+    uint32_t format;        // FORMAT_* flags of the marker
+    bool long_tags;         // The tag stream may hold LONG_TAG_SIZE tags
+    bool lz;
+    uint32_t block;
+    uint64_t nframes;
+    uint64_t* frame;        // File offset of each frame header
+    uint64_t stream_size;   // Tag-stream bytes (raw, for --lz archives)
+    bool has_sum;           // The archive ends with a checksum footer
+    uint64_t sum[2];
+    uint32_t sum_leaf;
+    SeekPoint* seek;
+    uint64_t nseek, restored_size;
+    uint8_t* cache[SEEK_CACHE];
+    uint64_t cache_frame[SEEK_CACHE];
+    int cache_next;
+    uint64_t parsed, followed; // Range statistics
+    char idx_path[600];     // "" = no seek index, scan for checkpoints
+    // Options
+    int threads;
+    FILE* log;
+    zirka_progress_fn progress_fn;
+    void* progress_user;
+    bool verify;
+    bool reflink;           // Turned off by the first refusal of the file system
+    bool kernel_copy;
+    uint64_t clone_block, cloned, kernel_copied;
+    uint64_t* leaves;       // --verify: hashes of the output leaves restored so far (2 words each, + the sizes)
+    uint64_t leaves_cap, leaves_done;
+    // Full restore: into a growing mapping of 'out_fd', or into the caller's 'out_cap' bytes at 'out_map'.
+    // Streaming: 'out_map' is a window holding output bytes [out_base, opos) until they are written to 'out_fd'.
+    int out_fd;
+    bool out_fixed;
+    uint8_t* out_map;
+    uint64_t out_cap, opos, out_base;
+    SourceRange* src;       // Streaming: what the tags reference, sorted and merged
+    uint64_t nsrc, src_cap, src_next, synced;
+    uint8_t* keep;          // The referenced bytes in RAM, or NULL when they live in 'keep_fd'
+    int keep_fd;
+    uint64_t keep_limit;
+    char keep_dir[512];
+    ZirkaStats stats;
+    char error[512];
+};
 
-    // 2. Prepare Output
-    char out_name[512];
-    snprintf(out_name, 512, "%s.restored", argv[1]);
-    int fd_out = open(out_name, O_RDWR | O_CREAT | O_TRUNC, 0666);
-    
-    // Initial 1GB allocation (will grow if needed)
-    uint64_t out_cap = INITIAL_OUTPUT_SIZE;
-    ftruncate(fd_out, out_cap);
-    uint8_t* out_map = mmap(NULL, out_cap, PROT_READ | PROT_WRITE, MAP_SHARED, fd_out, 0);
+static void dlog(ZirkaArchive* z, const char* fmt, ...) {
+    if (!z->log) return;
+    va_list ap;
+    va_start(ap, fmt);
+    vfprintf(z->log, fmt, ap);
+    va_end(ap);
+}
+
+// Records what went wrong for zirka_archive_error()
+static int archive_fail(ZirkaArchive* z, const char* fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(z->error, sizeof(z->error), fmt, ap);
+    va_end(ap);
+    return ZIRKA_ERROR;
+}
 
-    uint64_t ipos = 0, opos = 0, hits = 0;
+// --- TAG RESOLUTION ---
+// Grows the output mapping until 'need' bytes fit. A caller's buffer cannot grow: false once it is full.
+static bool out_reserve(ZirkaArchive* z, uint64_t need) {
+    while (need > z->out_cap) {
+        if (z->out_fixed) { archive_fail(z, "The output buffer is too small (%lu bytes)", z->out_cap); return false; }
+        uint64_t old_cap = z->out_cap;
+        z->out_cap *= 2;
+        munmap(z->out_map, old_cap);
+        z->out_map = MAP_FAILED;
+        if (ftruncate(z->out_fd, z->out_cap) == -1) { archive_fail(z, "Output: %s", strerror(errno)); return false; }
+        z->out_map = mmap(NULL, z->out_cap, PROT_READ | PROT_WRITE, MAP_SHARED, z->out_fd, 0);
+        if (z->out_map == MAP_FAILED) { archive_fail(z, "Output: %s", strerror(errno)); return false; }
+    }
+    return true;
+}
+
+// Decides what the tag stream of 'z' holds at 'p' ('rest' bytes left in it) once 'opos' bytes are restored.
+// Returns the bytes it takes: 1 for a literal, TAG_SIZE or LONG_TAG_SIZE for a tag copying '*len' bytes from '*off',
+// TAG_SIZE with '*len' = 1 for an escaped literal 255 (the marker's leading tag), 0 for a tag copying bytes not restored yet.
+static inline uint64_t parse_token(const ZirkaArchive* z, const uint8_t* p, uint64_t rest, uint64_t opos, uint64_t* off, uint64_t* len) {
     uint32_t chk[4];
+    // Check for Magic Tag
+    if (p[0] == MAGIC_BYTE && rest >= TAG_SIZE) {
+        uint64_t match_off;
+        uint32_t expected_hash;
+        
+        // Read the 8-byte offset and 4-byte hash from the .zirka file
+        memcpy(&match_off, p + 1, 8);
+        memcpy(&expected_hash, p + 9, 4);
 
-    printf("[Zirka v7 Restorer] Processing %s...\n", argv[1]);
+        // VERIFICATION: Hash the OFFSET, not the data
+        //if (calc_fnv_off(match_off) == expected_hash) {
+        FNV1A_Pippip_Yurii_OOO_128bit_AES_TriXZi_Mikayla_forte((const char *)&match_off, 8, 0, chk);
+        if (chk[0] == expected_hash) {
+            uint64_t escape;
+            memcpy(&escape, FORMAT_MAGIC, 8);
+            *len = 1;
+            if (z->head && match_off == escape) return TAG_SIZE;
+            if (match_off > opos || opos - match_off < CHUNK_SIZE) return 0;
+            *off = match_off;
+            *len = CHUNK_SIZE;
+            return TAG_SIZE;
+        }
 
-    while (ipos < sb.st_size) {
-        // Resize check
-        if (opos + CHUNK_SIZE >= out_cap) {
-            uint64_t old_cap = out_cap;
-            out_cap *= 2;
-            ftruncate(fd_out, out_cap);
-            munmap(out_map, old_cap);
-            out_map = mmap(NULL, out_cap, PROT_READ | PROT_WRITE, MAP_SHARED, fd_out, 0);
-        }
-
-        // Check for Magic Tag
-        if (in_map[ipos] == MAGIC_BYTE && ipos + 13 <= sb.st_size) {
-            uint64_t match_off;
-            uint32_t expected_hash;
-            
-            // Read the 8-byte offset and 4-byte hash from the .zirka file
-            memcpy(&match_off, &in_map[ipos + 1], 8);
-            memcpy(&expected_hash, &in_map[ipos + 9], 4);
-
-            // VERIFICATION: Hash the OFFSET, not the data
-            //if (calc_fnv_off(match_off) == expected_hash) {
-            FNV1A_Pippip_Yurii_OOO_128bit_AES_TriXZi_Mikayla_forte((const char *)&match_off, 8, 0, chk);
+        // Extended match: the checksum covers offset and length (the encoder never lets it pass as a short tag,
+        // and escapes literals that would pass as either)
+        if (z->long_tags && rest >= LONG_TAG_SIZE) {
+            uint8_t key[12];
+            uint32_t len32;
+            memcpy(&len32, p + 13, 4);
+            memcpy(key, &match_off, 8);
+            memcpy(key + 8, &len32, 4);
+            FNV1A_Pippip_Yurii_OOO_128bit_AES_TriXZi_Mikayla_forte((const char *)key, 12, 0, chk);
             if (chk[0] == expected_hash) {
-                // Success! Restore the chunk from the previous output data
-                memcpy(&out_map[opos], &out_map[match_off], CHUNK_SIZE);
-                opos += CHUNK_SIZE;
-                ipos += 13;
-                hits++;
-                continue;
+                if (len32 <= CHUNK_SIZE || match_off > opos || opos - match_off < len32) return 0;
+                *off = match_off;
+                *len = len32;
+                return LONG_TAG_SIZE;
+            }
+        }
+    }
+    // Literal Byte
+    *len = 1;
+    return 1;
+}
+
+static bool sum_leaves(ZirkaArchive* z, bool final);
+
+// parse_token() refused the tag at output offset 'opos'
+static bool archive_damaged(ZirkaArchive* z, uint64_t opos) {
+    archive_fail(z, "Damaged archive: the tag at output offset %lu copies bytes not restored yet", opos);
+    return false;
+}
+
+// --- RESTORE BY REFERENCE (--reflink) ---
+// A tag copying between block-aligned places of the output file can share the source's blocks instead (FICLONERANGE on
+// XFS, btrfs, ...): no data is copied and the restored file takes no space for them. The blocks in the middle of a tag
+// qualify when the tag's distance back is a whole number of blocks; its head and tail are copied as usual. Long literal
+// runs of a plain archive go from the archive to the output by copy_file_range, inside the kernel. Whatever the file
+// systems refuse is copied through the mapping, and the first refusal turns that method off for the rest of the restore.
+// The output mapping stays coherent: both calls go through the same page cache it maps.
+static bool clone_blocks(ZirkaArchive* z, uint64_t opos, uint64_t off, uint64_t len) {
+    uint64_t b = z->clone_block;
+    if ((opos - off) % b != 0) return false;
+    uint64_t from = (opos + b - 1) / b * b, to = (opos + len) / b * b;
+    if (to <= from) return false;
+    struct file_clone_range fcr = { .src_fd = z->out_fd, .src_offset = off + (from - opos), .src_length = to - from, .dest_offset = from };
+    if (ioctl(z->out_fd, FICLONERANGE, &fcr) == -1) {
+        if (errno != EINVAL) { // EINVAL may concern just this range (e.g. past the end of a file system with larger blocks)
+            dlog(z, "Reflink unavailable (%s), copying instead.\n", strerror(errno));
+            z->reflink = false;
+        }
+        return false;
+    }
+    memcpy(&z->out_map[opos], &z->out_map[off], from - opos);
+    memcpy(&z->out_map[to], &z->out_map[off + (to - opos)], opos + len - to);
+    z->cloned += to - from;
+    return true;
+}
+
+// 'n' literals starting at 'lit' (inside the mapped archive) to output offset 'opos'
+static bool copy_literals(ZirkaArchive* z, const uint8_t* lit, uint64_t n, uint64_t opos) {
+    loff_t in = lit - z->map, out = opos;
+    while (n) {
+        ssize_t k = copy_file_range(z->fd, &in, z->out_fd, &out, n, 0);
+        if (k <= 0) {
+            if (k < 0 && errno == EINTR) continue;
+            dlog(z, "copy_file_range unavailable (%s), copying instead.\n", k ? strerror(errno) : "no progress");
+            z->kernel_copy = false;
+            memcpy(&z->out_map[out], z->map + in, n);
+            return true;
+        }
+        n -= k;
+        z->kernel_copied += k;
+    }
+    return true;
+}
+
+// Resolves tags and literals of in_map[0, size) into the output. Unless 'final', stops where a tag might run past
+// the end of what is available and reports how far it got in '*done', so the caller can carry the rest into the next piece.
+static bool restore(ZirkaArchive* z, const uint8_t* in_map, uint64_t size, bool final, uint64_t* done) {
+    uint64_t ipos = 0, opos = z->opos;
+    uint64_t end = final ? size : (size > LONG_TAG_SIZE ? size - LONG_TAG_SIZE : 0);
+    bool ok = true;
+
+    while (ipos < end) {
+        uint64_t match_off, len;
+        uint64_t step = parse_token(z, in_map + ipos, size - ipos, opos, &match_off, &len);
+        if (!step) { ok = archive_damaged(z, opos); break; }
+        if (step == 1) {
+            // The whole run of literals at once
+            uint64_t run = 1;
+            while (ipos + run < end && parse_token(z, in_map + ipos + run, size - ipos - run, opos + run, &match_off, &len) == 1) run++;
+            if (opos + run > z->out_cap && !(ok = out_reserve(z, opos + run))) break;
+            if (run >= KERNEL_COPY_MIN && z->kernel_copy) copy_literals(z, in_map + ipos, run, opos);
+            else memcpy(&z->out_map[opos], in_map + ipos, run);
+            opos += run;
+            ipos += run;
+            continue;
+        }
+        if (len == 1) { // An escaped literal 255
+            if (opos + 1 > z->out_cap && !(ok = out_reserve(z, opos + 1))) break;
+            z->out_map[opos++] = MAGIC_BYTE;
+            ipos += step;
+            continue;
+        }
+        // Resize check
+        if (opos + len > z->out_cap && !(ok = out_reserve(z, opos + len))) break;
+        // Restore the region from the previous output data
+        if (!z->reflink || len < z->clone_block || !clone_blocks(z, opos, match_off, len)) memcpy(&z->out_map[opos], &z->out_map[match_off], len);
+        opos += len;
+        ipos += step;
+        z->stats.tags++;
+        if (step == LONG_TAG_SIZE) z->stats.long_tags++;
+    }
+    z->opos = opos;
+    *done = ipos;
+    return ok && (!z->verify || sum_leaves(z, false));
+}
+
+// --- CONTENT CHECKSUM (--verify) ---
+// The encoder's tree hash over the output: every leaf is hashed as soon as it is restored (while it is still in the
+// page cache, or in the window when streaming), leaves in parallel, and the root is compared with the footer at the end.
+static bool sum_leaves(ZirkaArchive* z, bool final) {
+    uint64_t leaf = z->sum_leaf;
+    uint64_t n = final ? (z->opos + leaf - 1) / leaf : z->opos / leaf;
+    if (n + 1 > z->leaves_cap) {
+        uint64_t cap = (n + 1) * 2;
+        uint64_t* grown = realloc(z->leaves, cap * 2 * sizeof(uint64_t));
+        if (!grown) { archive_fail(z, "Checksum leaves: %s", strerror(ENOMEM)); return false; }
+        z->leaves = grown;
+        z->leaves_cap = cap;
+    }
+    #pragma omp parallel for schedule(dynamic, 1) num_threads(z->threads)
+    for (uint64_t k = z->leaves_done; k < n; k++) {
+        uint64_t from = k * leaf, to = (from + leaf < z->opos) ? from + leaf : z->opos;
+        FNV1A_Pippip_Yurii_OOO_128bit_AES_TriXZi_Mikayla_forte((const char*)z->out_map + (from - z->out_base), to - from, 0, z->leaves + 2 * k);
+    }
+    z->leaves_done = n;
+    return true;
+}
+
+static int sum_check(ZirkaArchive* z) {
+    if (!sum_leaves(z, true)) return ZIRKA_ERROR;
+    z->leaves[2 * z->leaves_done] = z->opos;
+    z->leaves[2 * z->leaves_done + 1] = z->sum_leaf;
+    FNV1A_Pippip_Yurii_OOO_128bit_AES_TriXZi_Mikayla_forte((const char*)z->leaves, (z->leaves_done + 1) * 2 * sizeof(uint64_t), 0, z->stats.checksum);
+    if (z->stats.checksum[0] != z->sum[0] || z->stats.checksum[1] != z->sum[1])
+        return archive_fail(z, "Checksum mismatch: the restored file is %016lx%016lx, the original was %016lx%016lx", z->stats.checksum[1], z->stats.checksum[0], z->sum[1], z->sum[0]);
+    return ZIRKA_OK;
+}
+
+// One pass of 'resolve' over the whole tag stream, in pieces that report progress as 'stage'
+typedef bool (*resolve_fn)(ZirkaArchive* z, const uint8_t* in_map, uint64_t size, bool final, uint64_t* done);
+
+static int archive_walk(ZirkaArchive* z, resolve_fn resolve, const char* stage) {
+    uint64_t done;
+    if (z->lz) {
+        // Framed archive: decompress batches of frames on all the threads ahead of tag resolution
+        uint64_t batch = (uint64_t)z->threads * 4;
+        uint8_t* raw = malloc(LONG_TAG_SIZE + batch * z->block);
+        uint64_t* at = malloc(batch * sizeof(uint64_t));
+        bool* bad = calloc(batch, sizeof(bool));
+        int rc = ZIRKA_OK;
+        if (!raw || !at || !bad) rc = archive_fail(z, "LZ buffers: %s", strerror(ENOMEM));
+        uint64_t carry = 0;
+
+        for (uint64_t f0 = 0; rc == ZIRKA_OK && f0 < z->nframes; f0 += batch) {
+            uint64_t nb = (z->nframes - f0 < batch) ? z->nframes - f0 : batch;
+            uint64_t fill = carry;
+            for (uint64_t k = 0; k < nb; k++) {
+                uint32_t raw_len;
+                memcpy(&raw_len, z->map + z->frame[f0 + k], 4);
+                at[k] = fill;
+                fill += raw_len;
+            }
+            #pragma omp parallel for schedule(dynamic, 1) num_threads(z->threads)
+            for (uint64_t k = 0; k < nb; k++) {
+                const uint8_t* fr = z->map + z->frame[f0 + k];
+                uint32_t raw_len, stored;
+                memcpy(&raw_len, fr, 4);
+                memcpy(&stored, fr + 4, 4);
+                if (stored == raw_len) memcpy(raw + at[k], fr + 8, raw_len);
+                else bad[k] = !lz_decompress(fr + 8, stored, raw + at[k], raw_len);
             }
+            for (uint64_t k = 0; rc == ZIRKA_OK && k < nb; k++) if (bad[k]) rc = archive_fail(z, "Corrupt LZ frame %lu", f0 + k);
+            if (rc != ZIRKA_OK || !resolve(z, raw, fill, f0 + nb == z->nframes, &done)) { rc = ZIRKA_ERROR; break; }
+            carry = fill - done; // At most one tag's worth, moved in front of the next batch
+            memmove(raw, raw + done, carry);
+            if (z->progress_fn) z->progress_fn(z->progress_user, stage, f0 + nb, z->nframes);
+        }
+        free(raw);
+        free(at);
+        free(bad);
+        return rc;
+    }
+    // In pieces, only to report progress: a piece ends where the next one picks up
+    for (uint64_t ipos = 0; ipos < z->stream_size; ipos += done) {
+        uint64_t piece = (z->stream_size - ipos < RESTORE_PIECE) ? z->stream_size - ipos : RESTORE_PIECE;
+        if (!resolve(z, z->map + z->head + ipos, piece, ipos + piece == z->stream_size, &done)) return ZIRKA_ERROR;
+        if (z->progress_fn) z->progress_fn(z->progress_user, stage, ipos + done, z->stream_size);
+    }
+    return ZIRKA_OK;
+}
+
+static int decode_start(ZirkaArchive* z) {
+    z->opos = z->out_base = 0;
+    memset(&z->stats, 0, sizeof(z->stats));
+    z->stats.input_bytes = z->size;
+    z->leaves_done = 0;
+    if (z->verify && !z->has_sum) return archive_fail(z, "Nothing to verify against: the archive has no checksum (written with --no-extend or by an older encoder)");
+    if (z->lz) dlog(z, "LZ archive: %lu frames of up to %u KB, %d threads\n", z->nframes, z->block >> 10, z->threads);
+    return ZIRKA_OK;
+}
+
+// Restores the whole archive into the output set up by the caller (z->out_*)
+static int archive_decode(ZirkaArchive* z) {
+    int rc = decode_start(z);
+    if (rc == ZIRKA_OK) rc = archive_walk(z, restore, "restore");
+    if (rc != ZIRKA_OK) return rc;
+    z->stats.output_bytes = z->opos;
+    return z->verify ? sum_check(z) : ZIRKA_OK;
+}
+
+// --- STREAMING RESTORE (--stdout) ---
+// A full restore copies from anywhere in what it has written so far, so it keeps the whole output mapped. Streaming
+// parses the tag stream twice instead: the first pass collects the source range of every tag, the second writes the
+// output strictly in order through a window and keeps only the bytes inside those ranges (in RAM up to 'keep_limit',
+// else in an unlinked temp file). Memory follows the referenced working set, and the output may be a pipe.
+
+// First pass: the source range of every tag (a run of tags copying on from where the last one ended is one range)
+static bool scan_sources(ZirkaArchive* z, const uint8_t* in_map, uint64_t size, bool final, uint64_t* done) {
+    uint64_t ipos = 0, opos = z->opos;
+    uint64_t end = final ? size : (size > LONG_TAG_SIZE ? size - LONG_TAG_SIZE : 0);
+    bool ok = true;
+
+    while (ipos < end) {
+        uint64_t match_off, len;
+        uint64_t step = parse_token(z, in_map + ipos, size - ipos, opos, &match_off, &len);
+        if (!step) { ok = archive_damaged(z, opos); break; }
+        if (len > 1) {
+            SourceRange* last = z->nsrc ? &z->src[z->nsrc - 1] : NULL;
+            if (last && match_off >= last->from && match_off <= last->to) {
+                if (match_off + len > last->to) last->to = match_off + len;
+            } else {
+                if (z->nsrc == z->src_cap) {
+                    uint64_t cap = z->src_cap ? z->src_cap * 2 : 4096;
+                    SourceRange* grown = realloc(z->src, cap * sizeof(SourceRange));
+                    if (!grown) { ok = false; archive_fail(z, "Source ranges: %s", strerror(ENOMEM)); break; }
+                    z->src = grown;
+                    z->src_cap = cap;
+                }
+                z->src[z->nsrc++] = (SourceRange){ match_off, match_off + len, 0 };
+            }
+        }
+        opos += len;
+        ipos += step;
+    }
+    z->opos = opos;
+    *done = ipos;
+    return ok;
+}
+
+static int source_cmp(const void* a, const void* b) {
+    uint64_t x = ((const SourceRange*)a)->from, y = ((const SourceRange*)b)->from;
+    return (x > y) - (x < y);
+}
+
+// Sorts and merges the ranges and lays them out back to back in the cache; returns its size
+static uint64_t keep_layout(ZirkaArchive* z) {
+    uint64_t n = 0, at = 0;
+    qsort(z->src, z->nsrc, sizeof(SourceRange), source_cmp);
+    for (uint64_t i = 0; i < z->nsrc; i++) {
+        if (n && z->src[i].from <= z->src[n - 1].to) {
+            if (z->src[i].to > z->src[n - 1].to) z->src[n - 1].to = z->src[i].to;
+        } else {
+            z->src[n++] = z->src[i];
         }
+    }
+    z->nsrc = n;
+    for (uint64_t i = 0; i < n; i++) {
+        z->src[i].at = at;
+        at += z->src[i].to - z->src[i].from;
+    }
+    return at;
+}
 
-        // Literal Byte
-        out_map[opos++] = in_map[ipos++];
+// Moves 'n' bytes between 'buf' and the cache at 'at' ('put': into the cache)
+static bool keep_io(ZirkaArchive* z, uint8_t* buf, uint64_t n, uint64_t at, bool put) {
+    if (z->keep) {
+        if (put) memcpy(z->keep + at, buf, n); else memcpy(buf, z->keep + at, n);
+        return true;
+    }
+    while (n) {
+        ssize_t k = put ? pwrite(z->keep_fd, buf, n, at) : pread(z->keep_fd, buf, n, at);
+        if (k < 0 && errno == EINTR) continue;
+        if (k <= 0) { archive_fail(z, "Stream cache: %s", k ? strerror(errno) : "short read"); return false; }
+        buf += k;
+        n -= k;
+        at += k;
     }
+    return true;
+}
 
-    printf("\nRestoration Complete.\n");
-    printf("Dedup Tags Processed: %lu\n", hits);
-    printf("Final File Size: %lu bytes\n", opos);
+// Copies the referenced bytes among those restored since the last call from the window into the cache
+static bool keep_sync(ZirkaArchive* z) {
+    uint64_t from = z->synced;
+    while (z->src_next < z->nsrc && from < z->opos) {
+        const SourceRange* r = &z->src[z->src_next];
+        if (r->to <= from) { z->src_next++; continue; }
+        uint64_t a = (r->from > from) ? r->from : from;
+        if (a >= z->opos) break;
+        uint64_t b = (r->to < z->opos) ? r->to : z->opos;
+        if (!keep_io(z, z->out_map + (a - z->out_base), b - a, r->at + (a - r->from), true)) return false;
+        from = b;
+    }
+    z->synced = z->opos;
+    return true;
+}
+
+// Writes out the window (full, except for the last one)
+static bool stream_flush(ZirkaArchive* z, bool final) {
+    if (!keep_sync(z) || (z->verify && !sum_leaves(z, final))) return false;
+    const uint8_t* p = z->out_map;
+    uint64_t n = z->opos - z->out_base;
+    while (n) {
+        ssize_t k = write(z->out_fd, p, n);
+        if (k < 0 && errno == EINTR) continue;
+        if (k <= 0) { archive_fail(z, "Output: %s", k ? strerror(errno) : "nothing written"); return false; }
+        p += k;
+        n -= k;
+    }
+    z->out_base = z->opos;
+    return true;
+}
+
+// Second pass: restore() into the window, copying tags out of the cache
+static bool stream_restore(ZirkaArchive* z, const uint8_t* in_map, uint64_t size, bool final, uint64_t* done) {
+    uint64_t ipos = 0, opos = z->opos, limit = z->out_base + z->out_cap;
+    uint64_t end = final ? size : (size > LONG_TAG_SIZE ? size - LONG_TAG_SIZE : 0);
+    bool ok = true;
 
+    while (ipos < end) {
+        uint64_t match_off, len;
+        uint64_t step = parse_token(z, in_map + ipos, size - ipos, opos, &match_off, &len);
+        if (!step) { ok = archive_damaged(z, opos); break; }
+        if (len == 1) { // A literal, escaped or not
+            if (opos == limit) {
+                z->opos = opos;
+                if (!(ok = stream_flush(z, false))) break;
+                limit = z->out_base + z->out_cap;
+            }
+            z->out_map[opos++ - z->out_base] = in_map[ipos];
+            ipos += step;
+            continue;
+        }
+        // The first pass saw this tag too, so its source lies inside one kept range
+        z->opos = opos;
+        if (!(ok = keep_sync(z))) break;
+        uint64_t lo = 0, hi = z->nsrc;
+        while (hi - lo > 1) {
+            uint64_t mid = (lo + hi) / 2;
+            if (z->src[mid].from <= match_off) lo = mid; else hi = mid;
+        }
+        const SourceRange* r = &z->src[lo];
+        for (uint64_t got = 0; ok && got < len; ) {
+            if (z->opos == limit) {
+                if (!(ok = stream_flush(z, false))) break;
+                limit = z->out_base + z->out_cap;
+            }
+            uint64_t n = (len - got < limit - z->opos) ? len - got : limit - z->opos;
+            ok = keep_io(z, z->out_map + (z->opos - z->out_base), n, r->at + (match_off + got - r->from), false);
+            z->opos += n;
+            got += n;
+        }
+        if (!ok) break;
+        opos = z->opos;
+        ipos += step;
+        z->stats.tags++;
+        if (step == LONG_TAG_SIZE) z->stats.long_tags++;
+    }
+    z->opos = opos;
+    *done = ipos;
+    return ok;
+}
+
+// Both passes, into z->out_fd
+static int stream_decode(ZirkaArchive* z) {
+    int rc = decode_start(z);
+    if (rc != ZIRKA_OK) return rc;
+    z->nsrc = z->src_next = z->synced = 0;
+    rc = archive_walk(z, scan_sources, "scan");
+    if (rc != ZIRKA_OK) return rc;
+    uint64_t kept = keep_layout(z);
+
+    // The window holds whole checksum leaves, so every flush but the last hashes complete ones
+    uint64_t window = STREAM_WINDOW;
+    if (z->has_sum && window % z->sum_leaf) window += z->sum_leaf - window % z->sum_leaf;
+    z->out_map = malloc(window);
+    z->out_cap = window;
+    z->keep = NULL;
+    z->keep_fd = -1;
+    if (!z->out_map) return archive_fail(z, "Stream window: %s", strerror(ENOMEM));
+    if (kept <= z->keep_limit) z->keep = malloc(kept ? kept : 1);
+    if (!z->keep) {
+        char name[600];
+        snprintf(name, sizeof(name), "%s/zirka_keep_XXXXXX", z->keep_dir);
+        z->keep_fd = mkstemp(name);
+        if (z->keep_fd < 0) rc = archive_fail(z, "Stream cache %s: %s", name, strerror(errno));
+        else {
+            unlink(name); // Gone with the descriptor
+            if (ftruncate(z->keep_fd, kept) == -1) rc = archive_fail(z, "Stream cache %s: %s", name, strerror(errno));
+        }
+    }
+    if (rc == ZIRKA_OK) {
+        if (z->keep) dlog(z, "Streaming: %lu referenced ranges, %.1f MB kept in RAM\n", z->nsrc, kept / (1024.0 * 1024.0));
+        else dlog(z, "Streaming: %lu referenced ranges, %.1f MB kept in a temp file in %s\n", z->nsrc, kept / (1024.0 * 1024.0), z->keep_dir);
+        z->opos = 0;
+        rc = archive_walk(z, stream_restore, "restore");
+    }
+    if (rc == ZIRKA_OK && !stream_flush(z, true)) rc = ZIRKA_ERROR;
+    free(z->out_map);
+    z->out_map = NULL;
+    free(z->keep);
+    z->keep = NULL;
+    if (z->keep_fd >= 0) close(z->keep_fd);
+    z->keep_fd = -1;
+    if (rc != ZIRKA_OK) return rc;
+    z->stats.output_bytes = z->opos;
+    return z->verify ? sum_check(z) : ZIRKA_OK;
+}
+
+// --- SEEKABLE ARCHIVES (--range) ---
+// Tag-stream bytes at 'zpos': a pointer and how many of them are contiguous there
+static const uint8_t* stream_at(ZirkaArchive* z, uint64_t zpos, uint64_t* avail) {
+    if (!z->lz) { *avail = z->stream_size - zpos; return z->map + z->head + zpos; }
+    uint64_t f = zpos / z->block;
+    int c = 0;
+    while (c < SEEK_CACHE && z->cache_frame[c] != f) c++;
+    if (c == SEEK_CACHE) {
+        c = z->cache_next;
+        z->cache_next = (z->cache_next + 1) % SEEK_CACHE;
+        if (!z->cache[c]) z->cache[c] = malloc(z->block);
+        const uint8_t* fr = z->map + z->frame[f];
+        uint32_t raw_len, stored;
+        memcpy(&raw_len, fr, 4);
+        memcpy(&stored, fr + 4, 4);
+        z->cache_frame[c] = UINT64_MAX;
+        if (stored == raw_len) memcpy(z->cache[c], fr + 8, raw_len);
+        else if (!lz_decompress(fr + 8, stored, z->cache[c], raw_len)) { *avail = 0; return NULL; }
+        z->cache_frame[c] = f;
+    }
+    uint64_t in = zpos - f * z->block;
+    uint64_t raw_len = (f + 1 < z->nframes) ? z->block : z->stream_size - f * z->block;
+    *avail = raw_len - in;
+    return z->cache[c] + in;
+}
+
+// parse_token() at 'zpos', with a tag straddling two frames stitched together first
+static uint64_t stream_token(ZirkaArchive* z, uint64_t zpos, uint64_t o, uint64_t* off, uint64_t* len, uint8_t* lit) {
+    uint8_t tmp[LONG_TAG_SIZE];
+    uint64_t avail, rest = z->stream_size - zpos;
+    const uint8_t* p = stream_at(z, zpos, &avail);
+    if (!p) return 0;
+    if (avail < LONG_TAG_SIZE && avail < rest) {
+        uint64_t want = (rest < LONG_TAG_SIZE) ? rest : LONG_TAG_SIZE;
+        for (uint64_t got = 0; got < want; got += avail) {
+            p = stream_at(z, zpos + got, &avail);
+            if (!p) return 0;
+            if (avail > want - got) avail = want - got;
+            memcpy(tmp + got, p, avail);
+        }
+        p = tmp;
+    }
+    *lit = p[0];
+    return parse_token(z, p, rest, o, off, len);
+}
+
+// Loads <archive>.idx (or the index given to zirka_use_index), or builds the checkpoints with one pass over the tag stream when there is none
+static bool zirka_index(ZirkaArchive* z) {
+    const char* name = z->idx_path;
+    FILE* f = name[0] ? fopen(name, "rb") : NULL;
+    if (f) {
+        char magic[8];
+        uint64_t interval;
+        fseek(f, 0, SEEK_END);
+        long bytes = ftell(f);
+        fseek(f, 0, SEEK_SET);
+        uint64_t n = (bytes >= 16 + 16) ? (uint64_t)(bytes - 16) / 16 : 0;
+        z->seek = malloc((n ? n : 1) * sizeof(SeekPoint));
+        bool ok = n && fread(magic, 1, 8, f) == 8 && memcmp(magic, SEEK_MAGIC, 8) == 0 && fread(&interval, 8, 1, f) == 1 && fread(z->seek, sizeof(SeekPoint), n, f) == n;
+        fclose(f);
+        if (ok) {
+            z->nseek = n - 1; // The last pair holds the sizes
+            z->restored_size = z->seek[n - 1].opos;
+            for (uint64_t i = 0; ok && i < n; i++) ok = z->seek[i].zpos <= z->stream_size && (i == 0 || z->seek[i].opos >= z->seek[i - 1].opos);
+            ok = ok && z->seek[n - 1].zpos == z->stream_size && z->nseek > 0 && z->seek[0].opos == 0;
+        }
+        if (ok) return true;
+        dlog(z, "%s does not match the archive, scanning it instead.\n", name);
+        free(z->seek);
+        z->seek = NULL;
+    } else if (name[0]) {
+        dlog(z, "No %s (encode with --seekable), scanning the archive for checkpoints.\n", name);
+    }
+
+    uint64_t cap = 1024, o = 0, next = 0, zpos = 0;
+    z->seek = malloc(cap * sizeof(SeekPoint));
+    z->nseek = 0;
+    while (zpos < z->stream_size) {
+        uint64_t off, len;
+        uint8_t lit;
+        if (o >= next) {
+            if (z->nseek == cap) z->seek = realloc(z->seek, (cap *= 2) * sizeof(SeekPoint));
+            z->seek[z->nseek++] = (SeekPoint){ o, zpos };
+            next = o + SEEK_SCAN_INTERVAL;
+        }
+        uint64_t step = stream_token(z, zpos, o, &off, &len, &lit);
+        if (!step) return false;
+        zpos += step;
+        o += len;
+    }
+    z->restored_size = o;
+    return true;
+}
+
+// Restores [start, start + len) into 'dst': parse from the closest checkpoint, and restore the source of every
+// tag overlapping the range the same way (sources always lie before the tag, so this ends).
+static bool range_resolve(ZirkaArchive* z, uint64_t start, uint64_t len, uint8_t* dst) {
+    uint64_t lo = 0, hi = z->nseek, end = start + len;
+    while (hi - lo > 1) {
+        uint64_t mid = (lo + hi) / 2;
+        if (z->seek[mid].opos <= start) lo = mid; else hi = mid;
+    }
+    uint64_t o = z->seek[lo].opos, zpos = z->seek[lo].zpos;
+    while (o < end) {
+        uint64_t off, n;
+        uint8_t lit;
+        if (zpos >= z->stream_size) return false;
+        uint64_t step = stream_token(z, zpos, o, &off, &n, &lit);
+        if (!step) return false;
+        z->parsed += step;
+        if (n == 1) {
+            if (o >= start) dst[o - start] = lit;
+        } else {
+            uint64_t a = (o > start) ? o : start, b = (o + n < end) ? o + n : end;
+            uint64_t src = off + (a - o);
+            if (a < b && src >= start) {
+                memcpy(dst + (a - start), dst + (src - start), b - a); // Already restored by this call
+            } else if (a < b) {
+                z->followed++;
+                if (!range_resolve(z, src, b - a, dst + (a - start))) return false;
+            }
+        }
+        zpos += step;
+        o += n;
+    }
+    return true;
+}
+
+// Restores 'len' bytes starting at 'start' of the original file into 'dst'.
+// ZIRKA_ERROR when the range is out of bounds or the archive is damaged.
+ZIRKA_API int zirka_read_range(ZirkaArchive* z, uint64_t start, uint64_t len, uint8_t* dst) {
+    if (!z->seek && !zirka_index(z)) return archive_fail(z, "Damaged archive: its tag stream cannot be parsed");
+    if (start > z->restored_size || len > z->restored_size - start) return archive_fail(z, "Range outside the %lu restored bytes.", z->restored_size);
+    return range_resolve(z, start, len, dst) ? ZIRKA_OK : archive_fail(z, "Range outside the %lu restored bytes, or a damaged archive.", z->restored_size);
+}
+
+ZIRKA_API int64_t zirka_restored_size(ZirkaArchive* z) {
+    if (!z->seek && !zirka_index(z)) { archive_fail(z, "Damaged archive: its tag stream cannot be parsed"); return -1; }
+    return (int64_t)z->restored_size;
+}
+
+// --- LIBRARY API (libzirka.h) ---
+static ZirkaArchive* archive_new(const ZirkaDecodeOptions* opt) {
+    ZirkaDecodeOptions def;
+    if (!opt) { zirka_decode_defaults(&def); opt = &def; }
+    ZirkaArchive* z = calloc(1, sizeof(ZirkaArchive));
+    if (!z) return NULL;
+    z->fd = z->out_fd = -1;
+    z->threads = (opt->threads > 0) ? opt->threads : omp_get_max_threads();
+    z->log = opt->log;
+    z->progress_fn = opt->progress;
+    z->progress_user = opt->progress_user;
+    z->verify = opt->verify;
+    z->reflink = opt->reflink;
+    z->keep_fd = -1;
+    z->keep_limit = opt->keep_limit ? opt->keep_limit : KEEP_LIMIT;
+    snprintf(z->keep_dir, sizeof(z->keep_dir), "%s", opt->keep_dir ? opt->keep_dir : ".");
+    for (int c = 0; c < SEEK_CACHE; c++) z->cache_frame[c] = UINT64_MAX;
+    return z;
+}
+
+// zirka_open*() failed: the reason goes to stderr unless the caller wants silence
+static ZirkaArchive* archive_refused(ZirkaArchive* z) {
+    if (z->log) fprintf(stderr, "%s\n", z->error);
+    zirka_close(z);
+    return NULL;
+}
+
+// Takes the checksum footer the format marker announces off the end; returns where the archive body ends, UINT64_MAX if the footer is damaged
+static uint64_t archive_footer(ZirkaArchive* z) {
+    const uint8_t* f = z->map + z->size - SUM_FOOTER_SIZE;
+    uint32_t chk[4], stored;
+    if (!(z->format & FORMAT_CHECKSUM)) return z->size;
+    if (z->size < z->head + SUM_FOOTER_SIZE || memcmp(f, SUM_MAGIC, 8) != 0) return UINT64_MAX;
+    FNV1A_Pippip_Yurii_OOO_128bit_AES_TriXZi_Mikayla_forte((const char*)f, 28, 0, chk);
+    memcpy(&stored, f + 28, 4);
+    memcpy(&z->sum_leaf, f + 24, 4);
+    if (chk[0] != stored || z->sum_leaf == 0) return UINT64_MAX;
+    memcpy(z->sum, f + 8, 16);
+    z->has_sum = true;
+    return z->size - SUM_FOOTER_SIZE;
+}
+
+// Reads the format marker, if the archive starts with one (a v7 archive does not)
+static bool archive_format(ZirkaArchive* z) {
+    uint32_t chk[4], stored;
+    if (z->size < FORMAT_HEADER_SIZE || z->map[0] != MAGIC_BYTE || memcmp(z->map + 1, FORMAT_MAGIC, 8) != 0) return true;
+    FNV1A_Pippip_Yurii_OOO_128bit_AES_TriXZi_Mikayla_forte((const char*)z->map + 1, 8, 0, chk);
+    memcpy(&stored, z->map + 9, 4);
+    if (chk[0] != stored) return true;
+    memcpy(&z->format, z->map + 13, 4);
+    if (z->format & ~FORMAT_KNOWN) { archive_fail(z, "Archive format %#x needs a newer decoder", z->format); return false; }
+    z->head = FORMAT_HEADER_SIZE;
+    z->long_tags = (z->format & FORMAT_LONG_TAGS) != 0;
+    return true;
+}
+
+// Locates the LZ frames of a framed archive (every one but the last holds a full block)
+static ZirkaArchive* archive_frames(ZirkaArchive* z) {
+    if (!archive_format(z)) return archive_refused(z);
+    uint64_t end = archive_footer(z);
+    if (end == UINT64_MAX) { archive_fail(z, "Corrupt checksum footer: the archive is truncated or damaged at its end"); return archive_refused(z); }
+    const uint8_t* lz = z->map + z->head;
+    z->stream_size = end - z->head;
+    if (!(z->format & FORMAT_LZ)) return z;
+    if (z->stream_size < 12 || memcmp(lz, LZ_MAGIC, 8) != 0) { archive_fail(z, "Corrupt LZ header: the format marker announces one"); return archive_refused(z); }
+    z->lz = true;
+    memcpy(&z->block, lz + 8, 4);
+    if (z->block == 0 || z->block > LZ_BLOCK_MAX) { archive_fail(z, "Corrupt LZ header: block size %u", z->block); return archive_refused(z); }
+    uint64_t cap = 1024;
+    z->frame = malloc(cap * sizeof(uint64_t));
+    z->stream_size = 0;
+    for (uint64_t p = z->head + 12; p < end; z->nframes++) {
+        uint32_t raw_len, stored;
+        if (p + 8 > end) { archive_fail(z, "Corrupt LZ frame table at %lu", p); return archive_refused(z); }
+        memcpy(&raw_len, z->map + p, 4);
+        memcpy(&stored, z->map + p + 4, 4);
+        if (raw_len == 0 || raw_len > z->block || stored > raw_len || p + 8 + stored > end || z->stream_size % z->block != 0) { archive_fail(z, "Corrupt LZ frame table at %lu", p); return archive_refused(z); }
+        if (z->nframes == cap) z->frame = realloc(z->frame, (cap *= 2) * sizeof(uint64_t));
+        if (!z->frame) { archive_fail(z, "LZ frame table: %s", strerror(ENOMEM)); return archive_refused(z); }
+        z->frame[z->nframes] = p;
+        z->stream_size += raw_len;
+        p += 8 + stored;
+    }
+    return z;
+}
+
+// Maps the archive behind 'fd' (kept open by whoever owns it)
+static ZirkaArchive* archive_map(ZirkaArchive* z) {
+    struct stat sb;
+    if (fstat(z->fd, &sb) == -1) { archive_fail(z, "Input error: %s", strerror(errno)); return archive_refused(z); }
+    z->size = sb.st_size;
+    if (z->size) {
+        z->map = mmap(NULL, z->size, PROT_READ, MAP_PRIVATE, z->fd, 0);
+        if (z->map == MAP_FAILED) { z->map = NULL; archive_fail(z, "Input error: %s", strerror(errno)); return archive_refused(z); }
+        z->own_map = true;
+    }
+    return archive_frames(z);
+}
+
+ZIRKA_API void zirka_decode_defaults(ZirkaDecodeOptions* opt) {
+    memset(opt, 0, sizeof(*opt));
+}
+
+ZIRKA_API ZirkaArchive* zirka_open(const char* path, const ZirkaDecodeOptions* opt) {
+    ZirkaArchive* z = archive_new(opt);
+    if (!z) return NULL;
+    snprintf(z->idx_path, sizeof(z->idx_path), "%s.idx", path);
+    z->fd = open(path, O_RDONLY);
+    if (z->fd < 0) { archive_fail(z, "Input error: %s", strerror(errno)); return archive_refused(z); }
+    z->own_fd = true;
+    return archive_map(z);
+}
+
+ZIRKA_API ZirkaArchive* zirka_open_fd(int fd, const ZirkaDecodeOptions* opt) {
+    ZirkaArchive* z = archive_new(opt);
+    if (!z) return NULL;
+    z->fd = fd;
+    return archive_map(z);
+}
+
+ZIRKA_API ZirkaArchive* zirka_open_buffer(const void* data, uint64_t size, const ZirkaDecodeOptions* opt) {
+    ZirkaArchive* z = archive_new(opt);
+    if (!z) return NULL;
+    z->map = (uint8_t*)data; // Only ever read
+    z->size = size;
+    return archive_frames(z);
+}
+
+ZIRKA_API int zirka_use_index(ZirkaArchive* z, const char* idx_path) {
+    snprintf(z->idx_path, sizeof(z->idx_path), "%s", idx_path);
+    free(z->seek); // Read again on the next range request
+    z->seek = NULL;
+    return ZIRKA_OK;
+}
+
+ZIRKA_API void zirka_close(ZirkaArchive* z) {
+    if (!z) return;
+    for (int c = 0; c < SEEK_CACHE; c++) free(z->cache[c]);
+    free(z->frame);
+    free(z->seek);
+    free(z->leaves);
+    free(z->src);
+    if (z->own_map) munmap(z->map, z->size);
+    if (z->own_fd) close(z->fd);
+    free(z);
+}
+
+ZIRKA_API int zirka_decode_fd(ZirkaArchive* z, int out_fd) {
+    // Initial 1GB allocation (will grow if needed)
+    z->out_fd = out_fd;
+    z->out_fixed = false;
+    bool reflink = z->reflink;
+    struct stat sb;
+    z->clone_block = (fstat(out_fd, &sb) == 0 && sb.st_blksize >= 512) ? (uint64_t)sb.st_blksize : CHUNK_SIZE;
+    z->kernel_copy = reflink && z->fd >= 0 && !z->lz; // Literals are plain bytes of the archive only without LZ frames
+    z->cloned = z->kernel_copied = 0;
+    z->out_cap = INITIAL_OUTPUT_SIZE;
+    if (ftruncate(out_fd, z->out_cap) == -1) return archive_fail(z, "Output: %s", strerror(errno));
+    z->out_map = mmap(NULL, z->out_cap, PROT_READ | PROT_WRITE, MAP_SHARED, out_fd, 0);
+    if (z->out_map == MAP_FAILED) return archive_fail(z, "Output: %s", strerror(errno));
+    int rc = archive_decode(z);
+    z->reflink = reflink;
+    if (z->out_map != MAP_FAILED) munmap(z->out_map, z->out_cap);
     // Finalize file size on disk
-    ftruncate(fd_out, opos);
-    
-    munmap(in_map, sb.st_size);
-    munmap(out_map, out_cap);
-    close(fd_in);
-    close(fd_out);
+    if (ftruncate(out_fd, z->opos) == -1 && rc == ZIRKA_OK) rc = archive_fail(z, "Output: %s", strerror(errno));
+    z->out_map = NULL;
+    z->out_fd = -1;
+    return rc;
+}
 
-    return 0;
+ZIRKA_API int zirka_decode_stream(ZirkaArchive* z, int out_fd) {
+    z->out_fd = out_fd;
+    z->out_fixed = true;
+    int rc = stream_decode(z);
+    z->out_fd = -1;
+    return rc;
+}
+
+ZIRKA_API int64_t zirka_decode_buffer(ZirkaArchive* z, void* dst, uint64_t cap) {
+    bool reflink = z->reflink;
+    z->reflink = z->kernel_copy = false; // Nothing to share blocks with
+    z->out_fd = -1;
+    z->out_fixed = true;
+    z->out_map = dst;
+    z->out_cap = cap;
+    int rc = archive_decode(z);
+    z->out_map = NULL;
+    z->reflink = reflink;
+    return (rc == ZIRKA_OK) ? (int64_t)z->opos : -1;
 }
 
+ZIRKA_API const char* zirka_archive_error(const ZirkaArchive* z) { return z->error; }
+ZIRKA_API const ZirkaStats* zirka_archive_stats(const ZirkaArchive* z) { return &z->stats; }
+
+#ifndef ZIRKA_LIBRARY
+int main(int argc, char* argv[]) {
+    const char* path = NULL;
+    const char* range = NULL;
+    bool verify = false, stream = false, to_stdout = false, reflink = false;
+    uint64_t keep_mb = 0;
+    const char* keep_dir = NULL;
+    for (int a = 1; a < argc; a++) {
+        if (strcmp(argv[a], "--range") == 0 && a + 1 < argc) range = argv[++a];
+        else if (strcmp(argv[a], "--verify") == 0) verify = true;
+        else if (strcmp(argv[a], "--stream") == 0) stream = true;
+        else if (strcmp(argv[a], "--stdout") == 0) stream = to_stdout = true;
+        else if (strcmp(argv[a], "--reflink") == 0) reflink = true;
+        else if (strcmp(argv[a], "--keep-mb") == 0 && a + 1 < argc) keep_mb = strtoull(argv[++a], NULL, 10);
+        else if (strcmp(argv[a], "--keep-dir") == 0 && a + 1 < argc) keep_dir = argv[++a];
+        else path = argv[a];
+    }
+    if (!path) {
+        printf("Usage: %s [--verify] [--range START:LEN] [--stream | --stdout | --reflink] [--keep-mb N] [--keep-dir DIR] <file.zirka>\n", argv[0]);
+        printf("  --stream      Write the output sequentially, keeping only the parts tags refer to (RSS follows those)\n");
+        printf("  --stdout      Same, to stdout (reports go to stderr)\n");
+        printf("  --reflink     Share aligned blocks of matches (XFS, btrfs) and copy long literal runs in the kernel (full restore only)\n");
+        printf("  --keep-mb N   RAM for the referenced parts before they go to a temp file (default %llu)\n", KEEP_LIMIT >> 20);
+        printf("  --keep-dir D  Directory of that temp file (default .)\n");
+        return 1;
+    }
+    if (reflink && (stream || range)) {
+        fprintf(stderr, "--reflink shares blocks within the restored file: it cannot go with --stream, --stdout or --range\n");
+        return 1;
+    }
+    FILE* log = to_stdout ? stderr : stdout;
+
+    // 1. Open and Map Input
+    ZirkaDecodeOptions opt;
+    zirka_decode_defaults(&opt);
+    opt.log = log;
+    opt.verify = verify && !range;
+    opt.keep_limit = keep_mb << 20;
+    opt.keep_dir = keep_dir;
+    opt.reflink = reflink;
+    ZirkaArchive* z = zirka_open(path, &opt);
+    if (!z) return 1;
+
+    if (range) {
+        // Partial restore: work proportional to the range and what it references, written to <file.zirka>.range
+        char* colon;
+        uint64_t start = strtoull(range, &colon, 10);
+        if (*colon != ':') { printf("--range wants START:LEN\n"); return 1; }
+        uint64_t len = strtoull(colon + 1, NULL, 10);
+        uint8_t* buf = malloc(len ? len : 1);
+        if (!buf) { perror("Range buffer"); return 1; }
+        printf("[Zirka v7 Restorer] Restoring bytes %lu..%lu of %s...\n", start, start + len, path);
+        if (zirka_read_range(z, start, len, buf) != ZIRKA_OK) { printf("%s\n", zirka_archive_error(z)); return 1; }
+        char out_name[512];
+        snprintf(out_name, 512, "%s.range", path);
+        FILE* f = fopen(out_name, "wb");
+        if (!f) { perror(out_name); return 1; }
+        fwrite(buf, 1, len, f);
+        fclose(f);
+        printf("Range Complete: %lu bytes to %s (%lu checkpoints, %.1f KB of tag stream parsed, %lu references followed)\n", len, out_name, z->nseek, z->parsed / 1024.0, z->followed);
+        free(buf);
+        zirka_close(z);
+        return 0;
+    }
+
+    // 2. Prepare Output
+    char out_name[512];
+    snprintf(out_name, 512, "%s.restored", path);
+    int fd_out = to_stdout ? STDOUT_FILENO : open(out_name, O_RDWR | O_CREAT | O_TRUNC, 0666);
+    if (fd_out == -1) { perror(out_name); return 1; }
+
+    fprintf(log, "[Zirka v7 Restorer] Processing %s...\n", path);
+    int rc = stream ? zirka_decode_stream(z, fd_out) : zirka_decode_fd(z, fd_out);
+    if (!to_stdout) close(fd_out);
+    if (rc != ZIRKA_OK) { fprintf(log, "%s\n", zirka_archive_error(z)); zirka_close(z); return rc; }
+
+    const ZirkaStats* st = zirka_archive_stats(z);
+    fprintf(log, "\nRestoration Complete.\n");
+    fprintf(log, "Dedup Tags Processed: %lu (%lu extended)\n", st->tags, st->long_tags);
+    fprintf(log, "Final File Size: %lu bytes\n", st->output_bytes);
+    if (opt.reflink) fprintf(log, "Reflinked: %.1f MB, copy_file_range: %.1f MB\n", z->cloned / (1024.0 * 1024.0), z->kernel_copied / (1024.0 * 1024.0));
+    if (verify) fprintf(log, "Checksum Verified: %016lx%016lx\n", st->checksum[1], st->checksum[0]);
+    zirka_close(z);
+
+    return 0;
+}
+#endif
@@ -1,5 +1,6 @@
 // v7++ (in addition to v7, sorted progress bar was added; fnv replaced with Pippip; TO-DO: use memcmp on DiskEntry)
-// $ clang -O3 -msse4.2 -maes -fopenmp FastZirka_v7++_Final.c -o FastZirka_v7++_Final -DrankmapSERIAL
+// $ clang -O3 -msse4.2 -maes -fopenmp FastZirka_v7++_Final.c -o FastZirka_v7++_Final
+// (every pipeline is built in and picked with --engine; -DrankmapSERIAL, -Drankmap, -DrankmapFIRST or -DBS only set the default)
 
 /*
 Zirka v7: Original & Unique Features
@@ -30,7 +31,7 @@ Stage 4 (Applying): The "Nuclear" application is sharded, allowing multiple thre
 
 - Forgoing Standard `qsort()`
 Custom Engine: Zirka v7 abandons the standard C library `qsort()` because it is single-threaded.
-Solution: Implements a custom In-Place Parallel Quicksort (`omp_quicksort`). This algorithm creates OpenMP tasks for partitions, allowing the sorting of billion-entry arrays to be distributed dynamically across all CPU threads.
+Solution: Implements a custom In-Place Parallel Samplesort (`samplesort_index`). Each step splits a range into up to 256 buckets with oversampled splitters and block permutation, and the buckets are shared out through work-stealing deques, allowing the sorting of billion-entry arrays to be distributed dynamically across all CPU threads.
 
 - Hardware-Accelerated "Pip-Pip" Hashing
 Method: Implements the `FNV1A_Pippip_128` algorithm, manually written with SSE4.2 and AES-NI intrinsics.
@@ -46,22 +47,37 @@ Strategic Value: This deliberately avoids "eating" the short-range matches that
 Synergy: By handling the "Heavy Lifting" (deduplicating matches that are e.g. 25GB apart), Zirka clears the path for the backend LZ compressor to focus entirely on its strength: hyper-efficient bit-packing of local, short-range redundancies.
 */
 
+#define _GNU_SOURCE // O_DIRECT
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <stddef.h>
 #include <string.h>
 #include <stdbool.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include <linux/io_uring.h>
+#include <sys/uio.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
 #include <immintrin.h>
 #include <omp.h> // OPENMP
+#include <setjmp.h>
+#include <stdarg.h>
+#include "libzirka.h"
 
 #define VERSION 7
 #define CHUNK_SIZE 4096 //384 //4096 //256
 #define MAGIC_BYTE 255
-#define SORT_THRESHOLD 4096 // Items below this count use serial qsort
+#define SORT_THRESHOLD 4096 // Ranges up to this count end in the samplesort's leaf sort
 #define NULL_RANK 0xFFFFFFFFFFFFFFFFULL
 
 // --- PIPPIP HASH IMPLEMENTATION ---
@@ -74,11 +90,144 @@ Synergy: By handling the "Heavy Lifting" (deduplicating matches that are e.g. 25
 #define SHA1_DIGEST_SIZE 20
         #endif
 
-int g_max_threads_used = 0;
-int g_total_tasks = 0;
-long long SortedSoFar = 0;
-uint64_t entry_count = 0;
-uint64_t update_count = 0;
+// --- ENCODER CONTEXT (libzirka.h) ---
+// Everything a job shares between its stages lives in its ZirkaEncoder: the options it was created with and its run state.
+// Encoders do not share anything but the pool of I/O threads, so a process may run several jobs at once (one per thread).
+// Library code reports through zlog() (stdout for the CLI, nothing for a silent job) and gives up through zfail().
+#define MAX_TMP_DIRS 16
+#define MAX_ARTIFACTS 8
+#define MAX_QUEUES 8
+
+typedef struct {
+    const char* dirs[MAX_TMP_DIRS];
+    int ndirs;
+    const char* prefix; // Prepended to the file names, so that jobs can share a directory
+} TempDirs;
+
+// Bytes moved by the storage layer during the current stage, and the requests in flight over time (see ASYNC I/O ENGINE)
+typedef struct {
+    uint64_t bytes;
+    double t0, t_last, qd_area;
+    unsigned qd, qd_max;
+} StageIo;
+
+struct ZirkaEncoder {
+    // Options
+    FILE* log;
+    zirka_progress_fn progress_fn;
+    void* progress_user;
+    int threads;
+    char* tmp_lists[4];             // Copies of --tmp, --tmp-index, --tmp-updates, --tmp-rank
+    char* tmp_parsed[4];            // The copies the TempDirs point into (cut up by parse_tmp_dirs)
+    char tmp_prefix[64];
+    bool own_prefix;                // Generated: nobody can resume the job, so a failing one removes its temp files
+    bool layout_done;
+    TempDirs tmp_index, tmp_updates, tmp_rank;
+    uint64_t stripe_unit;
+    double disk_mbps;
+    int shards_requested;
+    int join;                       // Stage 2 of the shards: JOIN_SORT or JOIN_HASH (see HASH JOIN)
+    int pipeline_requested;         // --engine: PIPELINE_AUTO or the one to run (see PIPELINES)
+    uint64_t rss_limit;             // Bytes, 0 = no governor (the kernel manages paging)
+    char* metrics_path;
+    bool extend;                    // false: 4096-byte tags only, readable by v7 decoders
+    bool lz;
+    bool tar;                       // Index the data blocks of tar members only (see TAR-AWARE INDEXING)
+    bool align_refs;                // Prefer block-aligned sources (see BLOCK-ALIGNED REFERENCES)
+    bool prune;                     // Nuclear: drop the updates Stage 4's parse never looks at (see PARSE-AWARE PRUNING)
+    uint64_t seek_interval;         // 0 = no index
+    int io_backend, io_engine, io_depth;
+    uint64_t io_block;
+    int numa_mode;
+    bool resume, plan_only, force;
+
+    // The job: its input (mapped, or the caller's buffer), and where the archive goes
+    const char* name;
+    int in_fd;                      // -1 = memory only
+    const uint8_t* buffer;
+    uint64_t filesize;
+    bool mapped;                    // 'buffer' is our mapping of 'in_fd'
+    struct stat sb;
+    char out_dir[1024];             // Planned with the temp devices, "" = unknown (descriptor or buffer jobs)
+    char out_path[1040];            // File jobs open 'fout' (and 'fidx') when Stage 4 starts, see open_outputs()
+    FILE* fout;
+    FILE* fidx;
+
+    // Run state
+    int max_threads_used;
+    int total_tasks;
+    long long sorted_so_far;
+    int pipeline;                   // The one this job runs ('auto' resolved by pipeline_choose, or the manifest's)
+    uint64_t entry_count;
+    uint64_t index_entries;         // Windows Stage 1 indexes: entry_count, fewer with --tar
+    struct IndexLayout* layout;
+    uint64_t update_count;
+    uint64_t run_windows;           // Windows Stage 1 left out of the index (see LOW-ENTROPY RUNS)
+    uint64_t rejected;              // Updates that failed the batched verification (see BATCHED VERIFICATION)
+    uint64_t updates_kept;          // Updates left after the parse-aware pruning (see PARSE-AWARE PRUNING)
+    uint64_t pruned;                // Updates the pruning dropped unverified: the parse never reads them
+    uint64_t* tree;                 // Leaf hashes of the content checksum, 2 words each (see CONTENT CHECKSUM)
+    uint64_t tree_leaves, tree_done;
+    int shards;
+    uint64_t shard_ram;             // Largest shard sorted in RAM, bigger ones are sorted in place via mmap
+    int bucket_shift;               // Positions per updates bucket = 1 << bucket_shift (see RANGE-BUCKETED UPDATES)
+    uint64_t bucket_count;
+    uint64_t* bucket_fill;          // Updates gathered into each bucket, checkpointed with the manifest
+    uint64_t gov_released;          // Bytes dropped from our RSS so far
+    bool gov_sort;                  // The array being sorted is file-backed, so its pages may be dropped (never an in-RAM shard)
+    struct Artifact* artifacts[MAX_ARTIFACTS];
+    int artifact_count;
+    struct IoQueue* queues[MAX_QUEUES]; // Queues with transfers that may be in flight, drained before a failing job unwinds
+    struct ShardSet* shard_set;
+    struct OutStream* out;
+    StageIo stage_io;
+    pthread_mutex_t stage_io_lock;
+    struct Metrics* metrics;
+    struct ProgressReporter* progress;
+    struct NumaLayout* numa;
+    const char* stage_name;
+    ZirkaStats stats;
+
+    // Failure
+    pthread_t owner;                // Thread running the job
+    jmp_buf fail;
+    bool armed, failing;
+    char error[512];
+};
+
+static void zlog(ZirkaEncoder* z, const char* fmt, ...) {
+    if (!z->log) return;
+    va_list ap;
+    va_start(ap, fmt);
+    vfprintf(z->log, fmt, ap);
+    va_end(ap);
+}
+
+// Non-fatal trouble (a failed msync, a manifest that could not be written), perror style unless the job is silent
+static void zwarn(ZirkaEncoder* z, const char* what) {
+    if (z->log) fprintf(stderr, "%s: %s\n", what, strerror(errno));
+}
+
+// Reports 'done' of 'total' for the stage being measured (see metrics_begin)
+static void zprogress(ZirkaEncoder* z, uint64_t done, uint64_t total) {
+    if (z->progress_fn) z->progress_fn(z->progress_user, z->stage_name ? z->stage_name : "", done, total);
+}
+
+static void encoder_abort(ZirkaEncoder* z);
+
+// Fatal error, perror style. On the thread running the job (outside a parallel region) the job's files and queues are
+// closed and zirka_encode_*() returns ZIRKA_ERROR; worker threads cannot unwind the job, they print it and exit.
+static void zfail(ZirkaEncoder* z, const char* what) {
+    int err = errno;
+    if (!z->failing) snprintf(z->error, sizeof(z->error), "%s: %s", what, strerror(err));
+    if (z->armed && !z->failing && !omp_in_parallel() && pthread_equal(pthread_self(), z->owner)) {
+        z->failing = true;
+        encoder_abort(z);
+        longjmp(z->fail, 1);
+    }
+    fprintf(stderr, "%s: %s\n", what, strerror(err));
+    exit(1);
+}
 
 // --- SHA1 IMPLEMENTATION ---
 #define ROTL(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
@@ -148,7 +297,7 @@ static inline uint32_t fold32(uint32_t A, uint32_t B) {
 // CAUTION: Add 8 more bytes to the buffer being hashed, usually malloc(...+8) - to prevent out of boundary reads!
 // Many thanks go to Yurii 'Hordi' Hordiienko, he lessened with 3 instructions the original 'Pippip', thus:
 
-void FNV1A_Pippip_Yurii_OOO_128bit_AES_TriXZi_Mikayla_forte (const char *str, size_t wrdlen, uint32_t seed, void *output) {
+static void FNV1A_Pippip_Yurii_OOO_128bit_AES_TriXZi_Mikayla_forte (const char *str, size_t wrdlen, uint32_t seed, void *output) {
     __m128i chunkA;
     __m128i chunkA2;
     __m128i chunkB;
@@ -523,14 +672,7 @@ kl=41..48 Cycles= (kl-1)/16+1=3; MARGINAL CASES:
 // If the person is not recognizable in his works, then either the person is worthless or his works are worthless.
 // Therefore, the creative person should have no other biography than his works” (Hauschild, B. Traven: Die unbekannten Jahre, op. cit., p. 31.) 
 
-// --- FNV-1a Checksum for Verification ---
-uint32_t calc_fnv_off(uint64_t offset) {
-    uint8_t data[8]; memcpy(data, &offset, 8);
-    uint32_t h = 2166136261u;
-    for (int i=0; i<8; i++) { h^=data[i]; h*=16777619u; }
-    return h;
-}
-
+#ifndef eXdupe // SHA-1 keys the index only without eXdupe
 static const uint32_t K[4] = {
     0x5A827999, 0x6ED9EBA1, 0x8F1BBCDC, 0xCA62C1D6
 };
@@ -658,12 +800,13 @@ static void sha1_final(sha1_ctx *ctx, uint8_t *digest) {
     }
 }
 
-void sha1_sum(const void *data, size_t len, uint8_t *out) {
+static void sha1_sum(const void *data, size_t len, uint8_t *out) {
     sha1_ctx ctx;
     sha1_init(&ctx);
     sha1_update(&ctx, data, len);
     sha1_final(&ctx, out);
 }
+#endif
 
 // --- ENTRY STRUCTURE ---
 typedef struct {
@@ -674,7 +817,7 @@ typedef struct {
 
 // --- BINARY SEARCH LOGIC ---
 // Finds the lowest offset for a given hash that is smaller than current_pos
-int64_t find_match_binary(DiskEntry* index, uint64_t total_entries, uint64_t h1, uint64_t h2, uint64_t current_pos) {
+static int64_t find_match_binary(DiskEntry* index, uint64_t total_entries, uint64_t h1, uint64_t h2, uint64_t current_pos) {
     int64_t low = 0, high = (int64_t)total_entries - 1;
     int64_t result_offset = -1;
 
@@ -710,770 +853,4591 @@ int64_t find_match_binary(DiskEntry* index, uint64_t total_entries, uint64_t h1,
     return result_offset;
 }
 
-// --- SERIAL COMPARE (For small chunks) ---
-int compare_disk_serial(const void* a, const void* b) {
-    const DiskEntry* da = (const DiskEntry*)a;
-    const DiskEntry* db = (const DiskEntry*)b;
-    if (da->h2 < db->h2) return -1;
-    if (da->h2 > db->h2) return 1;
-    if (da->h1 < db->h1) return -1;
-    if (da->h1 > db->h1) return 1;
-    if (da->offset < db->offset) return -1;
-    if (da->offset > db->offset) return 1;
-    return 0;
-}
-
-// --- CUSTOM OPENMP QUICKSORT ---
-void omp_quicksort(DiskEntry* data, int64_t left, int64_t right) {
-    if (left >= right) return;
-
-    // 1. Serial Threshold: If chunk is small, avoid OMP overhead
-    if ((right - left) < SORT_THRESHOLD) {
-        qsort(data + left, right - left + 1, sizeof(DiskEntry), compare_disk_serial);
-
-    // stats [
-        #pragma omp atomic
-        SortedSoFar += (right - left + 1);
-        #pragma omp critical
-        {
-            double progress = (double)SortedSoFar / entry_count *100;
-            printf ("   Sort Progress = %.1f%%\r", progress);
-            fflush(stdout);
-        }
-    // stats ]
+// --- MEMORY GOVERNOR (RSS Ceiling) ---
+// Left alone, the kernel decides how much of the mmap'd input, index, updates and rank stays resident,
+// and a big run ends up owning the whole box. With --rss-limit every sequential phase walks its artifacts
+// through bounded windows: the next window is prefetched (MADV_WILLNEED) and consumed ones are dropped
+// from our RSS (MADV_DONTNEED; dirty shared pages stay in the page cache and are written back by the kernel).
+// The samplesort is random access and cannot be windowed: each thread's classification releases its stripe behind it,
+// and the block permutation and cleanup drop the whole range every rss_limit / 4 bytes the team touched (file-backed only).
+// What holds: the mapped artifacts stay within about the limit; the RAM buffers of the phase (I/O queues, bucket runs,
+// about 1.5 MB of sort scratch per thread) come on top. Stage 4 lookups of rankmap, first and bs are random and ungoverned.
+#define GOV_MIN_LIMIT (64ULL * 1024 * 1024) // Below it the windows get too small to stream; zirka_encoder_new() refuses
 
-        return;
+
+typedef struct {
+    void* base;
+    uint64_t size;
+    uint64_t done; // Page-aligned: everything below has been released
+} GovStream;
+
+// Elements per window for a loop touching 'bytes_per_elem' bytes per element across all its artifacts:
+// the window being worked on and the one being prefetched share the ceiling
+static uint64_t governor_window(ZirkaEncoder* z, uint64_t total, uint64_t bytes_per_elem) {
+    if (!z->rss_limit) return total ? total : 1;
+    uint64_t win = z->rss_limit / 2 / bytes_per_elem;
+    if (win < CHUNK_SIZE) win = CHUNK_SIZE;
+    return win;
+}
+
+// Releases the whole pages inside [from, to) of a mapping
+static void governor_release(ZirkaEncoder* z, void* base, uint64_t from, uint64_t to) {
+    if (!z->rss_limit) return;
+    uint64_t page = (uint64_t)sysconf(_SC_PAGESIZE);
+    from = (from + page - 1) & ~(page - 1);
+    to &= ~(page - 1);
+    if (to <= from) return;
+    if (madvise((uint8_t*)base + from, to - from, MADV_DONTNEED) == 0) {
+        #pragma omp atomic
+        z->gov_released += to - from;
     }
+}
 
-    // 2. Partitioning (Hoare partition scheme inline for speed)
-    int64_t i = left;
-    int64_t j = right;
-    
-    // Pivot Selection (Median of 3 approximation)
-    DiskEntry pivot = data[left + (right - left) / 2];
-
-    while (i <= j) {
-        // Scan Left: Find element > pivot
-        while (1) {
-            if (data[i].h2 < pivot.h2) { i++; continue; }
-            if (data[i].h2 > pivot.h2) break;
-            if (data[i].h1 < pivot.h1) { i++; continue; }
-            if (data[i].h1 > pivot.h1) break;
-            if (data[i].offset < pivot.offset) { i++; continue; }
-            break; 
-        }
+// Releases a sorted run. Both ends are rounded down, so neighbouring runs, sorted by other threads, own each page once.
+// Only for shared or read-only mappings: whatever is still being touched just faults back in from the page cache.
+static void governor_release_shared(ZirkaEncoder* z, void* base, uint64_t from, uint64_t to) {
+    if (!z->rss_limit) return;
+    uint64_t page = (uint64_t)sysconf(_SC_PAGESIZE);
+    governor_release(z, base, from & ~(page - 1), to & ~(page - 1));
+}
 
-        // Scan Right: Find element < pivot
-        while (1) {
-            if (data[j].h2 > pivot.h2) { j--; continue; }
-            if (data[j].h2 < pivot.h2) break;
-            if (data[j].h1 > pivot.h1) { j--; continue; }
-            if (data[j].h1 < pivot.h1) break;
-            if (data[j].offset > pivot.offset) { j--; continue; }
-            break;
-        }
+static void governor_release_run(ZirkaEncoder* z, void* base, uint64_t from, uint64_t to) {
+    if (z->gov_sort) governor_release_shared(z, base, from, to);
+}
 
-        if (i <= j) {
-            // Swap
-            DiskEntry temp = data[i];
-            data[i] = data[j];
-            data[j] = temp;
-            i++;
-            j--;
-        }
+// Drops a whole sort range of which only about 'touched' bytes were faulted in (the rest is not counted as released)
+static void governor_sweep_run(ZirkaEncoder* z, void* base, uint64_t from, uint64_t to, uint64_t touched) {
+    if (!z->gov_sort || !z->rss_limit) return;
+    uint64_t page = (uint64_t)sysconf(_SC_PAGESIZE);
+    from &= ~(page - 1);
+    to &= ~(page - 1);
+    if (to > from && madvise((uint8_t*)base + from, to - from, MADV_DONTNEED) == 0) {
+        #pragma omp atomic
+        z->gov_released += (touched < to - from) ? touched : to - from;
     }
+}
 
-    // 3. Recursive Parallel Tasking
-    // We create a task for one half, and the current thread handles the other.
-    #pragma omp task
-    {
-        #pragma omp atomic
-        g_total_tasks++;
-        omp_quicksort(data, left, j);
+// Marks bytes [0, upto) of the stream consumed and prefetches the next 'ahead' bytes
+static void governor_advance(ZirkaEncoder* z, GovStream* s, uint64_t upto, uint64_t ahead) {
+    if (!z->rss_limit || !s->base) return;
+    uint64_t page = (uint64_t)sysconf(_SC_PAGESIZE);
+    if (upto > s->size) upto = s->size;
+    governor_release(z, s->base, s->done, upto);
+    if ((upto & ~(page - 1)) > s->done) s->done = upto & ~(page - 1);
+    uint64_t end = (upto + ahead < s->size) ? upto + ahead : s->size;
+    uint64_t start = upto & ~(page - 1);
+    if (end > start) madvise((uint8_t*)s->base + start, end - start, MADV_WILLNEED);
+}
+
+// --- NUMA PLACEMENT (Thread Pinning & First Touch) ---
+// On a multi-socket host the team is spread over the nodes in contiguous blocks (threads [0, T/N) on the first node,
+// and so on) and pinned there for the job. The passes over in-RAM buffers (I/O blocks, bucket slots and runs, rank
+// windows) use static schedules, and fresh buffers are first touched with the same partition: the threads of a node
+// place, and later work on, the same slice of every bucket and rank window, so that slice never crosses the
+// interconnect. The Stage 2 samplesort jobs are stolen dynamically and stay unplaced.
+// --metrics reports remote accesses per stage (see STAGE METRICS).
+#define NUMA_MAX_NODES 64
+enum { NUMA_AUTO, NUMA_ON, NUMA_OFF, NUMA_MODES };
+static const char* numa_names[NUMA_MODES] = { "auto", "on", "off" };
+
+typedef struct NumaLayout {
+    int nodes;                      // Nodes the team is spread over, 0 = no placement
+    int id[NUMA_MAX_NODES];         // Their kernel numbers
+    cpu_set_t cpus[NUMA_MAX_NODES]; // Their CPUs this process may use
+    cpu_set_t saved;                // The affinity the team had before the job
+} NumaLayout;
+
+// "0-3,8-11" (a sysfs cpulist or node list) into a set
+static void numa_list(const char* s, cpu_set_t* set) {
+    CPU_ZERO(set);
+    while (*s) {
+        char* end;
+        long a = strtol(s, &end, 10), b = a;
+        if (end == s) break;
+        if (*end == '-') b = strtol(end + 1, &end, 10);
+        for (long c = a; c <= b && c < CPU_SETSIZE; c++) CPU_SET(c, set);
+        s = (*end == ',') ? end + 1 : end;
     }
-    // No task needed here (current thread does it)
-    omp_quicksort(data, i, right);
 }
 
-void* create_mmap_file(const char* filename, size_t size) {
-    int fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0666);
-    if (fd == -1) { perror("open"); exit(1); }
-    if (ftruncate(fd, size) == -1) { perror("truncate"); exit(1); }
-    void* ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-    if (ptr == MAP_FAILED) { perror("mmap"); exit(1); }
-    close(fd);
-    return ptr;
+static bool numa_read_list(const char* path, cpu_set_t* set) {
+    char line[4096];
+    FILE* f = fopen(path, "r");
+    if (!f) return false;
+    bool ok = fgets(line, sizeof(line), f) != NULL;
+    fclose(f);
+    if (ok) numa_list(line, set);
+    return ok;
 }
 
-/*
-Algorithm:
+// Reads the topology and pins the team. "auto" places nothing on a single node (or an affinity mask inside one).
+static void numa_bind(ZirkaEncoder* z) {
+    NumaLayout* nl = z->numa;
+    cpu_set_t online;
+    nl->nodes = 0;
+    if (z->numa_mode == NUMA_OFF || sched_getaffinity(0, sizeof(cpu_set_t), &nl->saved) != 0) return;
+    if (!numa_read_list("/sys/devices/system/node/online", &online)) return;
+    for (int n = 0; n < CPU_SETSIZE && nl->nodes < NUMA_MAX_NODES; n++) {
+        char path[96];
+        cpu_set_t cpus;
+        if (!CPU_ISSET(n, &online)) continue;
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", n);
+        if (!numa_read_list(path, &cpus)) continue;
+        CPU_AND(&cpus, &cpus, &nl->saved);
+        if (CPU_COUNT(&cpus) == 0) continue; // Memory-only node, or none of its CPUs allowed
+        nl->id[nl->nodes] = n;
+        nl->cpus[nl->nodes++] = cpus;
+    }
+    if (nl->nodes > z->threads) nl->nodes = z->threads;
+    if (nl->nodes == 0 || (nl->nodes < 2 && z->numa_mode == NUMA_AUTO)) { nl->nodes = 0; return; }
+    #pragma omp parallel
+    {
+        int t = omp_get_thread_num(), nt = omp_get_num_threads();
+        if (sched_setaffinity(0, sizeof(cpu_set_t), &nl->cpus[(int64_t)t * nl->nodes / nt]) != 0) zwarn(z, "sched_setaffinity");
+    }
+    zlog(z, "   [NUMA] %d threads pinned over %d nodes (", z->threads, nl->nodes);
+    for (int i = 0; i < nl->nodes; i++) zlog(z, "%snode %d: %d CPUs", i ? ", " : "", nl->id[i], CPU_COUNT(&nl->cpus[i]));
+    zlog(z, "), buffers first-touched by the threads working on them.\n");
+}
 
-Create a temporary file updates.bin.
+static void numa_unbind(ZirkaEncoder* z) {
+    if (!z->numa->nodes) return;
+    #pragma omp parallel
+    sched_setaffinity(0, sizeof(cpu_set_t), &z->numa->saved);
+    z->numa->nodes = 0;
+}
 
-In Stage 4.2 loop: Instead of writing to rank, write the pair {duplicate_pos, master_offset} to updates.bin. (This is fast sequential write).
+// First touch of a fresh buffer, in the static partition of the passes that work on it
+static void numa_touch(ZirkaEncoder* z, void* p, uint64_t bytes) {
+    if (!z->numa->nodes) return;
+    uint64_t page = (uint64_t)sysconf(_SC_PAGESIZE);
+    #pragma omp parallel for schedule(static)
+    for (uint64_t i = 0; i < bytes / page; i++) ((volatile uint8_t*)p)[i * page] = 0;
+}
 
-Sort updates.bin by duplicate_pos.
+// --- PARALLEL SAMPLESORT ---
+// In-place parallel samplesort after IPS4o. It replaces the task-per-partition quicksort, which created one OpenMP task
+// per Hoare split (millions on a big index) and swept the whole, possibly mmap'ed, array log2(n) times. One step splits
+// a range into up to SS_BUCKETS buckets, so a billion entries are done in three or four sweeps:
+//  1. Splitters: an oversampled random sample (log2(n) / 5 entries per bucket) is sorted and every alpha-th entry kept,
+//     laid out as an implicit search tree (tree[1] is the root, the children of i are 2i and 2i + 1).
+//  2. Classification: each thread walks its stripe and descends the tree without branches, 8 entries interleaved.
+//     Every bucket collects in a buffer of one block (SS_BLOCK_BYTES); a full buffer is written back over the part of the
+//     stripe already read, so a stripe ends as a run of full blocks followed by free space.
+//  3. Permutation: bucket b owns the block-aligned area its entries will end in. A thread takes an unplaced block,
+//     writes it at the write pointer of its bucket and carries on with the block it displaced; per-bucket locks guard
+//     the read and write pointers.
+//  4. Cleanup: the partial buffers, and the blocks that overhang the end of their bucket, fill the gaps at the edges.
+// The buckets then become jobs on per-thread deques (work stealing, see sort_take). A job is split again by the thread
+// that runs it; sub-buckets bigger than SS_STEAL are pushed back as jobs, the rest are finished at once, and ranges up
+// to SORT_THRESHOLD end in an introsort specialised for the key (no qsort callback per comparison).
+// Extra memory is a few blocks per bucket and thread (about 1.5 MB per thread), never a copy of the array.
+// SAMPLESORT_DEFINE(NAME, T, LESS) instantiates samplesort_NAME(z, data, n) for entries T ordered by LESS(a, b),
+// a branch-free expression of 0 or 1. Only the index (DiskEntry) below uses it: the update log is ordered bucket by
+// bucket with a counting sort (see RANGE-BUCKETED UPDATES).
+#define SS_LOG_BUCKETS 8
+#define SS_BUCKETS (1 << SS_LOG_BUCKETS)
+#define SS_BLOCK_BYTES 2048      // Unit of the block permutation
+#define SS_SAMPLE_MAX (16 * SS_BUCKETS)
+#define SS_STEAL (1 << 16)       // Sub-buckets with more entries become stealable jobs
+#define SS_PAR_MIN (1 << 22)     // Ranges with more entries are split by the whole team at once
 
-Read updates.bin and write to rank. Since updates.bin is now sorted by position, you will write to rank in perfect order (0, 1, 2...), which is 100x faster on disk.
+typedef struct {
+    int64_t lo, n;               // Entries [lo, lo + n) of the array
+} SortJob;
 
-To implement the "Nuclear Option" (sorting updates to convert random I/O into sequential I/O), we need to modify the code structure slightly.
+// The owner pushes and pops at the tail (the sub-buckets it just made, still in its cache), thieves take the head
+typedef struct {
+    SortJob* job;
+    int64_t head, tail, cap;
+    omp_lock_t lock;
+} SortDeque;
 
-This approach eliminates the disk thrashing by:
+typedef struct {
+    ZirkaEncoder* z;
+    void* base;                  // The whole array (page-aligned when mapped, for the governor)
+    int nt;                      // Threads of the team
+    SortDeque* dq;
+    void** scr;                  // Per-thread scratch (typed by the instantiation)
+    void* step;                  // Shared state of the steps the whole team runs
+    int64_t pending;             // Jobs pushed and not finished, the team stops at zero
+    int64_t par_min;
+    int next;                    // Deque for the next job of a team-wide split
+} SortTeam;
+
+static void sort_push(SortTeam* team, int t, int64_t lo, int64_t n) {
+    SortDeque* d = &team->dq[t];
+    #pragma omp atomic
+    team->pending++;
+    omp_set_lock(&d->lock);
+    if (d->tail == d->cap) {
+        d->cap = d->cap ? 2 * d->cap : 256;
+        d->job = (SortJob*)realloc(d->job, d->cap * sizeof(SortJob));
+        if (!d->job) zfail(team->z, "samplesort");
+    }
+    d->job[d->tail++] = (SortJob){ lo, n };
+    omp_unset_lock(&d->lock);
+}
 
-Gathering all duplicate pointers into a temporary linear array (fast sequential write).
+// Own deque first, then the others starting with the next thread
+static bool sort_take(SortTeam* team, int t, SortJob* job) {
+    for (int i = 0; i < team->nt; i++) {
+        SortDeque* d = &team->dq[(t + i) % team->nt];
+        bool got = false;
+        omp_set_lock(&d->lock);
+        if (d->tail > d->head) { *job = i ? d->job[d->head++] : d->job[--d->tail]; got = true; }
+        if (d->head == d->tail) d->head = d->tail = 0;
+        omp_unset_lock(&d->lock);
+        if (got) return true;
+    }
+    return false;
+}
 
-Sorting that array by file position (so the target addresses become monotonic).
+static inline uint64_t sort_random(uint64_t* s) {
+    uint64_t x = (*s += 0x9E3779B97F4A7C15ULL);
+    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+    return x ^ (x >> 31);
+}
 
-Applying the updates to the Rank Map in one clean sweep (fast sequential/monotonic write).
+#define SAMPLESORT_DEFINE(NAME, T, LESS) \
+typedef struct { \
+    int logk; \
+    int64_t stripe; \
+    int64_t bound[SS_BUCKETS + 1];          /* Bucket b ends up in [bound[b], bound[b + 1]) */ \
+    int64_t d[SS_BUCKETS + 1];              /* and its blocks go to [d[b], d[b + 1]): bound rounded up to a block */ \
+    int64_t w[SS_BUCKETS], r[SS_BUCKETS];   /* Blocks before w are placed, blocks in [w, r) not looked at yet */ \
+    int64_t spill_n[SS_BUCKETS]; \
+    int64_t ovf_pos;                        /* A block that would cross the end of the range waits in 'ovf' */ \
+    int64_t moved;                          /* Entries the permutation passes moved, see NAME##_moved */ \
+    int ovf_bucket; \
+    int64_t* wend;                          /* Per thread: end of the full blocks left in its stripe */ \
+    T* ovf; \
+    T* spill;                               /* Per bucket: its entries that overhang the next bucket */ \
+    omp_lock_t lock[SS_BUCKETS]; \
+    T tree[SS_BUCKETS]; \
+} SortStep_##NAME; \
+ \
+typedef struct { \
+    T* buf;                                 /* One block per bucket being filled */ \
+    int64_t fill[SS_BUCKETS]; \
+    int64_t count[SS_BUCKETS]; \
+    T* swap;                                /* Two blocks */ \
+    T* sample; \
+    SortStep_##NAME step;                   /* The steps this thread runs alone */ \
+} SortScratch_##NAME; \
+ \
+static inline void NAME##_sift(T* a, int64_t i, int64_t n) { \
+    T x = a[i]; \
+    for (int64_t c; (c = 2 * i + 1) < n; i = c) { \
+        if (c + 1 < n && LESS(a[c], a[c + 1])) c++; \
+        if (!LESS(x, a[c])) break; \
+        a[i] = a[c]; \
+    } \
+    a[i] = x; \
+} \
+ \
+/* Leaf sort: median-of-three quicksort, insertion sort below 16 entries, heapsort when it goes too deep */ \
+static void NAME##_intro(T* a, int64_t n, int depth) { \
+    while (n > 16) { \
+        if (depth-- == 0) { \
+            for (int64_t i = n / 2; i-- > 0; ) NAME##_sift(a, i, n); \
+            for (int64_t e = n - 1; e > 0; e--) { T x = a[0]; a[0] = a[e]; a[e] = x; NAME##_sift(a, 0, e); } \
+            return; \
+        } \
+        int64_t m = n / 2; \
+        if (LESS(a[m], a[0])) { T x = a[0]; a[0] = a[m]; a[m] = x; } \
+        if (LESS(a[n - 1], a[m])) { \
+            T x = a[m]; a[m] = a[n - 1]; a[n - 1] = x; \
+            if (LESS(a[m], a[0])) { x = a[0]; a[0] = a[m]; a[m] = x; } \
+        } \
+        T p = a[m]; \
+        int64_t i = -1, j = n; \
+        while (1) { \
+            do i++; while (LESS(a[i], p)); \
+            do j--; while (LESS(p, a[j])); \
+            if (i >= j) break; \
+            T x = a[i]; a[i] = a[j]; a[j] = x; \
+        } \
+        if (j + 1 < n - j - 1) { NAME##_intro(a, j + 1, depth); a += j + 1; n -= j + 1; } \
+        else { NAME##_intro(a + j + 1, n - j - 1, depth); n = j + 1; } \
+    } \
+    for (int64_t i = 1; i < n; i++) { \
+        T x = a[i]; \
+        int64_t j = i; \
+        while (j > 0 && LESS(x, a[j - 1])) { a[j] = a[j - 1]; j--; } \
+        a[j] = x; \
+    } \
+} \
+ \
+static void NAME##_leaf(T* a, int64_t n) { \
+    if (n > 1) NAME##_intro(a, n, 2 * (64 - __builtin_clzll((uint64_t)n))); \
+} \
+ \
+static inline void NAME##_put(SortScratch_##NAME* my, T* a, int64_t* w, int b, T x) { \
+    const int64_t B = SS_BLOCK_BYTES / sizeof(T); \
+    T* slot = my->buf + b * B; \
+    slot[my->fill[b]++] = x; \
+    my->count[b]++; \
+    if (my->fill[b] == B) { memcpy(a + *w, slot, B * sizeof(T)); *w += B; my->fill[b] = 0; } \
+} \
+ \
+/* Copies 'count' entries into the gaps of a bucket: [*pos, *end), then [next, next_end) */ \
+static inline void NAME##_drain(T* a, int64_t* pos, int64_t* end, int64_t next, int64_t next_end, const T* src, int64_t count) { \
+    while (count > 0) { \
+        if (*pos == *end) { if (*end == next_end) break; *pos = next; *end = next_end; continue; } \
+        int64_t c = (count < *end - *pos) ? count : *end - *pos; \
+        memcpy(a + *pos, src, c * sizeof(T)); \
+        *pos += c; src += c; count -= c; \
+    } \
+} \
+ \
+/* Under the governor the passes that jump all over the range count the entries they touch: every 'gov_step' of them \
+   (team-wide) the whole range is dropped from RSS. It is file-backed, so what is still in use faults back from the page cache. */ \
+static inline void NAME##_moved(SortTeam* team, SortStep_##NAME* st, T* a, int64_t n, int64_t gov_step, int64_t m) { \
+    if (!gov_step) return; \
+    int64_t before; \
+    _Pragma("omp atomic capture") \
+    { before = st->moved; st->moved += m; } \
+    if ((before + m) / gov_step == before / gov_step) return; \
+    int64_t lo = a - (T*)team->base; \
+    governor_sweep_run(team->z, team->base, lo * sizeof(T), (lo + n) * sizeof(T), gov_step * sizeof(T)); \
+} \
+ \
+/* One step over a[0, n), see PARALLEL SAMPLESORT. Called by every thread of the team (part = all scratches, t = thread) \
+   or by one thread alone (nt = 1, part = its scratch). Returns the number of buckets and their edges in 'bound', \
+   0 when the sample shows no spread (the caller leaf-sorts the range). */ \
+static int NAME##_step(SortTeam* team, SortStep_##NAME* st, SortScratch_##NAME** part, T* a, int64_t n, int t, int nt, int64_t* bound) { \
+    const int64_t B = SS_BLOCK_BYTES / sizeof(T); \
+    ZirkaEncoder* z = team->z; \
+    SortScratch_##NAME* my = part[t]; \
+    if (t == 0) { \
+        int logk = SS_LOG_BUCKETS; \
+        while (logk > 1 && (B << (logk + 1)) > n) logk--; \
+        int64_t k = 1 << logk; \
+        int64_t alpha = (63 - __builtin_clzll((uint64_t)n)) / 5; \
+        if (alpha < 1) alpha = 1; \
+        if (alpha * k > SS_SAMPLE_MAX) alpha = SS_SAMPLE_MAX / k; \
+        uint64_t seed = (uint64_t)(a - (T*)team->base) ^ ((uint64_t)n << 20); \
+        for (int64_t i = 0; i < alpha * k; i++) my->sample[i] = a[sort_random(&seed) % (uint64_t)n]; \
+        NAME##_leaf(my->sample, alpha * k); \
+        st->logk = LESS(my->sample[0], my->sample[alpha * k - 1]) ? logk : 0; \
+        for (int64_t i = 1; i < k; i++) { \
+            int l = 63 - __builtin_clzll((uint64_t)i); \
+            int64_t p = i - (1LL << l); \
+            st->tree[i] = my->sample[(2 * p + 1) * (k >> (l + 1)) * alpha - 1]; \
+        } \
+        st->stripe = ((n + nt - 1) / nt + B - 1) / B * B; \
+        st->ovf_pos = -1; \
+        st->ovf_bucket = -1; \
+        st->moved = 0; \
+    } \
+    if (nt > 1) { _Pragma("omp barrier") } \
+    int logk = st->logk, k = 1 << logk; \
+    if (!logk) { \
+        if (nt > 1) { _Pragma("omp barrier") } \
+        return 0; \
+    } \
+ \
+    /* 2. Local classification of the stripe */ \
+    int64_t s0 = t * st->stripe, s1 = s0 + st->stripe; \
+    if (s0 > n) s0 = n; \
+    if (s1 > n) s1 = n; \
+    memset(my->fill, 0, k * sizeof(int64_t)); \
+    memset(my->count, 0, k * sizeof(int64_t)); \
+    int64_t gov_step = (z->gov_sort && z->rss_limit && (uint64_t)n * sizeof(T) > z->rss_limit / 4) ? (int64_t)(z->rss_limit / 4 / sizeof(T)) : 0; \
+    int64_t w = s0, r = s0, rel = s0; /* Each thread releases its own stripe behind 'w', a share of gov_step at a time */ \
+    for (; r + 8 <= s1; r += 8) { \
+        uint64_t id[8]; \
+        for (int u = 0; u < 8; u++) id[u] = 1; \
+        for (int l = 0; l < logk; l++) \
+            for (int u = 0; u < 8; u++) id[u] = 2 * id[u] + LESS(st->tree[id[u]], a[r + u]); \
+        for (int u = 0; u < 8; u++) NAME##_put(my, a, &w, (int)(id[u] - k), a[r + u]); \
+        if (gov_step && w - rel >= gov_step / nt) { governor_release_run(z, team->base, (a - (T*)team->base + rel) * sizeof(T), (a - (T*)team->base + w) * sizeof(T)); rel = w; } \
+    } \
+    for (; r < s1; r++) { \
+        uint64_t i = 1; \
+        for (int l = 0; l < logk; l++) i = 2 * i + LESS(st->tree[i], a[r]); \
+        NAME##_put(my, a, &w, (int)(i - k), a[r]); \
+    } \
+    st->wend[t] = w; \
+    if (nt > 1) { _Pragma("omp barrier") } \
+ \
+    if (t == 0) { \
+        int64_t sum = 0; \
+        for (int b = 0; b < k; b++) { \
+            st->bound[b] = sum; \
+            st->d[b] = ((sum + B - 1) / B * B < n) ? (sum + B - 1) / B * B : n; \
+            for (int p = 0; p < nt; p++) sum += part[p]->count[b]; \
+            if (nt > 1) omp_init_lock(&st->lock[b]); \
+        } \
+        st->bound[k] = st->d[k] = n; \
+    } \
+    if (nt > 1) { _Pragma("omp barrier") } \
+ \
+    /* Full blocks to the front of every bucket area (only where stripes end inside the area) */ \
+    for (int b = t; b < k; b += nt) { \
+        int64_t lo = st->d[b], i = lo, j = lo + ((st->d[b + 1] - lo) / B - 1) * B; \
+        while (1) { \
+            while (i <= j && i < st->wend[i / st->stripe]) i += B; \
+            while (j > i && j >= st->wend[j / st->stripe]) j -= B; \
+            if (j <= i) break; \
+            memcpy(a + i, a + j, B * sizeof(T)); \
+            NAME##_moved(team, st, a, n, gov_step, 2 * B); \
+            i += B; \
+            j -= B; \
+        } \
+        st->w[b] = lo; \
+        st->r[b] = i; \
+    } \
+    if (nt > 1) { _Pragma("omp barrier") } \
+ \
+    /* 3. Block permutation, each thread starting from its own bucket */ \
+    T* cur = my->swap; \
+    T* other = my->swap + B; \
+    for (int c = 0; c < k; c++) { \
+        int b = (int)(((int64_t)t * k / nt + c) & (k - 1)); \
+        while (1) { \
+            bool got = false; \
+            if (nt > 1) omp_set_lock(&st->lock[b]); \
+            if (st->r[b] > st->w[b]) { st->r[b] -= B; memcpy(cur, a + st->r[b], B * sizeof(T)); got = true; } \
+            if (nt > 1) omp_unset_lock(&st->lock[b]); \
+            if (!got) break; \
+            NAME##_moved(team, st, a, n, gov_step, B); \
+            while (1) { \
+                uint64_t i = 1; \
+                for (int l = 0; l < logk; l++) i = 2 * i + LESS(st->tree[i], cur[0]); \
+                int dst = (int)(i - k); \
+                if (nt > 1) omp_set_lock(&st->lock[dst]); \
+                int64_t pos = st->w[dst]; \
+                st->w[dst] += B; \
+                bool taken = pos < st->r[dst]; \
+                if (nt > 1) omp_unset_lock(&st->lock[dst]); \
+                NAME##_moved(team, st, a, n, gov_step, B); \
+                if (taken) { \
+                    memcpy(other, a + pos, B * sizeof(T)); \
+                    memcpy(a + pos, cur, B * sizeof(T)); \
+                    T* x = cur; cur = other; other = x; \
+                    continue; \
+                } \
+                if (pos + B > n) { memcpy(st->ovf, cur, B * sizeof(T)); st->ovf_pos = pos; st->ovf_bucket = dst; } \
+                else memcpy(a + pos, cur, B * sizeof(T)); \
+                break; \
+            } \
+        } \
+    } \
+    if (nt > 1) { _Pragma("omp barrier") } \
+ \
+    /* 4. Cleanup: save what overhangs the next bucket, then fill the gaps of each bucket */ \
+    for (int b = t; b < k; b += nt) { \
+        int64_t fe = (b == st->ovf_bucket) ? st->ovf_pos : st->w[b]; \
+        int64_t from = (st->d[b] > st->bound[b + 1]) ? st->d[b] : st->bound[b + 1]; \
+        st->spill_n[b] = (fe > from) ? fe - from : 0; \
+        if (fe > from) memcpy(st->spill + b * B, a + from, (fe - from) * sizeof(T)); \
+    } \
+    if (nt > 1) { _Pragma("omp barrier") } \
+    for (int b = t; b < k; b += nt) { \
+        int64_t lo = st->bound[b], hi = st->bound[b + 1]; \
+        int64_t fe = (b == st->ovf_bucket) ? st->ovf_pos : st->w[b]; \
+        int64_t pos = lo, end = (st->d[b] < hi) ? st->d[b] : hi, next = (fe < hi) ? fe : hi; \
+        NAME##_drain(a, &pos, &end, next, hi, st->spill + b * B, st->spill_n[b]); \
+        if (b == st->ovf_bucket) NAME##_drain(a, &pos, &end, next, hi, st->ovf, B); \
+        for (int p = 0; p < nt; p++) NAME##_drain(a, &pos, &end, next, hi, part[p]->buf + b * B, part[p]->fill[b]); \
+    } \
+    if (nt > 1) { _Pragma("omp barrier") } \
+    if (gov_step && t == 0) governor_sweep_run(z, team->base, (a - (T*)team->base) * sizeof(T), (a - (T*)team->base + n) * sizeof(T), (st->moved % gov_step) * sizeof(T)); \
+    memcpy(bound, st->bound, (k + 1) * sizeof(int64_t)); \
+    if (nt > 1) { \
+        _Pragma("omp barrier") \
+        if (t == 0) for (int b = 0; b < k; b++) omp_destroy_lock(&st->lock[b]); \
+    } \
+    return k; \
+} \
+ \
+/* Sorts a job alone: sub-buckets bigger than SS_STEAL go to this thread's deque, the rest are sorted right away */ \
+static void NAME##_job(SortTeam* team, int self, T* a, int64_t n) { \
+    SortScratch_##NAME** scr = (SortScratch_##NAME**)team->scr; \
+    int64_t bound[SS_BUCKETS + 1]; \
+    int k = (n > SORT_THRESHOLD) ? NAME##_step(team, &scr[self]->step, &scr[self], a, n, 0, 1, bound) : 0; \
+    for (int b = 0; b < k; b++) { \
+        int64_t m = bound[b + 1] - bound[b]; \
+        if (m == n) { k = 0; break; } \
+        if (m > SS_STEAL) sort_push(team, self, a + bound[b] - (T*)team->base, m); \
+        else NAME##_job(team, self, a + bound[b], m); \
+    } \
+    if (k) return; \
+    NAME##_leaf(a, n); \
+    governor_release_run(team->z, team->base, (a - (T*)team->base) * sizeof(T), (a - (T*)team->base + n) * sizeof(T)); \
+    _Pragma("omp atomic") \
+    team->z->sorted_so_far += n; \
+} \
+ \
+/* Splits a range with the whole team: buckets still bigger than par_min are split the same way, the others are dealt \
+   round robin to the deques */ \
+static void NAME##_split(SortTeam* team, int t, T* a, int64_t n) { \
+    int64_t bound[SS_BUCKETS + 1]; \
+    int k = NAME##_step(team, (SortStep_##NAME*)team->step, (SortScratch_##NAME**)team->scr, a, n, t, team->nt, bound); \
+    if (!k && t == 0) sort_push(team, 0, a - (T*)team->base, n); \
+    for (int b = 0; b < k; b++) { \
+        int64_t m = bound[b + 1] - bound[b]; \
+        if (m > team->par_min && m < n) NAME##_split(team, t, a + bound[b], m); \
+        else if (m > 0 && t == 0) { sort_push(team, team->next, a + bound[b] - (T*)team->base, m); team->next = (team->next + 1) % team->nt; } \
+    } \
+} \
+ \
+static void samplesort_##NAME(ZirkaEncoder* z, T* a, int64_t n) { \
+    if (n < 2) return; \
+    const int64_t B = SS_BLOCK_BYTES / sizeof(T); \
+    int nt = omp_get_max_threads(); \
+    SortTeam team = { z, a, nt, NULL, NULL, NULL, 0, 0, 0 }; \
+    /* Every allocation up front: the workers cannot unwind the job */ \
+    SortScratch_##NAME** scr = (SortScratch_##NAME**)calloc(nt, sizeof(*scr)); \
+    SortStep_##NAME* st = (SortStep_##NAME*)calloc(1, sizeof(*st)); \
+    team.dq = (SortDeque*)calloc(nt, sizeof(SortDeque)); \
+    bool ok = scr && st && team.dq; \
+    if (ok) { \
+        st->wend = (int64_t*)malloc(nt * sizeof(int64_t)); \
+        st->ovf = (T*)malloc(B * sizeof(T)); \
+        st->spill = (T*)malloc(SS_BUCKETS * B * sizeof(T)); \
+        ok = st->wend && st->ovf && st->spill; \
+    } \
+    for (int t = 0; ok && t < nt; t++) { \
+        SortScratch_##NAME* s = scr[t] = (SortScratch_##NAME*)calloc(1, sizeof(SortScratch_##NAME)); \
+        if (!s) { ok = false; break; } \
+        s->buf = (T*)malloc(SS_BUCKETS * B * sizeof(T)); \
+        s->swap = (T*)malloc(2 * B * sizeof(T)); \
+        s->sample = (T*)malloc(SS_SAMPLE_MAX * sizeof(T)); \
+        s->step.wend = (int64_t*)malloc(sizeof(int64_t)); \
+        s->step.ovf = (T*)malloc(B * sizeof(T)); \
+        s->step.spill = (T*)malloc(SS_BUCKETS * B * sizeof(T)); \
+        ok = s->buf && s->swap && s->sample && s->step.wend && s->step.ovf && s->step.spill; \
+    } \
+    if (!ok) zfail(z, "samplesort"); \
+    for (int t = 0; t < nt; t++) omp_init_lock(&team.dq[t].lock); \
+    team.scr = (void**)scr; \
+    team.step = st; \
+    team.par_min = (2 * n / nt > SS_PAR_MIN) ? 2 * n / nt : SS_PAR_MIN; \
+ \
+    _Pragma("omp parallel num_threads(nt)") \
+    { \
+        int t = omp_get_thread_num(); \
+        _Pragma("omp single") \
+        team.nt = omp_get_num_threads(); \
+        if (team.nt > 1 && n > SS_PAR_MIN) NAME##_split(&team, t, a, n); \
+        else if (t == 0) sort_push(&team, 0, 0, n); \
+        _Pragma("omp barrier") \
+        SortJob job; \
+        while (1) { \
+            if (sort_take(&team, t, &job)) { \
+                NAME##_job(&team, t, a + job.lo, job.n); \
+                _Pragma("omp atomic") \
+                team.pending--; \
+                _Pragma("omp atomic") \
+                z->total_tasks++; \
+                continue; \
+            } \
+            int64_t left; \
+            _Pragma("omp atomic read") \
+            left = team.pending; \
+            if (!left) break; \
+            sched_yield(); \
+        } \
+    } \
+ \
+    for (int t = 0; t < nt; t++) { \
+        omp_destroy_lock(&team.dq[t].lock); \
+        free(team.dq[t].job); \
+        free(scr[t]->buf); free(scr[t]->swap); free(scr[t]->sample); \
+        free(scr[t]->step.wend); free(scr[t]->step.ovf); free(scr[t]->step.spill); \
+        free(scr[t]); \
+    } \
+    free(st->wend); free(st->ovf); free(st->spill); \
+    free(st); free(scr); free(team.dq); \
+}
 
-Here is the complete solution.
+// Hash, then offset: the first occurrence of every hash group comes first
+#define DISK_LESS(a, b) (((a).h2 < (b).h2) | (((a).h2 == (b).h2) & (((a).h1 < (b).h1) | (((a).h1 == (b).h1) & ((a).offset < (b).offset)))))
+SAMPLESORT_DEFINE(index, DiskEntry, DISK_LESS)
 
-1. Add these Definitions (Top of File)
-Place these before main(), alongside the existing DiskEntry and omp_quicksort. This defines the structure for the updates and a specific sorter for them.
-*/
+static void* create_mmap_file(ZirkaEncoder* z, const char* filename, size_t size) {
+    int fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0666);
+    if (fd == -1) zfail(z, "open");
+    if (ftruncate(fd, size) == -1) zfail(z, "truncate");
+    void* ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (ptr == MAP_FAILED) zfail(z, "mmap");
+    close(fd);
+    return ptr;
+}
 
-// --- NUCLEAR OPTION HELPERS ---
-typedef struct {
-    uint64_t pos;    // Where in the file the duplicate is (The Random Address)
-    uint64_t target; // The Master Offset it should point to (The Value)
-} RankUpdate;
+// Re-maps a temp artifact left behind by an interrupted run (used by --resume), NULL if it is missing or has the wrong size
+static void* open_mmap_file(const char* filename, size_t size) {
+    int fd = open(filename, O_RDWR);
+    if (fd == -1) return NULL;
+    struct stat st;
+    if (fstat(fd, &st) == -1 || (uint64_t)st.st_size != size) { close(fd); return NULL; }
+    void* ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    return (ptr == MAP_FAILED) ? NULL : ptr;
+}
 
-// Compare by Position (to linearize the writes later)
-int compare_updates(const void* a, const void* b) {
-    const RankUpdate* ua = (const RankUpdate*)a;
-    const RankUpdate* ub = (const RankUpdate*)b;
-    if (ua->pos < ub->pos) return -1;
-    if (ua->pos > ub->pos) return 1;
-    return 0;
+// --- TEMP DIRECTORIES (Per-Artifact Placement & Striping) ---
+// Each temp artifact gets its own list of directories. One directory = one plain file (the v7 layout).
+// Several directories = the artifact is striped round-robin in STRIPE_UNIT pieces over one file per directory,
+// and the pieces are mmap-ed (MAP_FIXED) back-to-back into a single reserved address range,
+// so the rest of the code still sees one flat array while every thread streams to a different NVMe device.
+#define STRIPE_UNIT (64ULL * 1024 * 1024) // Multiple of the page size
+
+// Splits "dir1,dir2,..." into 'td' (the string is kept, not copied)
+static void parse_tmp_dirs(TempDirs* td, char* list) {
+    char* save = NULL;
+    td->ndirs = 0;
+    for (char* tok = strtok_r(list, ",", &save); tok && td->ndirs < MAX_TMP_DIRS; tok = strtok_r(NULL, ",", &save)) td->dirs[td->ndirs++] = tok;
+    if (td->ndirs == 0) { td->dirs[0] = "."; td->ndirs = 1; }
 }
 
-// Special Quicksort for the Update List
-void omp_quicksort_updates(RankUpdate* data, int64_t left, int64_t right) {
-    if (left >= right) return;
-    
-    // Serial Threshold
-    if ((right - left) < SORT_THRESHOLD) {
-        qsort(data + left, right - left + 1, sizeof(RankUpdate), compare_updates);
+static void temp_path(char* out, const TempDirs* td, const char* name, int stripe) {
+    if (td->ndirs == 1) snprintf(out, 1024, "%s/%s%s", td->dirs[0], td->prefix, name);
+    else snprintf(out, 1024, "%s/%s%s.%d", td->dirs[stripe], td->prefix, name, stripe);
+}
 
-    // stats [
-        #pragma omp atomic
-        SortedSoFar += (right - left + 1);
-        #pragma omp critical
-        {
-            double progress = (double)SortedSoFar / update_count *100;
-            printf ("   Sort Progress = %.1f%%\r", progress);
-            fflush(stdout);
+// Bytes of a 'size' artifact that land in stripe file 'd'
+static uint64_t stripe_file_size(uint64_t size, uint64_t unit, int ndirs, int d) {
+    uint64_t pieces = (size + unit - 1) / unit, bytes = 0;
+    for (uint64_t k = d; k < pieces; k += ndirs) bytes += (k == pieces - 1) ? size - k * unit : unit;
+    return bytes;
+}
+
+static void* map_temp_artifact(ZirkaEncoder* z, const TempDirs* td, const char* name, size_t size, bool create) {
+    char path[1024];
+    if (td->ndirs == 1) {
+        temp_path(path, td, name, 0);
+        return create ? create_mmap_file(z, path, size) : open_mmap_file(path, size);
+    }
+    uint64_t unit = z->stripe_unit;
+    uint8_t* base = mmap(NULL, size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (base == MAP_FAILED) zfail(z, "mmap reserve");
+    for (int d = 0; d < td->ndirs; d++) {
+        temp_path(path, td, name, d);
+        uint64_t fsize = stripe_file_size(size, unit, td->ndirs, d);
+        int fd = create ? open(path, O_RDWR | O_CREAT | O_TRUNC, 0666) : open(path, O_RDWR);
+        if (fd == -1) { if (create) zfail(z, "open"); munmap(base, size); return NULL; }
+        struct stat st;
+        if (create) {
+            if (ftruncate(fd, fsize) == -1) zfail(z, "truncate");
+        } else if (fstat(fd, &st) == -1 || (uint64_t)st.st_size != fsize) { close(fd); munmap(base, size); return NULL; }
+        // Piece k of the artifact is piece k/ndirs of stripe file k%ndirs
+        for (uint64_t k = d; k * unit < size; k += td->ndirs) {
+            uint64_t len = (size - k * unit < unit) ? size - k * unit : unit;
+            void* p = mmap(base + k * unit, len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, (k / td->ndirs) * unit);
+            if (p == MAP_FAILED) zfail(z, "mmap stripe");
         }
-    // stats ]
+        close(fd);
+    }
+    return base;
+}
 
-        return;
+static bool temp_artifact_matches(ZirkaEncoder* z, const TempDirs* td, const char* name, uint64_t size) {
+    char path[1024];
+    struct stat st;
+    for (int d = 0; d < td->ndirs; d++) {
+        temp_path(path, td, name, d);
+        uint64_t fsize = (td->ndirs == 1) ? size : stripe_file_size(size, z->stripe_unit, td->ndirs, d);
+        if (stat(path, &st) != 0 || (uint64_t)st.st_size != fsize) return false;
     }
+    return true;
+}
 
-    int64_t i = left, j = right;
-    RankUpdate pivot = data[left + (right - left) / 2];
+static void remove_temp_artifact(const TempDirs* td, const char* name) {
+    char path[1024];
+    for (int d = 0; d < td->ndirs; d++) { temp_path(path, td, name, d); unlink(path); }
+}
 
-    while (i <= j) {
-        while (data[i].pos < pivot.pos) i++;
-        while (data[j].pos > pivot.pos) j--;
-        if (i <= j) {
-            RankUpdate temp = data[i]; data[i] = data[j]; data[j] = temp;
-            i++; j--;
-        }
+// --tmp DIR1,DIR2,...: a pool of directories (ideally one per device) that the planner spreads the artifacts over.
+// The index is sorted in place (random access), the updates log and the rank map are written and read in block sweeps,
+// so the rank map gets a device of its own and the index is striped over the remaining ones.
+static void plan_temp_layout(ZirkaEncoder* z, char* pool_list) {
+    TempDirs pool;
+    parse_tmp_dirs(&pool, pool_list);
+
+    // One directory per device: extra directories on an already used device add nothing but seeks
+    TempDirs devs = { { 0 }, 0, z->tmp_prefix };
+    dev_t seen[MAX_TMP_DIRS];
+    for (int i = 0; i < pool.ndirs; i++) {
+        struct stat st;
+        if (stat(pool.dirs[i], &st) == -1) zfail(z, pool.dirs[i]);
+        bool dup = false;
+        for (int j = 0; j < devs.ndirs; j++) if (seen[j] == st.st_dev) dup = true;
+        if (!dup) { seen[devs.ndirs] = st.st_dev; devs.dirs[devs.ndirs++] = pool.dirs[i]; }
     }
 
-    #pragma omp task
-    omp_quicksort_updates(data, left, j);
-    omp_quicksort_updates(data, i, right);
+    if (devs.ndirs == 1) {
+        z->tmp_index = z->tmp_updates = z->tmp_rank = devs;
+        return;
+    }
+    z->tmp_rank.dirs[0] = devs.dirs[devs.ndirs - 1];
+    z->tmp_rank.ndirs = 1;
+    z->tmp_index.ndirs = devs.ndirs - 1;
+    for (int i = 0; i < z->tmp_index.ndirs; i++) z->tmp_index.dirs[i] = devs.dirs[i];
+    z->tmp_updates.dirs[0] = devs.dirs[0];
+    z->tmp_updates.ndirs = 1;
 }
 
-int main(int argc, char* argv[]) {
-    if (argc < 2) { printf("Usage: %s <file>\n", argv[0]); return 1; }
+static void print_temp_layout(ZirkaEncoder* z) {
+    const TempDirs* all[3] = { &z->tmp_index, &z->tmp_updates, &z->tmp_rank };
+    const char* names[3] = { "Index  ", "Updates", "Rank   " };
+    for (int a = 0; a < 3; a++) {
+        zlog(z, "   [Temp] %s:", names[a]);
+        for (int d = 0; d < all[a]->ndirs; d++) zlog(z, " %s", all[a]->dirs[d]);
+        if (all[a]->ndirs > 1) zlog(z, " (striped, %lu MB units)", z->stripe_unit >> 20);
+        zlog(z, "\n");
+    }
+}
 
-printf ("__________.__        __            \n");
-printf ("\\____    /|__|______|  | _______   \n");
-printf ("  /     / |  \\_  __ \\  |/ /\\__  \\  \n");
-printf (" /     /_ |  ||  | \\/    <  / __ \\_\n");
-printf ("/_______ \\|__||__|  |__|_ \\(____  /\n");
-printf ("        \\/               \\/     \\/ \n");
-printf ("Version %d++, Deduplication granularity %d\n", VERSION, CHUNK_SIZE);
+// --- PIPELINES (--engine) ---
+// How Stages 3-4 turn the sorted index into matches. Every build has all of them, and they share Stage 4's output:
+//   nuclear  gather, bucket-sort and apply the duplicates into a position-ordered rank map: sequential I/O only,
+//            resumable, the only one that takes shards, --tar and the low-entropy runs (v7's -DrankmapSERIAL)
+//   rankmap  rank map of index positions written at random, the previous occurrence found next to it (-Drankmap)
+//   first    rank map of first occurrences written at random (-DrankmapFIRST)
+//   bs       no rank map: every literal position is hashed again and binary-searched in the index (-DBS)
+// 'auto' picks one per input (see PIPELINE SELECTION); the v7 build flags only change the default.
+enum { PIPELINE_AUTO, PIPELINE_NUCLEAR, PIPELINE_RANKMAP, PIPELINE_FIRST, PIPELINE_BS, PIPELINES };
+static const char* pipeline_names[PIPELINES] = { "auto", "nuclear", "rankmap", "first", "bs" };
+static const char* pipeline_titles[PIPELINES] = { "auto", "Nuclear rank map (rankmapSERIAL)", "Rank map (rankmap)", "First-occurrence rank map (rankmapFIRST)", "Binary search encode (BS)" };
+#if defined(rankmapSERIAL)
+#define PIPELINE_DEFAULT PIPELINE_NUCLEAR
+#elif defined(rankmap)
+#define PIPELINE_DEFAULT PIPELINE_RANKMAP
+#elif defined(rankmapFIRST)
+#define PIPELINE_DEFAULT PIPELINE_FIRST
+#elif defined(BS)
+#define PIPELINE_DEFAULT PIPELINE_BS
+#else
+#define PIPELINE_DEFAULT PIPELINE_AUTO
+#endif
 
-// [sanmayce@djudjeto v7+]$ echo -n Sanmayce> Sanmayce 
-// [sanmayce@djudjeto v7+]$ sha1sum Sanmayce 
-// 8ecfb9435b758ba69d424f0aa003f6e3dc5943b3  Sanmayce
+// --- RUN MANIFEST (Stage Checkpointing) ---
+// After every finished stage the temp artifacts are flushed (msync) and the manifest is rewritten (write + rename),
+// so a run killed hours later (disk full, OOM, reboot) can be continued with --resume instead of re-hashing and re-sorting.
+#define MANIFEST_FILE "zirka_manifest.tmp" // Lives next to (the first stripe of) the index
+#define MANIFEST_MAGIC 0x375453464E414D5AULL // "ZMANFST7" (the index holds index_entries since v5, the pipeline is recorded since v6, the pruning parse since v7)
+
+enum {
+    STAGE_NONE = 0,
+    STAGE_HASHED,          // zirka_index.tmp (or the shard files) filled
+    STAGE_SORTED,          // zirka_index.tmp sorted
+    STAGE_GATHERED,        // zirka_updates.tmp buckets filled, update_count & bucket fills valid
+    STAGE_UPDATES_SORTED,  // zirka_updates.tmp buckets sorted by pos
+    STAGE_RANKED           // zirka_rank.tmp complete and verified, index & updates deleted
+};
 
-/*
-char Sanmayce[] = "Sanmayce";
-uint8_t hash_out20[32];
-        sha1_sum(Sanmayce, 8, (uint8_t *)hash_out20);
-for (int i=0; i<20; i++) printf("%02x", hash_out20[i]);
-printf("\n");
-exit (1);
-*/
+static const char* stage_names[] = { "none", "hashed", "sorted", "gathered", "updates sorted", "ranked" };
 
-// [sanmayce@djudjeto v7+]$ ./Zirka_v7 q
-// Version 7+, Deduplication granularity 384
-// 8ecfb9435b758ba69d424f0aa003f6e3dc5943b3
+typedef struct {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t chunk_size;
+    uint64_t input_size;
+    int64_t input_mtime_sec;
+    int64_t input_mtime_nsec;
+    uint64_t entry_count;
+    uint64_t index_entries; // Fewer than entry_count with --tar
+    uint64_t pipeline;      // PIPELINE_* the run was started with
+    uint64_t update_count;
+    uint64_t run_windows;  // Windows in low-entropy runs Stage 1 left out
+    uint64_t stage;        // Last completed stage
+    uint64_t stripe_unit;  // Striped artifacts can only be re-mapped with the same unit
+    uint64_t shards;       // 0 = one monolithic index, else the shard count of Stage 1
+    uint64_t shards_done;  // Shards already sorted, gathered and deleted (STAGE_HASHED only)
+    uint64_t entries_done; // Entries those shards held
+    uint64_t bucket_shift; // Updates buckets (their fill counts follow the manifest in the file)
+    uint64_t buckets;
+    uint64_t buckets_done; // Buckets already sorted (STAGE_GATHERED only)
+    uint64_t parse_next;   // Where the pruning parse stands after them, its pending literals and its last tag
+    uint64_t parse_lit;
+    uint64_t parse_tag[3];
+    uint64_t pruned;       // Updates it dropped unverified, and those it (then the apply) rejected
+    uint64_t rejected;
+    uint64_t fills_checksum;
+    uint64_t checksum;     // Pippip of all the fields above
+} RunManifest;
+
+static uint64_t manifest_checksum(const RunManifest* m) {
+    uint64_t h[2];
+    FNV1A_Pippip_Yurii_OOO_128bit_AES_TriXZi_Mikayla_forte((const char*)m, offsetof(RunManifest, checksum), 0, h);
+    return h[0];
+}
 
-// malloc [
-/*
-    FILE* fin = fopen(argv[1], "rb");
-    if (!fin) { perror("Input error"); return 1; }
-    fseek(fin, 0, SEEK_END);
-    uint64_t filesize = ftell(fin);
-    fseek(fin, 0, SEEK_SET);
+static uint64_t fills_checksum(const uint64_t* fill, uint64_t count) {
+    uint64_t h[2] = { 0, 0 };
+    if (count) FNV1A_Pippip_Yurii_OOO_128bit_AES_TriXZi_Mikayla_forte((const char*)fill, count * sizeof(uint64_t), 0, h);
+    return h[0];
+}
 
-    uint64_t entry_count = (filesize >= CHUNK_SIZE) ? (filesize - CHUNK_SIZE + 1) : 0;
+// With the job's temp file prefix, like every other artifact
+static void manifest_path(ZirkaEncoder* z, char* out, size_t size) {
+    snprintf(out, size, "%s/%s%s", z->tmp_index.dirs[0], z->tmp_index.prefix, MANIFEST_FILE);
+}
 
-    char* filename = argv[1];
-    
-    printf("[Zirka 1-Pass] File: %s (%.2f GB)\n", filename, filesize / 1024.0 / 1024.0 / 1024.0);
-    printf("[Zirka 1-Pass] Hashing to temporary MMAP file (this will use 24x filesize = ~%lu GB disk space)...\n", 
-           (entry_count * sizeof(DiskEntry)) / 1024 / 1024 / 1024);
-*/
-// malloc ]
-   
-// 1. OPEN FILE & GET SIZE [
-    int fd_in = open(argv[1], O_RDONLY);
-    if (fd_in == -1) { perror("Open input failed"); return 1; }
-    char* filename = argv[1];
+static void manifest_init(ZirkaEncoder* z, RunManifest* m, const struct stat* sb, int shards) {
+    memset(m, 0, sizeof(*m));
+    m->magic = MANIFEST_MAGIC;
+    m->version = VERSION;
+    m->chunk_size = CHUNK_SIZE;
+    m->input_size = sb->st_size;
+    m->input_mtime_sec = sb->st_mtim.tv_sec;
+    m->input_mtime_nsec = sb->st_mtim.tv_nsec;
+    m->entry_count = z->entry_count;
+    m->index_entries = z->index_entries;
+    m->pipeline = z->pipeline;
+    m->stripe_unit = z->stripe_unit;
+    m->shards = shards;
+}
 
-    struct stat sb;
-    if (fstat(fd_in, &sb) == -1) { perror("Stat failed"); return 1; }
-    uint64_t filesize = sb.st_size;
-    entry_count = (filesize >= CHUNK_SIZE) ? (filesize - CHUNK_SIZE + 1) : 0;
+// Records 'stage' as completed. Durable: the data is synced before the manifest claims it.
+static void manifest_commit(ZirkaEncoder* z, RunManifest* m, uint64_t stage) {
+    m->stage = stage;
+    m->update_count = z->update_count;
+    m->run_windows = z->run_windows;
+    m->pruned = z->pruned;
+    m->rejected = z->rejected;
+    m->bucket_shift = z->bucket_shift;
+    m->buckets = z->bucket_fill ? z->bucket_count : 0;
+    m->fills_checksum = fills_checksum(z->bucket_fill, m->buckets);
+    m->checksum = manifest_checksum(m);
+    char path[1024], path_new[1040];
+    manifest_path(z, path, sizeof(path));
+    snprintf(path_new, sizeof(path_new), "%s.new", path);
+    int fd = open(path_new, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd == -1) { zwarn(z, "manifest open"); return; }
+    ssize_t fills_bytes = m->buckets * sizeof(uint64_t);
+    if (write(fd, m, sizeof(*m)) != (ssize_t)sizeof(*m) || (fills_bytes && write(fd, z->bucket_fill, fills_bytes) != fills_bytes) || fsync(fd) == -1) zwarn(z, "manifest write");
+    close(fd);
+    if (rename(path_new, path) == -1) zwarn(z, "manifest rename");
+}
 
-    printf("[Zirka 1-Pass] File: %s (%.2f GB)\n", argv[1], filesize / 1024.0 / 1024.0 / 1024.0);
-    printf("[Zirka 1-Pass] Zero-RAM Mode: Input is memory-mapped (OS manages paging).\n");
+// Returns the stage a run may continue from, STAGE_NONE if there is no usable manifest for this input
+static uint64_t manifest_load(ZirkaEncoder* z, RunManifest* m, const struct stat* sb) {
+    char path[1024];
+    manifest_path(z, path, sizeof(path));
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) { zlog(z, "   [Resume] No manifest found, starting from scratch.\n"); return STAGE_NONE; }
+    ssize_t got = read(fd, m, sizeof(*m));
+    uint64_t* fill = NULL;
+    if (got == (ssize_t)sizeof(*m) && m->magic == MANIFEST_MAGIC && m->checksum == manifest_checksum(m) && m->buckets) {
+        fill = malloc(m->buckets * sizeof(uint64_t));
+        if (!fill || read(fd, fill, m->buckets * sizeof(uint64_t)) != (ssize_t)(m->buckets * sizeof(uint64_t)) || fills_checksum(fill, m->buckets) != m->fills_checksum) { free(fill); fill = NULL; got = 0; }
+    }
+    close(fd);
+    if (got != (ssize_t)sizeof(*m) || m->magic != MANIFEST_MAGIC || m->checksum != manifest_checksum(m)) {
+        zlog(z, "   [Resume] Manifest is damaged, starting from scratch.\n"); return STAGE_NONE;
+    }
+    if (m->version != VERSION || m->chunk_size != CHUNK_SIZE || m->entry_count != z->entry_count || m->stripe_unit != z->stripe_unit) {
+        zlog(z, "   [Resume] Manifest was written by a different build, starting from scratch.\n"); return STAGE_NONE;
+    }
+    if (m->input_size != (uint64_t)sb->st_size || m->input_mtime_sec != sb->st_mtim.tv_sec || m->input_mtime_nsec != sb->st_mtim.tv_nsec) {
+        zlog(z, "   [Resume] Input size/mtime changed since the manifest was written, starting from scratch.\n"); return STAGE_NONE;
+    }
+    if (m->index_entries != z->index_entries) {
+        zlog(z, "   [Resume] The index was laid out differently (--tar), starting from scratch.\n"); return STAGE_NONE;
+    }
+    if (m->pipeline == PIPELINE_AUTO || m->pipeline >= PIPELINES || (z->pipeline != PIPELINE_AUTO && m->pipeline != (uint64_t)z->pipeline)) {
+        zlog(z, "   [Resume] The run was started with --engine %s, starting from scratch.\n", m->pipeline < PIPELINES ? pipeline_names[m->pipeline] : "?"); return STAGE_NONE;
+    }
+    z->update_count = m->update_count;
+    z->run_windows = m->run_windows;
+    z->pruned = m->pruned;
+    z->rejected = m->rejected;
+    z->bucket_shift = (int)m->bucket_shift;
+    z->bucket_count = m->buckets;
+    free(z->bucket_fill);
+    z->bucket_fill = fill;
+    zlog(z, "   [Resume] Last completed stage: %s", stage_names[m->stage]);
+    if (m->shards && m->stage == STAGE_HASHED) zlog(z, ", %lu of %lu shards gathered", m->shards_done, m->shards);
+    if (m->stage == STAGE_GATHERED && m->buckets_done) zlog(z, ", %lu of %lu update buckets sorted", m->buckets_done, m->buckets);
+    zlog(z, "\n");
+    return m->stage;
+}
 
-    // 2. MMAP THE INPUT (Zero-RAM Magic)
-    // PROT_READ: We only read. MAP_PRIVATE: Changes (if any) stay local.
-    uint8_t* buffer = mmap(NULL, filesize, PROT_READ, MAP_PRIVATE, fd_in, 0);
-    if (buffer == MAP_FAILED) { perror("mmap input failed"); return 1; }
-    
-    // Hint to OS: We will read this sequentially (speeds up Hashing phase)
-    #ifdef __linux__
-    madvise(buffer, filesize, MADV_SEQUENTIAL);
-    #endif
+static void flush_mmap_file(ZirkaEncoder* z, void* ptr, size_t size) {
+    if (size && msync(ptr, size, MS_SYNC) == -1) zwarn(z, "msync");
+}
 
-    // We can close the file descriptor now; the map stays valid.
-    close(fd_in);
-// 1. OPEN FILE & GET SIZE ]
+// --- STORAGE LAYER (Access-Pattern-Aware Temp I/O) ---
+// Every temp artifact is opened as an Artifact, and each stage declares how it is about to touch it:
+//   ACCESS_SEQ_WRITE / ACCESS_SEQ_SCAN: the stage moves whole blocks (the hash output, the index scan of the gather,
+//   the update buckets, the rank map), so they go through pread/pwrite, or O_DIRECT when the filesystem has it:
+//   no page cache to fill and evict, no dirty-page writeback deciding the I/O sizes, one request per block.
+//   ACCESS_RANDOM: the artifact is mmap-ed (only the in-place index sort needs this).
+// --io picks the backend of the sequential accesses: auto (O_DIRECT where supported, else pread), pread, direct,
+// or mmap (every block is copied through a mapping, the v7 behaviour). Pieces that are not 4 KB aligned
+// always take the buffered descriptor. Bytes moved are counted per artifact and backend.
+#define IO_BLOCK (8ULL * 1024 * 1024) // Default block, --io-block-mb
+#define IO_ALIGN 4096                 // O_DIRECT buffer, offset and length alignment
+
+enum { ACCESS_SEQ_WRITE, ACCESS_SEQ_SCAN, ACCESS_RANDOM };
+enum { BACKEND_AUTO, BACKEND_MMAP, BACKEND_PREAD, BACKEND_DIRECT, BACKEND_COUNT };
+static const char* backend_names[BACKEND_COUNT] = { "auto", "mmap", "pread", "direct" };
+
+typedef struct Artifact {
+    ZirkaEncoder* z;
+    const TempDirs* td;
+    const char* name;
+    uint64_t size;
+    int fds[MAX_TMP_DIRS];
+    int dfds[MAX_TMP_DIRS];        // O_DIRECT descriptors, -1 where the filesystem refuses them (tmpfs)
+    uint8_t* map;                  // Mapping for ACCESS_RANDOM and the mmap backend
+    int access, backend;           // Current access and the backend chosen for it
+    unsigned used;                 // Backends used over the run (bit mask)
+    uint64_t read[BACKEND_COUNT];  // Bytes moved, per backend
+    uint64_t written[BACKEND_COUNT];
+    uint64_t requests;
+    bool borrowed;                 // 'map' is the caller's memory (zirka_encode_buffer): never released, never unmapped
+} Artifact;
+
+static int parse_io_backend(const char* s) {
+    for (int b = 0; b < BACKEND_COUNT; b++) if (strcmp(s, backend_names[b]) == 0) return b;
+    return -1;
+}
 
-    // 1. CREATE DISK INDEX
-    printf("1. Creating Index (24x Filesize using MMAP, %lu entries)...\n", entry_count);
-    DiskEntry* index = create_mmap_file("zirka_index.tmp", entry_count * sizeof(DiskEntry));
-        #ifdef eXdupe
-    printf("   Hashing (Parallel Pippip, taking 128bits=16bytes)...\n");
-        #else
-    printf("   Hashing (Parallel SHA1, taking 128bits=16bytes)...\n");
-        #endif
-    double t_start = omp_get_wtime();
-    // OMP Parallel Hashing
-    #pragma omp parallel for
-    for(uint64_t i=0; i<entry_count; i++) {
-        uint64_t hash_out[3]; // 2 for 16 bytes, 3 for 24
-        //uint8_t digest[SHA1_DIGEST_SIZE];
+static void* io_alloc(ZirkaEncoder* z, uint64_t bytes) {
+    void* p = NULL;
+    if (posix_memalign(&p, IO_ALIGN, bytes ? bytes : IO_ALIGN) != 0) { errno = ENOMEM; zfail(z, "I/O buffer"); }
+    return p;
+}
 
-        //FNV1A_Pippip_128((char*)buffer + i, CHUNK_SIZE, 0, hash_out);
-        #ifdef eXdupe
-        //void FNV1A_Pippip_Yurii_OOO_128bit_AES_TriXZi_Mikayla_forte (const char *str, size_t wrdlen, uint32_t seed, void *output) {
-        FNV1A_Pippip_Yurii_OOO_128bit_AES_TriXZi_Mikayla_forte ((const char *) ((char*)buffer + i), CHUNK_SIZE, 0, hash_out);
-        #else
-        sha1_sum(((char*)buffer + i), CHUNK_SIZE, (uint8_t *)hash_out);
-        #endif
+static void artifact_close(Artifact* a) {
+    if (a->map && !a->borrowed) munmap(a->map, a->size);
+    a->map = NULL;
+    for (int d = 0; d < a->td->ndirs; d++) {
+        if (a->fds[d] >= 0) close(a->fds[d]);
+        if (a->dfds[d] >= 0) close(a->dfds[d]);
+        a->fds[d] = a->dfds[d] = -1;
+    }
+}
 
-        index[i].h1 = hash_out[0];
-        index[i].h2 = hash_out[1];
-        index[i].offset = i;
+// Creates (or, for --resume, re-opens and size-checks) the stripe files of an artifact
+static bool artifact_open(ZirkaEncoder* z, Artifact* a, const TempDirs* td, const char* name, uint64_t size, bool create) {
+    char path[1024];
+    if (a->td == NULL) {
+        memset(a, 0, sizeof(*a));
+        if (z->artifact_count < MAX_ARTIFACTS) z->artifacts[z->artifact_count++] = a;
     }
-    printf("   Hashed in %.2fs\n", omp_get_wtime() - t_start);
+    a->z = z;
+    a->td = td;
+    a->name = name;
+    a->size = size;
+    a->map = NULL;
+    for (int d = 0; d < MAX_TMP_DIRS; d++) a->fds[d] = a->dfds[d] = -1;
+    for (int d = 0; d < td->ndirs; d++) {
+        temp_path(path, td, name, d);
+        uint64_t fsize = (td->ndirs == 1) ? size : stripe_file_size(size, z->stripe_unit, td->ndirs, d);
+        int fd = create ? open(path, O_RDWR | O_CREAT | O_TRUNC, 0666) : open(path, O_RDWR);
+        if (fd == -1) { if (create) zfail(z, "open"); artifact_close(a); return false; }
+        a->fds[d] = fd;
+        struct stat st;
+        if (create) {
+            if (ftruncate(fd, fsize) == -1) zfail(z, "truncate");
+        } else if (fstat(fd, &st) == -1 || (uint64_t)st.st_size != fsize) { artifact_close(a); return false; }
+        a->dfds[d] = open(path, O_RDWR | O_DIRECT);
+    }
+    return true;
+}
 
-    // 2. PARALLEL DISK SORT
-    printf("2. Sorting Disk Index (Parallel Quicksort)...\n");
-    t_start = omp_get_wtime();
-    SortedSoFar = 0;
-    // OMP Parallel Region for Recursion
-    #pragma omp parallel
-    {
-        #pragma omp single nowait
-        {
-        //g_max_threads_used = omp_get_num_threads();
-        omp_quicksort(index, 0, entry_count - 1);
-        }
+// Declares the next access pattern of the artifact and picks its backend
+static void artifact_access(Artifact* a, int access) {
+    ZirkaEncoder* z = a->z;
+    bool direct = true;
+    for (int d = 0; d < a->td->ndirs; d++) if (a->dfds[d] < 0) direct = false;
+    a->access = access;
+    if (access == ACCESS_RANDOM) a->backend = BACKEND_MMAP;
+    else if (z->io_backend == BACKEND_AUTO || z->io_backend == BACKEND_DIRECT) a->backend = direct ? BACKEND_DIRECT : BACKEND_PREAD;
+    else a->backend = z->io_backend;
+    if (a->backend != BACKEND_MMAP && a->map) { munmap(a->map, a->size); a->map = NULL; } // Dirty pages stay in the page cache
+    if (a->backend == BACKEND_MMAP && !a->map) {
+        a->map = map_temp_artifact(z, a->td, a->name, a->size, false);
+        if (!a->map) zfail(z, a->name);
     }
-            printf ("   Sort Progress = %.1f%%\n", 100.0);
-    printf("   Sorted in %.2fs\n", omp_get_wtime() - t_start);
-    //printf("   Max threads executed simultaneously: %d\n", g_max_threads_used);
-    printf("   Total parallel tasks generated: %d\n", g_total_tasks);
+    for (int d = 0; d < a->td->ndirs; d++) posix_fadvise(a->fds[d], 0, 0, access == ACCESS_RANDOM ? POSIX_FADV_RANDOM : POSIX_FADV_SEQUENTIAL);
+    a->used |= 1u << a->backend;
+}
 
-#ifdef rankmapFIRST
-    // --- STAGE 4: BUILDING THE 64-BIT RANK MAP (Dictionary Linker) ---
-    printf("3. Building Rank Map (8x Filesize using MMAP)...\n");
-    uint64_t* rank = create_mmap_file("zirka_rank.tmp", entry_count * sizeof(uint64_t));
-/*
-    printf("\nStage 3: Building 64-bit Rank Map (Linking Duplicates to First Occurrence)...\n");
-    // Allocate the Rank Map (uint64_t)
-    uint64_t* rank = mmap(NULL, filesize * sizeof(uint64_t), PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
-*/  
+// Stripe file holding logical offset 'off', the offset inside it, and the bytes left in that stripe piece
+static int artifact_piece(const Artifact* a, uint64_t off, uint64_t* file_off, uint64_t* left) {
+    int nd = a->td->ndirs;
+    if (nd == 1) { *file_off = off; *left = a->size - off; return 0; }
+    uint64_t unit = a->z->stripe_unit, k = off / unit;
+    *file_off = (k / nd) * unit + off % unit;
+    *left = unit - off % unit;
+    return (int)(k % nd);
+}
 
-    // OPTIMIZATION: Use Huge Pages if available to reduce TLB misses during random writes
-    //#ifdef __linux__
-    madvise(rank, filesize * sizeof(uint64_t), MADV_HUGEPAGE);
-    //#endif
-  
-// SLOW [
+// First request of a transfer at 'off' from/to 'p': descriptor, file offset and backend, returns its length
+static uint64_t artifact_request(const Artifact* a, const uint8_t* p, uint64_t len, uint64_t off, int* fd, uint64_t* file_off, int* backend) {
+    uint64_t left;
+    int d = artifact_piece(a, off, file_off, &left);
+    uint64_t n = (len < left) ? len : left;
+    *fd = a->fds[d];
+    *backend = BACKEND_PREAD;
+    if (a->backend == BACKEND_DIRECT && a->dfds[d] >= 0 && ((uintptr_t)p | *file_off) % IO_ALIGN == 0 && n >= IO_ALIGN) {
+        n &= ~(uint64_t)(IO_ALIGN - 1); // The unaligned tail follows through the buffered descriptor
+        *fd = a->dfds[d];
+        *backend = BACKEND_DIRECT;
+    }
+    return n;
+}
 
-    uint64_t prcnt = 0;
-    // 4.1 Initialize Rank Map to NULL
-    #pragma omp parallel for
-    for(uint64_t i = 0; i < filesize; i++) rank[i] = NULL_RANK;
+static void artifact_count(Artifact* a, int backend, uint64_t bytes, bool write) {
+    uint64_t* stat = write ? a->written : a->read;
+    #pragma omp atomic
+    stat[backend] += bytes;
+    #pragma omp atomic
+    a->z->stage_io.bytes += bytes;
+    if (backend == BACKEND_MMAP) return;
+    #pragma omp atomic
+    a->requests++;
+}
 
-    // 4.2 Fill Rank Map based on "First Occurrence"
-    for (uint64_t i = 0; i < entry_count; i++) {
-        uint64_t group_start = i;
+// Moves [off, off + len) between 'buf' and the artifact; safe to call from several threads on disjoint ranges
+static void artifact_io(Artifact* a, void* buf, uint64_t len, uint64_t off, bool write) {
+    if (a->backend == BACKEND_MMAP) {
+        if (write) memcpy(a->map + off, buf, len); else memcpy(buf, a->map + off, len);
+        if (a->access != ACCESS_RANDOM && !a->borrowed) governor_release_shared(a->z, a->map, off, off + len); // Not touched again by this sweep
+        artifact_count(a, BACKEND_MMAP, len, write);
+        return;
+    }
+    uint8_t* p = buf;
+    while (len) {
+        int fd, backend;
+        uint64_t foff;
+        uint64_t n = artifact_request(a, p, len, off, &fd, &foff, &backend);
+        ssize_t r = write ? pwrite(fd, p, n, foff) : pread(fd, p, n, foff);
+        if (r <= 0) zfail(a->z, write ? "artifact write" : "artifact read");
+        p += r; off += r; len -= r;
+        artifact_count(a, backend, r, write);
+    }
+}
 
-        prcnt++;
-        if (prcnt == 17*1024) {printf("\rDone: %.1f%%", (double)i/entry_count*100.0); prcnt = 0;}
-        
-        // Find all records with identical hashes
-        while (i + 1 < entry_count && 
-               index[i+1].h2 == index[group_start].h2 && 
-               index[i+1].h1 == index[group_start].h1) {
-            i++;
-        }
+// Elements of 'elem_size' bytes per I/O block, in whole O_DIRECT units
+static uint64_t io_block_elems(ZirkaEncoder* z, uint64_t elem_size) {
+    uint64_t n = z->io_block / elem_size / IO_ALIGN * IO_ALIGN;
+    return n ? n : IO_ALIGN;
+}
 
-        uint64_t group_size = (i - group_start) + 1;
+static void artifact_write(Artifact* a, const void* buf, uint64_t len, uint64_t off) { artifact_io(a, (void*)buf, len, off, true); }
 
-        // Logic: If there is more than one, we have duplicates
-        if (group_size > 1) {
-            // Because our sort tie-breaker was 'offset', index[group_start] is the FIRST appearance
-            uint64_t master_offset = index[group_start].offset;
+// Everything written so far is on the device (checkpoint before a manifest commit)
+static void artifact_sync(Artifact* a) {
+    if (a->map) flush_mmap_file(a->z, a->map, a->size);
+    for (int d = 0; d < a->td->ndirs; d++) if (a->fds[d] >= 0 && fdatasync(a->fds[d]) == -1) zwarn(a->z, "artifact sync");
+}
 
-            // Map every subsequent appearance back to the master_offset
-            for (uint64_t j = group_start + 1; j <= i; j++) {
-                uint64_t duplicate_pos = index[j].offset;
-                rank[duplicate_pos] = master_offset;
-            }
+static uint64_t artifact_moved(const Artifact* a, int backend) { return a->read[backend] + a->written[backend]; }
+
+static void artifact_report(ZirkaEncoder* z) {
+    for (int i = 0; i < z->artifact_count; i++) {
+        const Artifact* a = z->artifacts[i];
+        uint64_t rd = 0, wr = 0;
+        for (int b = 0; b < BACKEND_COUNT; b++) { rd += a->read[b]; wr += a->written[b]; }
+        zlog(z, "   [IO] %-18s: read %8.1f MB, written %8.1f MB (", a->name, rd / 1048576.0, wr / 1048576.0);
+        const char* sep = "";
+        for (int b = BACKEND_MMAP; b < BACKEND_COUNT; b++) {
+            if (!(a->used & (1u << b)) && !artifact_moved(a, b)) continue;
+            if (b == BACKEND_MMAP && !artifact_moved(a, b)) zlog(z, "%smmap in place", sep); // Random access, paged by the kernel
+            else zlog(z, "%s%s %.1f MB", sep, backend_names[b], artifact_moved(a, b) / 1048576.0);
+            sep = ", ";
         }
+        zlog(z, ", %lu requests)\n", a->requests);
     }
-    printf("\nRank Map linking complete.\n");
+}
 
-// SLOW ]
+// The input as a read-only artifact, so the hashing stage can stream it through the same layer ('map' serves --io mmap).
+// 'fd' is read through a duplicate (and an O_DIRECT reopen of it); without one (a caller's buffer) only the map is used.
+static void artifact_open_input(ZirkaEncoder* z, Artifact* a, int fd, uint64_t size, const uint8_t* map) {
+    static const TempDirs input_td = { { "." }, 1, "" };
+    memset(a, 0, sizeof(*a));
+    if (z->artifact_count < MAX_ARTIFACTS) z->artifacts[z->artifact_count++] = a;
+    a->z = z;
+    a->td = &input_td;
+    a->name = "input";
+    a->size = size;
+    for (int d = 0; d < MAX_TMP_DIRS; d++) a->fds[d] = a->dfds[d] = -1;
+    a->map = (uint8_t*)map; // Unmapped by artifact_close, unless it is the caller's
+    a->access = ACCESS_SEQ_SCAN;
+    if (fd < 0) {
+        a->borrowed = true;
+        a->backend = BACKEND_MMAP;
+        a->used = 1u << a->backend;
+        return;
+    }
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+    a->fds[0] = dup(fd);
+    if (a->fds[0] == -1) zfail(z, "input");
+    a->dfds[0] = open(path, O_RDONLY | O_DIRECT);
+    if (z->io_backend == BACKEND_MMAP || z->io_backend == BACKEND_PREAD) a->backend = z->io_backend;
+    else a->backend = (a->dfds[0] >= 0) ? BACKEND_DIRECT : BACKEND_PREAD;
+    a->used = 1u << a->backend;
+}
 
-/*
-// --- 4.2 Optimised Parallel Rank Filling --- [
-    printf("\n   [Boost] Linking duplicates (Parallel)...\n");
+// --- ASYNC I/O ENGINE (io_uring, Thread-Pool Fallback) ---
+// The block sweeps of the storage layer run ahead of (reads) and behind (writes) the compute that consumes them.
+// A queue owns 'depth' slot buffers; a slot is submitted as one transfer (split into per-stripe requests) and is only
+// waited for when its buffer is needed again, so a stage keeps depth x block bytes in flight while the threads hash,
+// gather or sort. io_uring is driven through the raw syscalls, with the slot buffers registered (READ_FIXED/WRITE_FIXED).
+// Where io_uring is unavailable (old kernel, seccomp) or with --io-engine threads, a pool of worker threads
+// issues the same transfers with pread/pwrite. Every stage reports its bandwidth and the queue depth it achieved.
+#define IO_DEPTH 8
+#define IO_DEPTH_MAX 64
+#define IO_RING_REQUESTS 16                      // Ring entries per slot (stripe pieces and unaligned tails)
+#define IO_POOL_FIFO (4 * IO_DEPTH_MAX)          // Transfers waiting for a pool thread; a job finding it full waits
+
+enum { ENGINE_AUTO, ENGINE_URING, ENGINE_THREADS, ENGINE_COUNT };
+static const char* engine_names[ENGINE_COUNT] = { "auto", "uring", "threads" };
 
-    // OPTIMIZATION: Use Huge Pages if available to reduce TLB misses during random writes
-    #ifdef __linux__
-    madvise(rank, filesize * sizeof(uint64_t), MADV_HUGEPAGE);
-    #endif
+typedef struct {
+    int fd;
+    unsigned sq_entries, cq_entries;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe* sqes;
+    struct io_uring_cqe* cqes;
+    void* sq_ptr;
+    void* cq_ptr;
+    size_t sq_size, cq_size;
+    unsigned queued;             // Pushed to the SQ, not yet submitted
+} Ring;
 
-    // We use a counter to track progress across threads
-    uint64_t processed_count = 0;
+typedef struct {
+    Artifact* a;
+    uint64_t len, off;
+    bool write;
+    int pending;                 // Ring requests, or pool transfers, not completed yet
+} IoSlot;
 
-    #pragma omp parallel for schedule(dynamic, 2048)
-    for (uint64_t i = 0; i < entry_count; i++) {
-        
-        // 1. EFFICIENT SKIP: 
-        // We only want to process the "Group Start". 
-        // If 'i' is NOT the first element of a group, skip it immediately.
-        // (Comparison with i-1 is safe in parallel read-only)
-        if (i > 0) {
-            if (index[i].h2 == index[i-1].h2 && index[i].h1 == index[i-1].h1) {
-                continue; 
-            }
-        }
+typedef struct {
+    int slot, fd;
+    uint8_t* p;
+    uint64_t len, file_off;
+    bool write;
+} IoRequest;
+
+typedef struct IoQueue {
+    ZirkaEncoder* z;
+    int depth;
+    uint64_t slot_bytes;
+    uint8_t* buf[IO_DEPTH_MAX];
+    IoSlot slot[IO_DEPTH_MAX];
+    bool uring, fixed;
+    Ring ring;
+    IoRequest* req;              // One per CQ entry, indexed by user_data
+    int* req_free;
+    int nfree;
+    pthread_mutex_t lock;        // Pool transfers complete on worker threads
+    pthread_cond_t done;
+} IoQueue;
+
+// Requests in flight over time, integrated per stage
+static double io_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
 
-        // 2. SCAN FORWARD:
-        // Since we are the "Group Leader", we scan strictly forward to find our duplicates.
-        uint64_t group_start = i;
-        uint64_t master_offset = index[group_start].offset; // First Occurrence
+static void io_inflight(ZirkaEncoder* z, int delta) {
+    pthread_mutex_lock(&z->stage_io_lock);
+    double now = io_now();
+    z->stage_io.qd_area += z->stage_io.qd * (now - z->stage_io.t_last);
+    z->stage_io.t_last = now;
+    z->stage_io.qd += delta;
+    if (z->stage_io.qd > z->stage_io.qd_max) z->stage_io.qd_max = z->stage_io.qd;
+    pthread_mutex_unlock(&z->stage_io_lock);
+}
 
-        // Look ahead
-        uint64_t look = group_start + 1;
-        
-        // Note: This inner while loop is fast because sorted identical hashes are adjacent.
-        while (look < entry_count && 
-               index[look].h2 == index[group_start].h2 && 
-               index[look].h1 == index[group_start].h1) {
-            
-            // 3. WRITE TO RANK MAP
-            // 'duplicate_pos' is random, so this is the bottleneck. 
-            // Parallelism helps saturate the I/O queue here.
-            uint64_t duplicate_pos = index[look].offset;
-            rank[duplicate_pos] = master_offset;
-            
-            look++;
-        }
+// -- io_uring (raw syscalls) --
+static bool ring_init(Ring* r, unsigned entries) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    memset(r, 0, sizeof(*r));
+    r->fd = (int)syscall(__NR_io_uring_setup, entries, &p);
+    if (r->fd < 0) return false;
+    r->sq_entries = p.sq_entries;
+    r->cq_entries = p.cq_entries;
+    r->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    bool single = p.features & IORING_FEAT_SINGLE_MMAP;
+    if (single && r->cq_size > r->sq_size) r->sq_size = r->cq_size;
+    r->sq_ptr = mmap(NULL, r->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    r->cq_ptr = single ? r->sq_ptr : mmap(NULL, r->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+    r->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if (r->sq_ptr == MAP_FAILED || r->cq_ptr == MAP_FAILED || r->sqes == MAP_FAILED) { close(r->fd); return false; }
+    uint8_t* sq = r->sq_ptr;
+    uint8_t* cq = r->cq_ptr;
+    r->sq_head = (unsigned*)(sq + p.sq_off.head);
+    r->sq_tail = (unsigned*)(sq + p.sq_off.tail);
+    r->sq_mask = (unsigned*)(sq + p.sq_off.ring_mask);
+    r->sq_array = (unsigned*)(sq + p.sq_off.array);
+    r->cq_head = (unsigned*)(cq + p.cq_off.head);
+    r->cq_tail = (unsigned*)(cq + p.cq_off.tail);
+    r->cq_mask = (unsigned*)(cq + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+    return true;
+}
 
-        // 4. PROGRESS BAR (Atomic update to avoid race condition)
-        if (i % 4096 == 0) {
-            #pragma omp atomic
-            processed_count += 4096;
-            
-            // Only one thread prints
-            if (omp_get_thread_num() == 0) {
-                printf("\r   Linked: %.1f%%", (double)processed_count / entry_count * 100.0);
-                fflush(stdout);
-            }
+static void ring_free(Ring* r) {
+    munmap(r->sqes, r->sq_entries * sizeof(struct io_uring_sqe));
+    if (r->cq_ptr != r->sq_ptr) munmap(r->cq_ptr, r->cq_size);
+    munmap(r->sq_ptr, r->sq_size);
+    close(r->fd);
+}
+
+static void ring_enter(Ring* r, unsigned min_complete) {
+    for (;;) {
+        int n = (int)syscall(__NR_io_uring_enter, r->fd, r->queued, min_complete, min_complete ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+        if (n < 0) {
+            if (errno == EINTR || errno == EAGAIN || errno == EBUSY) continue;
+            perror("io_uring_enter");
+            exit(1); // Another thread may be waiting on this ring
         }
+        r->queued -= ((unsigned)n < r->queued) ? (unsigned)n : r->queued;
+        if (r->queued == 0 || min_complete) return;
     }
-    printf("\n   [Boost] Parallel Linking Complete.\n");
-// --- 4.2 Optimised Parallel Rank Filling --- ]
-*/
-
-    // Clear index to free up memory before the final pass
-    //munmap(index, entry_count * sizeof(DiskEntry));
+}
 
-    // --- STAGE 5: ENCODING (O(1) Pass) ---
-    printf("Stage 4: Encoding with O(1) Rank Lookups...\n");
-    char out_name[512]; snprintf(out_name, 512, "%s.zirka", argv[1]);
-    FILE* fout = fopen(out_name, "wb");
-    uint64_t pos = 0;
-    
-    while(pos < filesize) {
-        // Instant check: Does this position have a link to a first occurrence?
-        uint64_t match_off = rank[pos];
+static void ring_push(Ring* r, int opcode, int fd, void* addr, uint32_t len, uint64_t off, int buf_index, uint64_t user_data) {
+    unsigned tail = *r->sq_tail;
+    if (tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) == r->sq_entries) { ring_enter(r, 0); tail = *r->sq_tail; }
+    unsigned idx = tail & *r->sq_mask;
+    struct io_uring_sqe* sqe = &r->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)addr;
+    sqe->len = len;
+    sqe->off = off;
+    sqe->buf_index = buf_index;
+    sqe->user_data = user_data;
+    r->sq_array[idx] = idx;
+    __atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    r->queued++;
+}
 
-        if (match_off != NULL_RANK) {
-            // master_offset is always < pos because we linked j = group_start + 1 onwards
-            if (memcmp(buffer + pos, buffer + match_off, CHUNK_SIZE) == 0) {
-                fputc(MAGIC_BYTE, fout);
-                fwrite(&match_off, 8, 1, fout); // Point back to master
-                uint32_t chk = calc_fnv_off(match_off);
-                fwrite(&chk, 4, 1, fout);
-                pos += CHUNK_SIZE;
-                continue;
-            }
+// Completes every finished request, waiting for at least one when 'wait'. A short transfer is finished synchronously.
+static void ring_reap(IoQueue* q, bool wait) {
+    Ring* r = &q->ring;
+    unsigned head = *r->cq_head;
+    bool empty = head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+    if (r->queued || (wait && empty)) ring_enter(r, (wait && empty) ? 1 : 0);
+    for (;;) {
+        if (head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) break;
+        struct io_uring_cqe* cqe = &r->cqes[head & *r->cq_mask];
+        IoRequest* rq = &q->req[cqe->user_data];
+        int res = cqe->res;
+        head++;
+        __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+        if (res < 0) { errno = -res; zfail(q->z, rq->write ? "io_uring write" : "io_uring read"); }
+        for (uint64_t done = (uint64_t)res; done < rq->len; ) {
+            ssize_t n = rq->write ? pwrite(rq->fd, rq->p + done, rq->len - done, rq->file_off + done) : pread(rq->fd, rq->p + done, rq->len - done, rq->file_off + done);
+            if (n <= 0) zfail(q->z, rq->write ? "artifact write" : "artifact read");
+            done += n;
         }
-        
-        // Literal byte
-        fputc(buffer[pos], fout);
-        pos++;
+        q->slot[rq->slot].pending--;
+        q->req_free[q->nfree++] = (int)cqe->user_data;
+        io_inflight(q->z, -1);
     }
+}
 
-    printf("\nDone.\n");
-    fclose(fout);
-    free(buffer);
-    
-    munmap(index, entry_count * sizeof(DiskEntry));
-    munmap(rank, entry_count * sizeof(uint64_t));
-    //unlink("zirka_index.tmp");
-    //unlink("zirka_rank.tmp");
-    return 0;
-#endif
+// -- Thread pool (shared by all the jobs of the process, it grows to the deepest queue asked for) --
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t ready, space;
+    IoQueue* q[IO_POOL_FIFO];
+    int s[IO_POOL_FIFO];
+    int head, count, workers;
+} IoPool;
+
+static IoPool g_io_pool = { .lock = PTHREAD_MUTEX_INITIALIZER, .ready = PTHREAD_COND_INITIALIZER, .space = PTHREAD_COND_INITIALIZER };
+
+static void* io_worker(void* arg) {
+    (void)arg;
+    for (;;) {
+        pthread_mutex_lock(&g_io_pool.lock);
+        while (g_io_pool.count == 0) pthread_cond_wait(&g_io_pool.ready, &g_io_pool.lock);
+        IoQueue* q = g_io_pool.q[g_io_pool.head];
+        int s = g_io_pool.s[g_io_pool.head];
+        g_io_pool.head = (g_io_pool.head + 1) % IO_POOL_FIFO;
+        g_io_pool.count--;
+        pthread_cond_signal(&g_io_pool.space);
+        pthread_mutex_unlock(&g_io_pool.lock);
+
+        IoSlot* sl = &q->slot[s];
+        artifact_io(sl->a, q->buf[s], sl->len, sl->off, sl->write);
+        io_inflight(q->z, -1);
+        pthread_mutex_lock(&q->lock);
+        sl->pending = 0;
+        pthread_cond_broadcast(&q->done);
+        pthread_mutex_unlock(&q->lock);
+    }
+    return NULL;
+}
 
-#ifdef rankmap
-    // 3. BUILD RANK MAP (Parallel)
-    printf("3. Building Rank Map (8x Filesize using MMAP)...\n");
-    uint64_t* rank = create_mmap_file("zirka_rank.tmp", entry_count * sizeof(uint64_t));
-    
-    #pragma omp parallel for
-    for(uint64_t i=0; i<entry_count; i++) {
-        rank[index[i].offset] = (uint64_t)i;
+static void io_pool_push(IoQueue* q, int s) {
+    pthread_mutex_lock(&g_io_pool.lock);
+    while (g_io_pool.workers < q->z->io_depth) {
+        pthread_t tid;
+        if (pthread_create(&tid, NULL, io_worker, NULL) != 0) { fprintf(stderr, "I/O worker: cannot create a thread\n"); exit(1); }
+        pthread_detach(tid);
+        g_io_pool.workers++;
+    }
+    while (g_io_pool.count == IO_POOL_FIFO) pthread_cond_wait(&g_io_pool.space, &g_io_pool.lock); // Concurrent jobs: the workers always drain it
+    int tail = (g_io_pool.head + g_io_pool.count) % IO_POOL_FIFO;
+    g_io_pool.q[tail] = q;
+    g_io_pool.s[tail] = s;
+    g_io_pool.count++;
+    pthread_cond_signal(&g_io_pool.ready);
+    pthread_mutex_unlock(&g_io_pool.lock);
+}
+
+// -- Queues --
+// Every slot is touched (and registered with the ring) up front, so it is resident for the whole stage: 'slot_bytes' must
+// be the largest transfer the caller will really make (a run of updates, one block), never a worst-case region.
+static void io_queue_init(ZirkaEncoder* z, IoQueue* q, int depth, uint64_t slot_bytes) {
+    memset(q, 0, sizeof(*q));
+    q->z = z;
+    q->depth = (depth < 1) ? 1 : (depth > IO_DEPTH_MAX) ? IO_DEPTH_MAX : depth;
+    q->slot_bytes = slot_bytes;
+    for (int s = 0; s < q->depth; s++) { q->buf[s] = io_alloc(z, slot_bytes); numa_touch(z, q->buf[s], slot_bytes); }
+    pthread_mutex_init(&q->lock, NULL);
+    pthread_cond_init(&q->done, NULL);
+    for (int i = 0; i < MAX_QUEUES; i++) if (!z->queues[i]) { z->queues[i] = q; break; }
+    if (z->io_engine == ENGINE_THREADS) return;
+    if (!ring_init(&q->ring, q->depth * IO_RING_REQUESTS)) {
+        if (z->io_engine == ENGINE_URING) zfail(z, "io_uring_setup");
+        zlog(z, "   [IO] io_uring unavailable (%s), using a pool of %d I/O threads.\n", strerror(errno), z->io_depth);
+        z->io_engine = ENGINE_THREADS;
+        return;
+    }
+    z->io_engine = ENGINE_URING;
+    q->uring = true;
+    q->req = malloc(q->ring.cq_entries * sizeof(IoRequest));
+    q->req_free = malloc(q->ring.cq_entries * sizeof(int));
+    if (!q->req || !q->req_free) zfail(z, "I/O requests");
+    for (unsigned i = 0; i < q->ring.cq_entries; i++) q->req_free[q->nfree++] = (int)i;
+    // Registered buffers are pinned once instead of per request (refused beyond RLIMIT_MEMLOCK: plain READ/WRITE then)
+    struct iovec iov[IO_DEPTH_MAX];
+    for (int s = 0; s < q->depth; s++) { iov[s].iov_base = q->buf[s]; iov[s].iov_len = slot_bytes; }
+    q->fixed = syscall(__NR_io_uring_register, q->ring.fd, IORING_REGISTER_BUFFERS, iov, q->depth) == 0;
+}
+
+// Starts moving 'len' bytes at 'off' of the artifact between it and slot 's' (the slot must be idle)
+static void io_queue_submit(IoQueue* q, int s, Artifact* a, uint64_t len, uint64_t off, bool write) {
+    IoSlot* sl = &q->slot[s];
+    sl->a = a;
+    sl->len = len;
+    sl->off = off;
+    sl->write = write;
+    sl->pending = 0;
+    if (len == 0) return;
+    if (a->backend == BACKEND_MMAP) { artifact_io(a, q->buf[s], len, off, write); return; } // A memcpy, nothing to overlap
+    if (!q->uring) {
+        sl->pending = 1;
+        io_inflight(q->z, +1);
+        io_pool_push(q, s);
+        return;
+    }
+    uint8_t* p = q->buf[s];
+    while (len) {
+        int fd, backend;
+        uint64_t foff;
+        uint64_t n = artifact_request(a, p, len, off, &fd, &foff, &backend);
+        if (n > (1ULL << 30)) n = 1ULL << 30; // One SQE moves at most 2^32 - 1 bytes
+        while (q->nfree == 0) ring_reap(q, true);
+        int id = q->req_free[--q->nfree];
+        q->req[id] = (IoRequest){ s, fd, p, n, foff, write };
+        int op = q->fixed ? (write ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED) : (write ? IORING_OP_WRITE : IORING_OP_READ);
+        ring_push(&q->ring, op, fd, p, (uint32_t)n, foff, s, (uint64_t)id);
+        sl->pending++;
+        io_inflight(q->z, +1);
+        artifact_count(a, backend, n, write);
+        p += n; off += n; len -= n;
+    }
+    ring_enter(&q->ring, 0);
+}
+
+// Waits until slot 's' is idle and returns its buffer
+static uint8_t* io_queue_wait(IoQueue* q, int s) {
+    IoSlot* sl = &q->slot[s];
+    if (q->uring) {
+        while (sl->pending) ring_reap(q, true);
+    } else {
+        pthread_mutex_lock(&q->lock);
+        while (sl->pending) pthread_cond_wait(&q->done, &q->lock);
+        pthread_mutex_unlock(&q->lock);
+    }
+    return q->buf[s];
+}
+
+static void io_queue_free(IoQueue* q) {
+    for (int i = 0; i < MAX_QUEUES; i++) if (q->z->queues[i] == q) q->z->queues[i] = NULL;
+    for (int s = 0; s < q->depth; s++) { io_queue_wait(q, s); free(q->buf[s]); }
+    if (q->uring) { ring_free(&q->ring); free(q->req); free(q->req_free); }
+    pthread_mutex_destroy(&q->lock);
+    pthread_cond_destroy(&q->done);
+}
+
+// -- Sequential reader: blocks of [from, to) in order, 'depth' of them in flight ahead of the consumer.
+// Each block is read with 'extra' more bytes (clipped to the artifact) so windows may run past its end.
+typedef struct {
+    IoQueue q;
+    Artifact* a;
+    uint64_t next, end, block, extra;
+    uint64_t off[IO_DEPTH_MAX], n[IO_DEPTH_MAX];
+    int head, cur;
+} IoReader;
+
+static void io_reader_issue(IoReader* r, int s) {
+    uint64_t n = (r->end - r->next < r->block) ? r->end - r->next : r->block;
+    uint64_t len = (r->next + n + r->extra < r->a->size) ? n + r->extra : r->a->size - r->next;
+    r->off[s] = r->next;
+    r->n[s] = n;
+    io_queue_submit(&r->q, s, r->a, len, r->next, false);
+    r->next += n;
+}
+
+static void io_reader_start(IoReader* r, Artifact* a, uint64_t from, uint64_t to, uint64_t block, uint64_t extra) {
+    io_queue_init(a->z, &r->q, a->z->io_depth, block + extra);
+    r->a = a;
+    r->next = from;
+    r->end = to;
+    r->block = block;
+    r->extra = extra;
+    r->head = 0;
+    r->cur = -1;
+    for (int s = 0; s < r->q.depth; s++) r->n[s] = 0;
+    for (int s = 0; s < r->q.depth && r->next < r->end; s++) io_reader_issue(r, s);
+}
+
+// Next block (NULL at the end): its offset and length; the previous block is recycled for a read further ahead
+static uint8_t* io_reader_next(IoReader* r, uint64_t* off, uint64_t* n) {
+    if (r->cur >= 0) {
+        r->n[r->cur] = 0;
+        if (r->next < r->end) io_reader_issue(r, r->cur);
+    }
+    int s = r->head;
+    if (r->n[s] == 0) { r->cur = -1; return NULL; }
+    r->head = (r->head + 1) % r->q.depth;
+    r->cur = s;
+    *off = r->off[s];
+    *n = r->n[s];
+    return io_queue_wait(&r->q, s);
+}
+
+// -- Sequential writer: fill the buffer it hands out, submit it, and up to 'depth' writes stay in flight behind
+typedef struct {
+    IoQueue q;
+    int next;
+} IoWriter;
+
+static void io_writer_start(ZirkaEncoder* z, IoWriter* w, int depth, uint64_t block) {
+    io_queue_init(z, &w->q, depth, block);
+    w->next = 0;
+}
+
+static uint8_t* io_writer_buffer(IoWriter* w) { return io_queue_wait(&w->q, w->next); }
+
+static void io_writer_submit(IoWriter* w, Artifact* a, uint64_t len, uint64_t off) {
+    io_queue_submit(&w->q, w->next, a, len, off, true);
+    w->next = (w->next + 1) % w->q.depth;
+}
+
+// Stage boundaries (called from metrics_begin / metrics_end)
+static void io_stage_begin(ZirkaEncoder* z) {
+    pthread_mutex_lock(&z->stage_io_lock);
+    unsigned qd = z->stage_io.qd;
+    memset(&z->stage_io, 0, sizeof(z->stage_io));
+    z->stage_io.qd = z->stage_io.qd_max = qd;
+    z->stage_io.t0 = z->stage_io.t_last = io_now();
+    pthread_mutex_unlock(&z->stage_io_lock);
+}
+
+static void io_stage_end(ZirkaEncoder* z, StageIo* out, const char* name) {
+    io_inflight(z, 0);
+    pthread_mutex_lock(&z->stage_io_lock);
+    *out = z->stage_io;
+    out->t_last -= out->t0; // Duration
+    pthread_mutex_unlock(&z->stage_io_lock);
+    if (!out->bytes) return;
+    zlog(z, "   [IO] %s: %.1f MB at %.1f MB/s, queue depth %.1f avg / %u max (%s)\n", name ? name : "stage", out->bytes / 1048576.0,
+           out->t_last > 0 ? out->bytes / 1048576.0 / out->t_last : 0.0, out->t_last > 0 ? out->qd_area / out->t_last : 0.0, out->qd_max,
+           out->qd_max == 0 ? "synchronous" : z->io_engine == ENGINE_URING ? "io_uring" : "I/O thread pool");
+}
+
+/*
+Algorithm:
+
+Create a temporary file updates.bin.
+
+In Stage 4.2 loop: Instead of writing to rank, write the pair {duplicate_pos, master_offset} to updates.bin. (This is fast sequential write).
+
+Sort updates.bin by duplicate_pos.
+
+Read updates.bin and write to rank. Since updates.bin is now sorted by position, you will write to rank in perfect order (0, 1, 2...), which is 100x faster on disk.
+
+To implement the "Nuclear Option" (sorting updates to convert random I/O into sequential I/O), we need to modify the code structure slightly.
+
+This approach eliminates the disk thrashing by:
+
+Gathering all duplicate pointers into a temporary linear array (fast sequential write).
+
+Sorting that array by file position (so the target addresses become monotonic).
+
+Applying the updates to the Rank Map in one clean sweep (fast sequential/monotonic write).
+
+Here is the complete solution.
+
+1. Add these Definitions (Top of File)
+Place these before main(), alongside the existing DiskEntry and omp_quicksort. This defines the structure for the updates and a specific sorter for them.
+*/
+
+// --- NUCLEAR OPTION HELPERS ---
+typedef struct {
+    uint64_t pos;    // Where in the file the duplicate is (The Random Address)
+    uint64_t target; // The Master Offset it should point to (The Value)
+} RankUpdate;
+
+// --- RANGE-BUCKETED UPDATES (Nuclear Scatter) ---
+// Every position is a duplicate at most once, so the positions [b*S, (b+1)*S) of bucket b never yield more than S updates.
+// The updates log is therefore cut into fixed regions of S entries: the gather scatters each update into the region of
+// its bucket through per-thread write-combining buffers (one atomic reservation per flushed buffer, none per group),
+// and each bucket is then read into RAM and ordered with a direct-address counting sort (one slot per position, the keys are unique).
+// Linear time instead of a second quicksort over the whole log, and region b only ever feeds rank[b*S, (b+1)*S).
+// The regions are sized for the worst case, the RAM is not: runs hold the longest fill, and a sparse bucket is sorted and
+// applied in panes of one I/O block of positions, so the slots and rank windows never cover the whole span.
+#define BUCKET_SHIFT_MAX 25                          // 32M positions (3 GB to apply and verify if every one is a duplicate) per bucket
+#define BUCKET_SHIFT_MIN 12
+#define BUCKET_COUNT_MAX 65536                       // Fill counts are checkpointed with the manifest
+#define BUCKET_WC_BYTES (8ULL * 1024 * 1024)         // Write-combining buffers per thread (all buckets together)
+#define BUCKET_COMMIT_EVERY 16                       // Sorted buckets between two manifest commits
+#define BUCKET_RUNS 3                                // Runs in RAM while sorting: one being read, one sorted, one written
+
+typedef struct {
+    ZirkaEncoder* z;
+    Artifact* log;
+    RankUpdate* buf;
+    uint32_t* used;
+    uint32_t per;
+    uint64_t pushed;
+} BucketWriter;
+
+// Largest bucket span whose slots and runs would fit the RAM budget even if every position had an update, small enough to
+// keep the bucket count bounded. The budget is only a cap: the buffers are sized later from the fills and panes (sort below).
+static void buckets_init(ZirkaEncoder* z, uint64_t ram) {
+    // Per position: sorting holds the slots and BUCKET_RUNS runs; applying two windows, two runs and 2 x 24 bytes of verify segments
+    uint64_t per = sizeof(uint64_t) + BUCKET_RUNS * sizeof(RankUpdate);
+    uint64_t apply = 2 * (sizeof(uint64_t) + sizeof(RankUpdate) + 3 * sizeof(uint64_t));
+    if (apply > per) per = apply;
+    int shift = BUCKET_SHIFT_MAX;
+    while (shift > BUCKET_SHIFT_MIN && (per << shift) > ram) shift--;
+    while (shift > BUCKET_SHIFT_MIN && (1ULL << (shift - 1)) >= z->entry_count) shift--;
+    while ((z->entry_count >> shift) >= BUCKET_COUNT_MAX) shift++;
+    z->bucket_shift = shift;
+    z->bucket_count = (z->entry_count + (1ULL << shift) - 1) >> shift;
+    free(z->bucket_fill);
+    z->bucket_fill = calloc(z->bucket_count ? z->bucket_count : 1, sizeof(uint64_t));
+    if (!z->bucket_fill) zfail(z, "bucket fills");
+}
+
+// Byte offset of the region of bucket b in the updates log
+static inline uint64_t bucket_run(const ZirkaEncoder* z, uint64_t b) {
+    return (b << z->bucket_shift) * sizeof(RankUpdate);
+}
+
+static void bucket_writer_init(BucketWriter* w, Artifact* log) {
+    ZirkaEncoder* z = w->z = log->z;
+    w->log = log;
+    w->per = (uint32_t)(BUCKET_WC_BYTES / sizeof(RankUpdate) / (z->bucket_count ? z->bucket_count : 1));
+    if (w->per < 16) w->per = 16;
+    w->buf = malloc((size_t)w->per * z->bucket_count * sizeof(RankUpdate));
+    w->used = calloc(z->bucket_count, sizeof(uint32_t));
+    if (!w->buf || !w->used) zfail(z, "bucket buffers");
+    w->pushed = 0;
+}
+
+static void bucket_flush(BucketWriter* w, uint64_t b) {
+    uint64_t at;
+    #pragma omp atomic capture
+    { at = w->z->bucket_fill[b]; w->z->bucket_fill[b] += w->used[b]; }
+    artifact_write(w->log, w->buf + b * w->per, w->used[b] * sizeof(RankUpdate), bucket_run(w->z, b) + at * sizeof(RankUpdate));
+    w->used[b] = 0;
+}
+
+static inline void bucket_push(BucketWriter* w, uint64_t pos, uint64_t target) {
+    uint64_t b = pos >> w->z->bucket_shift;
+    RankUpdate* slot = w->buf + b * w->per + w->used[b];
+    slot->pos = pos;
+    slot->target = target;
+    w->pushed++;
+    if (++w->used[b] == w->per) bucket_flush(w, b);
+}
+
+static void bucket_writer_done(BucketWriter* w) {
+    for (uint64_t b = 0; b < w->z->bucket_count; b++) if (w->used[b]) bucket_flush(w, b);
+    #pragma omp atomic
+    w->z->update_count += w->pushed;
+    free(w->buf);
+    free(w->used);
+}
+
+// The longest run of any bucket. The buffers that hold runs are sized from it, and from the updates the pruning may add;
+// the RAM budget of buckets_init() only caps the span, which a sparse bucket never fills.
+static uint64_t buckets_max_fill(const ZirkaEncoder* z) {
+    uint64_t m = 1;
+    for (uint64_t b = 0; b < z->bucket_count; b++) if (z->bucket_fill[b] > m) m = z->bucket_fill[b];
+    return m;
+}
+
+// Positions per pane: a sparse bucket is sorted and applied a pane at a time, so that the buffers with one entry per
+// position (sort slots, rank windows) stay one I/O block of positions instead of the whole span
+static int bucket_pane_shift(ZirkaEncoder* z) {
+    int shift = BUCKET_SHIFT_MIN;
+    while (shift < z->bucket_shift && (2ULL << shift) <= io_block_elems(z, sizeof(uint64_t))) shift++;
+    return shift;
+}
+
+// Groups a run by pane, keeping the order within each, into 'out'; count[p] gets the size of pane p's group ('at' is scratch)
+static void bucket_panes(const RankUpdate* run, uint64_t n, uint64_t base, int pane_shift, uint64_t panes, RankUpdate* out, uint64_t* count, uint64_t* at) {
+    memset(count, 0, panes * sizeof(uint64_t));
+    for (uint64_t i = 0; i < n; i++) count[(run[i].pos - base) >> pane_shift]++;
+    for (uint64_t p = 0, sum = 0; p < panes; p++) { at[p] = sum; sum += count[p]; }
+    for (uint64_t i = 0; i < n; i++) out[at[(run[i].pos - base) >> pane_shift]++] = run[i];
+}
+
+// Orders the n updates at 'in' (positions [base, base + span)) by position: scatter their targets into 'slot' (one per
+// position), then read them back in order into 'out' (which may be 'in'). Returns how many were emitted.
+static uint64_t bucket_sort(ZirkaEncoder* z, const RankUpdate* in, uint64_t n, uint64_t base, uint64_t span, uint64_t* slot, RankUpdate* out) {
+    uint64_t total;
+    int max_threads = omp_get_max_threads();
+    uint64_t* emitted = calloc(max_threads + 1, sizeof(uint64_t));
+    if (!emitted) zfail(z, "bucket sort");
+
+    #pragma omp parallel
+    {
+        int t = omp_get_thread_num(), nt = omp_get_num_threads();
+        #pragma omp for schedule(static)
+        for (uint64_t i = 0; i < span; i++) slot[i] = NULL_RANK;
+        #pragma omp for schedule(static)
+        for (uint64_t i = 0; i < n; i++) slot[in[i].pos - base] = in[i].target;
+
+        // Each thread emits one contiguous slice of positions, at the offset the slices before it add up to
+        uint64_t lo = span * t / nt, hi = span * (t + 1) / nt, k = 0;
+        for (uint64_t i = lo; i < hi; i++) k += (slot[i] != NULL_RANK);
+        emitted[t + 1] = k;
+        #pragma omp barrier
+        #pragma omp single
+        for (int i = 1; i <= nt; i++) emitted[i] += emitted[i - 1];
+        k = emitted[t];
+        for (uint64_t i = lo; i < hi; i++) {
+            if (slot[i] == NULL_RANK) continue;
+            out[k].pos = base + i;
+            out[k].target = slot[i];
+            k++;
+        }
+        #pragma omp single
+        total = emitted[nt]; // Equal to n, unless a resumed run re-sorts a bucket that was half written
+    }
+    free(emitted);
+    return total;
+}
+
+// --- NUCLEAR GATHER ---
+// Scans a sorted run of the index (the whole index, or one shard) and scatters
+// "At position [duplicate], point to [master]" for every non-first member of every hash group into the update buckets.
+// Only groups led inside [from, to) are gathered (a group may run past 'to'), so the run can be walked in blocks.
+static void gather_updates(const DiskEntry* index, uint64_t from, uint64_t to, uint64_t count, Artifact* updates) {
+    #pragma omp parallel
+    {
+    BucketWriter writer;
+    bucket_writer_init(&writer, updates);
+    #pragma omp for schedule(dynamic, 4096)
+    for (uint64_t i = from; i < to; i++) {
+        // Skip if not the "Group Leader" (First of identical hashes)
+        if (i > 0) {
+            if (index[i].h2 == index[i-1].h2 && index[i].h1 == index[i-1].h1) continue;
+        }
+
+        uint64_t group_start = i;
+        // Since we sorted by Hash+Offset, this is the absolute first occurrence
+        uint64_t master_offset = index[group_start].offset; 
+
+        // Write the updates: "At position [duplicate], point to [master]"
+        uint64_t look = group_start + 1;
+        while (look < count && 
+               index[look].h2 == index[group_start].h2 && 
+               index[look].h1 == index[group_start].h1) {
+            bucket_push(&writer, index[look].offset, master_offset);
+            look++;
+        }
+    }
+    bucket_writer_done(&writer);
+    }
+}
+
+// --- HASH-PARTITIONED SHARDS (Stage 1 Scatter) ---
+// Instead of one 24x index that is sorted as a whole, Stage 1 scatters every entry by the top bits of h2
+// (the primary sort key, so a hash group never spans two shards) into 'count' shard files,
+// through per-thread write-combining buffers. Each shard is then sorted on its own in RAM, gathered and deleted:
+// no global sort, no index-sized artifact next to the updates log and the rank map.
+#define SHARDS_AUTO -1
+#define SHARD_WC_BYTES (8ULL * 1024 * 1024) // Write-combining buffers per thread (all shards together)
+
+typedef struct ShardSet {
+    ZirkaEncoder* z;
+    int count;          // Power of two
+    int bits;           // log2(count)
+    int* fds;
+    uint64_t* fill;     // Bytes written to each shard (atomic)
+} ShardSet;
+
+typedef struct {
+    ShardSet* set;
+    DiskEntry* buf;     // count x per entries
+    uint32_t* used;
+    uint32_t per;
+} ShardWriter;
+
+
+static void shard_path(const ZirkaEncoder* z, char* out, int s) {
+    char name[64];
+    snprintf(name, sizeof(name), "zirka_shard_%05d.tmp", s);
+    TempDirs one = { { z->tmp_index.dirs[s % z->tmp_index.ndirs] }, 1, z->tmp_prefix }; // Shards are dealt round-robin over the index directories
+    temp_path(out, &one, name, 0);
+}
+
+// Opens shards [first, count), the ones before 'first' were already consumed
+static void shards_open(ZirkaEncoder* z, ShardSet* set, int count, int first, bool create) {
+    set->z = z;
+    set->count = count;
+    set->bits = __builtin_ctz(count);
+    set->fds = malloc(count * sizeof(int));
+    set->fill = calloc(count, sizeof(uint64_t));
+    if (!set->fds || !set->fill) zfail(z, "shards");
+    for (int s = 0; s < count; s++) set->fds[s] = -1;
+    z->shard_set = set; // Closed by the unwinding of a failing job
+    char path[1024];
+    for (int s = 0; s < count; s++) {
+        if (s < first) continue;
+        shard_path(z, path, s);
+        set->fds[s] = create ? open(path, O_RDWR | O_CREAT | O_TRUNC, 0666) : open(path, O_RDWR);
+        if (set->fds[s] == -1) zfail(z, path);
+        struct stat st;
+        if (!create && fstat(set->fds[s], &st) == 0) set->fill[s] = st.st_size;
+    }
+}
+
+// Resume check: the shards still on disk must hold exactly 'entries' entries (the consumed ones are gone)
+static bool shards_match(const ZirkaEncoder* z, int count, int first, uint64_t entries) {
+    char path[1024];
+    uint64_t total = 0;
+    struct stat st;
+    for (int s = first; s < count; s++) {
+        shard_path(z, path, s);
+        if (stat(path, &st) != 0 || st.st_size % sizeof(DiskEntry)) return false;
+        total += st.st_size / sizeof(DiskEntry);
+    }
+    return total == entries;
+}
+
+static inline int shard_of(const ShardSet* set, uint64_t h2) {
+    return (int)(h2 >> (64 - set->bits));
+}
+
+static void shard_flush(ShardWriter* w, int s) {
+    uint64_t bytes = (uint64_t)w->used[s] * sizeof(DiskEntry);
+    if (bytes == 0) return;
+    uint64_t off = __atomic_fetch_add(&w->set->fill[s], bytes, __ATOMIC_RELAXED);
+    const uint8_t* src = (const uint8_t*)(w->buf + (uint64_t)s * w->per);
+    while (bytes) {
+        ssize_t n = pwrite(w->set->fds[s], src, bytes, off);
+        if (n <= 0) zfail(w->set->z, "shard write");
+        src += n; off += n; bytes -= n;
+        #pragma omp atomic
+        w->set->z->stage_io.bytes += n;
+    }
+    w->used[s] = 0;
+}
+
+static void shard_writer_init(ShardWriter* w, ShardSet* set) {
+    w->set = set;
+    w->per = SHARD_WC_BYTES / sizeof(DiskEntry) / set->count;
+    if (w->per < 16) w->per = 16;
+    w->buf = malloc((uint64_t)set->count * w->per * sizeof(DiskEntry));
+    w->used = calloc(set->count, sizeof(uint32_t));
+    if (!w->buf || !w->used) zfail(set->z, "malloc");
+}
+
+static inline void shard_push(ShardWriter* w, const DiskEntry* e) {
+    int s = shard_of(w->set, e->h2);
+    w->buf[(uint64_t)s * w->per + w->used[s]] = *e;
+    if (++w->used[s] == w->per) shard_flush(w, s);
+}
+
+static void shard_writer_done(ShardWriter* w) {
+    for (int s = 0; s < w->set->count; s++) shard_flush(w, s);
+    free(w->buf);
+    free(w->used);
+}
+
+// Brings shard 's' into memory: a private RAM copy when it fits the job's shard_ram, otherwise a shared mapping sorted on disk
+static DiskEntry* shard_load(ShardSet* set, int s, uint64_t* count, bool* in_ram) {
+    ZirkaEncoder* z = set->z;
+    uint64_t bytes = set->fill[s];
+    *count = bytes / sizeof(DiskEntry);
+    if (bytes == 0) { *in_ram = true; return NULL; }
+    if (bytes <= z->shard_ram) {
+        DiskEntry* data = malloc(bytes);
+        if (data) {
+            *in_ram = true;
+            uint8_t* dst = (uint8_t*)data;
+            for (uint64_t off = 0; off < bytes; ) {
+                ssize_t n = pread(set->fds[s], dst + off, bytes - off, off);
+                if (n <= 0) { free(data); zfail(z, "shard read"); }
+                off += n;
+                z->stage_io.bytes += n;
+            }
+            return data;
+        }
+    }
+    *in_ram = false;
+    void* map = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, set->fds[s], 0);
+    if (map == MAP_FAILED) zfail(z, "mmap shard");
+    return map;
+}
+
+static void shard_release(ShardSet* set, int s, DiskEntry* data, bool in_ram) {
+    if (data) { if (in_ram) free(data); else munmap(data, set->fill[s]); }
+    char path[1024];
+    shard_path(set->z, path, s);
+    close(set->fds[s]);
+    set->fds[s] = -1;
+    unlink(path);
+}
+
+static void shards_close(ShardSet* set) {
+    if (set->z->shard_set == set) set->z->shard_set = NULL;
+    for (int s = 0; s < set->count; s++) if (set->fds[s] != -1) close(set->fds[s]);
+    free(set->fds);
+    free(set->fill);
+    set->fds = NULL;
+    set->fill = NULL;
+}
+
+// --- HASH JOIN (--join hash) ---
+// All the gather needs from a sorted shard is the first offset of every hash. The join engine does not sort: the team
+// inserts the shard into an open-addressing table (hash -> smallest offset), then walks the shard again and scatters
+// "at [offset], point to [smallest offset]" for every other member. Two linear passes instead of n log n, and exactly
+// the updates of the sort engine, so the same archive.
+// Slots are DiskEntry's, indexed by h1 (h2 picked the shard). A slot is claimed by swapping its offset from JOIN_EMPTY
+// to JOIN_BUSY; the key is stored before the offset is published, and a later occurrence lowers it with a CAS.
+#define JOIN_EMPTY NULL_RANK
+#define JOIN_BUSY (NULL_RANK - 1)
+#define JOIN_RAM_FACTOR 4        // Shard plus table (at most 3 slots per entry), in shard bytes
+#define JOIN_PREFETCH 16         // Entries ahead whose slot is prefetched
+enum { JOIN_SORT, JOIN_HASH, JOIN_MODES };
+static const char* join_names[JOIN_MODES] = { "sort", "hash" };
+
+typedef struct {
+    DiskEntry* slot;
+    uint64_t cap;                // Slots allocated (the largest shard's table)
+    uint64_t mask;
+} JoinTable;
+
+// Table of the largest shard in [first, count), reused by all of them
+static void join_init(ZirkaEncoder* z, JoinTable* jt, const ShardSet* set, int first) {
+    uint64_t most = 0;
+    for (int s = first; s < set->count; s++) if (set->fill[s] > most) most = set->fill[s];
+    most /= sizeof(DiskEntry);
+    jt->cap = 1024;
+    while (jt->cap < most + most / 2) jt->cap <<= 1;
+    jt->slot = malloc(jt->cap * sizeof(DiskEntry));
+    if (!jt->slot) zfail(z, "join table");
+}
+
+static inline void join_insert(JoinTable* jt, const DiskEntry* e) {
+    for (uint64_t i = e->h1 & jt->mask; ; i = (i + 1) & jt->mask) {
+        DiskEntry* s = &jt->slot[i];
+        uint64_t o = __atomic_load_n(&s->offset, __ATOMIC_ACQUIRE);
+        if (o == JOIN_EMPTY) {
+            if (__atomic_compare_exchange_n(&s->offset, &o, JOIN_BUSY, false, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) {
+                s->h1 = e->h1;
+                s->h2 = e->h2;
+                __atomic_store_n(&s->offset, e->offset, __ATOMIC_RELEASE);
+                return;
+            }
+        }
+        while (o == JOIN_BUSY) { _mm_pause(); o = __atomic_load_n(&s->offset, __ATOMIC_ACQUIRE); }
+        if (s->h1 == e->h1 && s->h2 == e->h2) {
+            while (e->offset < o && !__atomic_compare_exchange_n(&s->offset, &o, e->offset, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+            return;
+        }
+    }
+}
+
+static inline uint64_t join_first(const JoinTable* jt, const DiskEntry* e) {
+    for (uint64_t i = e->h1 & jt->mask; ; i = (i + 1) & jt->mask) {
+        const DiskEntry* s = &jt->slot[i];
+        if (s->h1 == e->h1 && s->h2 == e->h2) return s->offset;
+    }
+}
+
+// Scatters the updates of one shard (any order) into the update buckets
+static void join_shard(ZirkaEncoder* z, JoinTable* jt, const DiskEntry* data, uint64_t count, Artifact* updates) {
+    uint64_t size = jt->cap;
+    while (size / 2 >= 1024 && size / 2 >= count + count / 2) size /= 2;
+    jt->mask = size - 1;
+    #pragma omp parallel
+    {
+    #pragma omp for schedule(static)
+    for (uint64_t i = 0; i <= jt->mask; i++) jt->slot[i].offset = JOIN_EMPTY;
+    #pragma omp for schedule(static)
+    for (uint64_t i = 0; i < count; i++) {
+        if (i + JOIN_PREFETCH < count) _mm_prefetch((const char*)&jt->slot[data[i + JOIN_PREFETCH].h1 & jt->mask], _MM_HINT_T0);
+        join_insert(jt, &data[i]);
+    }
+    BucketWriter writer;
+    bucket_writer_init(&writer, updates);
+    #pragma omp for schedule(static)
+    for (uint64_t i = 0; i < count; i++) {
+        if (i + JOIN_PREFETCH < count) _mm_prefetch((const char*)&jt->slot[data[i + JOIN_PREFETCH].h1 & jt->mask], _MM_HINT_T0);
+        uint64_t first = join_first(jt, &data[i]);
+        if (first != data[i].offset) bucket_push(&writer, data[i].offset, first);
+    }
+    bucket_writer_done(&writer);
+    }
+    #pragma omp atomic
+    z->sorted_so_far += count;
+}
+
+// --- EXECUTION PLANNER (Disk & Memory Budget) ---
+// Runs before Stage 1: sums up, per device, the worst-case footprint of every artifact that is alive at the same time,
+// compares it against the free space of that device, and refuses up front (with the exact shortfall)
+// instead of dying hours later in Stage 3. With --plan it only prints the plan and the estimated I/O and time per stage.
+//
+// Rough per-thread rates of a current x86 core (AES-NI), only used for the --plan estimates:
+#define PLAN_HASH_RATE 4.0e6  // Windows hashed per second
+#define PLAN_SORT_RATE 5.0e7  // n*log2(n) sort steps per second while in RAM (out-of-RAM passes are charged as I/O)
+#define PLAN_JOIN_RATE 2.0e7  // Entries inserted or looked up per second in a shard's hash table
+#define PLAN_SEARCH_RATE 2.0e7 // Binary-search probes per second into an index in RAM (BS, and --engine auto)
+#define PLAN_DISK_MBPS 2000.0 // Sequential MB/s per device, override with --disk-mbps
+
+enum { PHASE_SORT = 0, PHASE_RANK, PHASE_ENCODE, PHASE_COUNT }; // Phases with a distinct set of live artifacts
+
+typedef struct {
+    dev_t dev;
+    const char* dir;
+    uint64_t free;                // Bytes available to us (statvfs f_bavail), plus what our own resumable artifacts already hold
+    uint64_t need[PHASE_COUNT];   // Worst-case bytes alive on this device in each phase
+} PlanDevice;
+
+typedef struct {
+    ZirkaEncoder* z;
+    PlanDevice devs[3 * MAX_TMP_DIRS + 1];
+    int ndevs;
+    uint64_t ram_avail;
+    uint64_t index_bytes, updates_bytes, rank_bytes, output_bytes;
+    int shards;
+    double disk_mbps;
+    bool feasible;
+} ExecPlan;
+
+
+static PlanDevice* plan_device(ExecPlan* plan, const char* dir) {
+    struct stat st;
+    struct statvfs vfs;
+    if (stat(dir, &st) == -1 || statvfs(dir, &vfs) == -1) zfail(plan->z, dir);
+    for (int i = 0; i < plan->ndevs; i++) if (plan->devs[i].dev == st.st_dev) return &plan->devs[i];
+    PlanDevice* d = &plan->devs[plan->ndevs++];
+    memset(d, 0, sizeof(*d));
+    d->dev = st.st_dev;
+    d->dir = dir;
+    d->free = (uint64_t)vfs.f_bavail * vfs.f_frsize;
+    return d;
+}
+
+// Charges 'size' bytes of an artifact (split over its stripe files) to the devices holding it during 'phase'
+static void plan_charge(ExecPlan* plan, const TempDirs* td, uint64_t size, int phase) {
+    for (int d = 0; d < td->ndirs; d++) {
+        uint64_t part = (td->ndirs == 1) ? size : stripe_file_size(size, plan->z->stripe_unit, td->ndirs, d);
+        plan_device(plan, td->dirs[d])->need[phase] += part;
+    }
+}
+
+// A resumed run reuses its artifacts, so the blocks they already occupy count as free
+static void plan_credit(ExecPlan* plan, const TempDirs* td, const char* name) {
+    char path[1024];
+    struct stat st;
+    for (int d = 0; d < td->ndirs; d++) {
+        temp_path(path, td, name, d);
+        if (stat(path, &st) == 0) plan_device(plan, td->dirs[d])->free += (uint64_t)st.st_blocks * 512;
+    }
+}
+
+static uint64_t available_ram(void) {
+    FILE* f = fopen("/proc/meminfo", "r");
+    char line[256];
+    uint64_t kb = 0;
+    if (f) {
+        while (fgets(line, sizeof(line), f)) if (sscanf(line, "MemAvailable: %lu kB", &kb) == 1) break;
+        fclose(f);
+    }
+    if (kb == 0) kb = (uint64_t)sysconf(_SC_AVPHYS_PAGES) * (sysconf(_SC_PAGESIZE) / 1024);
+    return kb * 1024;
+}
+
+static void plan_charge_all(ExecPlan* plan, const TempDirs* out_td, int shards) {
+    ZirkaEncoder* z = plan->z;
+    for (int i = 0; i < plan->ndevs; i++) memset(plan->devs[i].need, 0, sizeof(plan->devs[i].need));
+    plan_charge(plan, &z->tmp_index, plan->index_bytes, PHASE_SORT);
+    if (z->pipeline == PIPELINE_NUCLEAR) {
+    plan->updates_bytes = z->index_entries * sizeof(RankUpdate); // Sparse file, fully used only if every window indexed is a duplicate
+    if (shards == 0) plan_charge(plan, &z->tmp_index, plan->index_bytes, PHASE_RANK); // Shards are gone before the rank map exists
+    plan_charge(plan, &z->tmp_updates, plan->updates_bytes, PHASE_RANK);
+    plan_charge(plan, &z->tmp_rank, plan->rank_bytes, PHASE_RANK);
+    plan_charge(plan, &z->tmp_rank, plan->rank_bytes, PHASE_ENCODE);
+    } else if (z->pipeline == PIPELINE_BS) {
+    plan_charge(plan, &z->tmp_index, plan->index_bytes, PHASE_RANK);
+    plan_charge(plan, &z->tmp_index, plan->index_bytes, PHASE_ENCODE);
+    } else {
+    plan->rank_bytes = z->entry_count * sizeof(uint64_t);
+    plan_charge(plan, &z->tmp_index, plan->index_bytes, PHASE_RANK);
+    plan_charge(plan, &z->tmp_rank, plan->rank_bytes, PHASE_RANK);
+    if (z->pipeline == PIPELINE_RANKMAP) plan_charge(plan, &z->tmp_index, plan->index_bytes, PHASE_ENCODE); // 'first' drops it after Stage 3
+    plan_charge(plan, &z->tmp_rank, plan->rank_bytes, PHASE_ENCODE);
+    }
+    if (out_td) plan_charge(plan, out_td, plan->output_bytes, PHASE_ENCODE);
+}
+
+static bool plan_feasible(const ExecPlan* plan) {
+    for (int i = 0; i < plan->ndevs; i++) {
+        for (int ph = 0; ph < PHASE_COUNT; ph++) if (plan->devs[i].need[ph] > plan->devs[i].free) return false;
+    }
+    return true;
+}
+
+// Fewest shards (>= 256, power of two) whose average size leaves 4x headroom in RAM for skewed shards
+static int plan_shard_count(uint64_t index_bytes, uint64_t ram) {
+    int count = 256;
+    while (count < 65536 && index_bytes / count > ram / 4) count <<= 1;
+    return count;
+}
+
+static void plan_build(ZirkaEncoder* z, ExecPlan* plan, uint64_t filesize, bool resuming) {
+    memset(plan, 0, sizeof(*plan));
+    plan->z = z;
+    plan->disk_mbps = z->disk_mbps;
+    plan->ram_avail = available_ram();
+    if (z->rss_limit && z->rss_limit < plan->ram_avail) plan->ram_avail = z->rss_limit; // The governor's ceiling is all we may use
+    plan->index_bytes = z->index_entries * sizeof(DiskEntry);
+    plan->output_bytes = filesize + filesize / CHUNK_SIZE; // Worst case: all literals (a tag is never longer than what it replaces)
+    if (z->pipeline == PIPELINE_NUCLEAR) plan->rank_bytes = filesize * sizeof(uint64_t);
+
+    // The output goes next to the input (a descriptor or buffer job writes wherever its caller says, which is not planned)
+    TempDirs out_td = { { z->out_dir }, 1, "" };
+    const TempDirs* out = z->out_dir[0] ? &out_td : NULL;
+
+    if (resuming) {
+        plan_credit(plan, &z->tmp_index, "zirka_index.tmp");
+        plan_credit(plan, &z->tmp_updates, "zirka_updates.tmp");
+        plan_credit(plan, &z->tmp_rank, "zirka_rank.tmp");
+        for (int sh = 0; sh < z->shards; sh++) {
+            char name[64];
+            snprintf(name, sizeof(name), "zirka_shard_%05d.tmp", sh);
+            TempDirs one = { { z->tmp_index.dirs[sh % z->tmp_index.ndirs] }, 1, z->tmp_prefix };
+            plan_credit(plan, &one, name);
+        }
+    }
+
+    int shards = z->shards;
+    if (z->pipeline == PIPELINE_NUCLEAR) {
+    // Monolithic index unless it does not fit: then hash-partitioned shards, which never keep the index next to updates & rank
+    if (shards == SHARDS_AUTO && z->join == JOIN_HASH) {
+        shards = plan_shard_count(plan->index_bytes * JOIN_RAM_FACTOR, plan->ram_avail); // The join engine only works on shards
+    } else if (shards == SHARDS_AUTO) {
+        plan_charge_all(plan, out, 0);
+        shards = plan_feasible(plan) ? 0 : plan_shard_count(plan->index_bytes, plan->ram_avail);
+    }
+    } else shards = 0; // Only the Nuclear pipeline consumes the index shard by shard
+    z->shards = plan->shards = shards;
+    z->shard_ram = plan->ram_avail / 2;
+    plan_charge_all(plan, out, shards);
+    plan->feasible = plan_feasible(plan);
+}
+
+static double plan_nlogn(double n) {
+    return (n > 1) ? n * (63 - __builtin_clzll((uint64_t)n)) : 0;
+}
+
+// Passes the samplesort makes over an mmap-ed array that no longer fits in the page cache: one per step, until the buckets fit
+static double plan_sort_passes(uint64_t bytes, uint64_t ram) {
+    double passes = 1.0;
+    while (bytes > ram && ram > 0) { bytes /= SS_BUCKETS; passes += 1.0; }
+    return passes;
+}
+
+static void plan_print(const ExecPlan* plan, uint64_t filesize) {
+    ZirkaEncoder* z = plan->z;
+    const double GB = 1024.0 * 1024.0 * 1024.0;
+    const char* phase_names[PHASE_COUNT] = { "Stage 1-2", "Stage 3", "Stage 4" };
+    int threads = z->threads;
+    zlog(z, "   [Plan] Pipeline    : %s\n", pipeline_titles[z->pipeline]);
+    if (plan->shards)
+    zlog(z, "   [Plan] Index       : %d hash-partitioned shards over %d dir%s (~%.1f MB each), %s\n", plan->shards, z->tmp_index.ndirs, z->tmp_index.ndirs > 1 ? "s" : "", plan->index_bytes / (double)plan->shards / 1048576.0,
+           z->join == JOIN_HASH ? "join engine: hash table per shard" : "sort engine: parallel samplesort per shard");
+    else
+    zlog(z, "   [Plan] Index       : %s (%d dir%s), sort engine: parallel samplesort\n", z->tmp_index.ndirs > 1 ? "striped" : "single file", z->tmp_index.ndirs, z->tmp_index.ndirs > 1 ? "s" : "");
+    zlog(z, "   [Plan] Temp I/O    : %s for sequential passes (%lu MB blocks, %d in flight, %s), mmap for the in-place index sort\n", z->io_backend == BACKEND_AUTO ? "O_DIRECT where supported, else pread" : backend_names[z->io_backend], z->io_block >> 20, z->io_depth,
+           z->io_engine == ENGINE_THREADS ? "I/O thread pool" : z->io_engine == ENGINE_URING ? "io_uring" : "io_uring, thread-pool fallback");
+    zlog(z, "   [Plan] RAM         : %.2f GB %s, index %s the page cache\n", plan->ram_avail / GB, z->rss_limit == plan->ram_avail ? "(--rss-limit)" : "available", plan->index_bytes <= plan->ram_avail ? "fits in" : "exceeds");
+    for (int i = 0; i < plan->ndevs; i++) {
+        const PlanDevice* d = &plan->devs[i];
+        uint64_t peak = 0;
+        int peak_phase = 0;
+        for (int ph = 0; ph < PHASE_COUNT; ph++) if (d->need[ph] > peak) { peak = d->need[ph]; peak_phase = ph; }
+        zlog(z, "   [Plan] Device [%-20s]: %9.2f GB free | %9.2f GB peak (%s)", d->dir, d->free / GB, peak / GB, phase_names[peak_phase]);
+        if (peak > d->free) zlog(z, " | SHORT BY %.2f GB (%lu bytes)", (peak - d->free) / GB, peak - d->free);
+        zlog(z, "\n");
+    }
+
+    // I/O volume and time per stage (time = the slower of CPU and disk, disks work in parallel)
+    int ndisks = plan->ndevs;
+    double bw = plan->disk_mbps * 1024.0 * 1024.0 * (ndisks > 0 ? ndisks : 1);
+    double n = (double)z->index_entries;
+    double sort_passes = plan_sort_passes(plan->index_bytes, plan->ram_avail);
+    double io[4], cpu[4];
+    io[0] = filesize + plan->index_bytes;
+    cpu[0] = n / (PLAN_HASH_RATE * threads);
+    io[1] = plan->shards ? (double)plan->index_bytes : 2.0 * plan->index_bytes * sort_passes; // Shards: read once, sorted in RAM
+    cpu[1] = (plan->shards && z->join == JOIN_HASH) ? 2.0 * n / (PLAN_JOIN_RATE * threads) : plan_nlogn(n) / (PLAN_SORT_RATE * threads);
+    io[2] = (plan->shards ? 0 : plan->index_bytes) + 3.0 * plan->updates_bytes + plan->rank_bytes; // Scatter, bucket sort, apply
+    cpu[2] = n * plan->updates_bytes / (plan->index_bytes ? plan->index_bytes : 1) / (PLAN_SORT_RATE * threads);
+    io[3] = filesize + plan->rank_bytes + plan->output_bytes;
+    cpu[3] = filesize / (200.0 * 1024 * 1024); // Serial encoder
+    const char* stage_titles[4] = { "1. Hashing ", (plan->shards && z->join == JOIN_HASH) ? "2. Joining " : "2. Sorting ", "3. Ranking ", "4. Encoding" };
+    double total = 0;
+    for (int st = 0; st < 4; st++) {
+        double t = io[st] / bw > cpu[st] ? io[st] / bw : cpu[st];
+        total += t;
+        zlog(z, "   [Plan] %s: %10.2f GB I/O, ~%9.0fs\n", stage_titles[st], io[st] / GB, t);
+    }
+    zlog(z, "   [Plan] Total      : ~%.0fs (%d threads, %.0f MB/s x %d device%s)\n", total, threads, plan->disk_mbps, ndisks, ndisks > 1 ? "s" : "");
+    if (!plan->feasible) zlog(z, "   [Plan] NOT FEASIBLE: free up the space above or spread the artifacts with --tmp/--tmp-index/--tmp-updates/--tmp-rank (--force runs anyway).\n");
+}
+
+// --- PIPELINE SELECTION (--engine auto) ---
+// Nuclear, unless BS is cheaper for this input: BS needs no Stage 3 and no 8x rank map, but hashes every position that
+// does not end up in a match again (on one thread) and binary-searches the index for it. So it pays off when the index
+// sits in RAM and nearly all of the input is duplicate, or when the temp devices cannot hold Nuclear's artifacts.
+// rankmap and first (random writes into an 8x map) are never picked, only kept for comparisons.
+// The duplicate share is sampled: over up to SAMPLE_REGIONS slices of the input, a gear hash of the last 64 bytes sets
+// an anchor about every SAMPLE_GAP bytes, the window at each anchor is hashed and repeats are counted. Anchors follow
+// the content, so a copy gets the anchors of its source at any alignment (small inputs are sampled whole).
+#define SAMPLE_REGIONS 256
+#define SAMPLE_REGION (1ULL << 20) // Bytes per slice
+#define SAMPLE_GAP 512             // Fewest bytes from one anchor to the next, also about the average
+
+// Share of the sampled windows seen before in the sample
+static double sample_duplicates(ZirkaEncoder* z, const uint8_t* buffer, uint64_t filesize) {
+    if (filesize < 2 * CHUNK_SIZE) return 0.0;
+    uint64_t gear[256], seed = 0;
+    for (int i = 0; i < 256; i++) {
+        uint64_t x = (seed += 0x9E3779B97F4A7C15ULL);
+        x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+        gear[i] = x ^ (x >> 31);
+    }
+    uint64_t stride = filesize / SAMPLE_REGIONS, len = SAMPLE_REGION, regions = SAMPLE_REGIONS;
+    if (stride < len) { stride = len = (filesize + SAMPLE_REGIONS - 1) / SAMPLE_REGIONS; } // Whole
+    uint64_t per = len / SAMPLE_GAP + 1;
+    uint64_t* found = malloc(regions * per * sizeof(uint64_t));
+    uint64_t* count = calloc(regions, sizeof(uint64_t));
+    if (!found || !count) zfail(z, "duplicate sample");
+    #pragma omp parallel for schedule(dynamic, 1)
+    for (uint64_t r = 0; r < regions; r++) {
+        uint64_t p0 = r * stride, p1 = p0 + len;
+        if (p1 > filesize - CHUNK_SIZE) p1 = filesize - CHUNK_SIZE;
+        uint64_t g = 0, next = p0 + 64; // The gear hash covers 64 bytes
+        for (uint64_t p = p0; p < p1; p++) {
+            g = (g << 1) + gear[buffer[p]];
+            if (p < next || (g >> 55) || count[r] == per) continue;
+            uint64_t h[2];
+            FNV1A_Pippip_Yurii_OOO_128bit_AES_TriXZi_Mikayla_forte((const char*)buffer + p, CHUNK_SIZE, 0, h);
+            found[r * per + count[r]++] = h[0] | 1; // 0 marks a free slot below
+            next = p + SAMPLE_GAP;
+        }
+    }
+    uint64_t n = 0, repeats = 0, cap = 1024;
+    for (uint64_t r = 0; r < regions; r++) n += count[r];
+    while (cap < 2 * n) cap <<= 1;
+    uint64_t* table = calloc(cap, sizeof(uint64_t));
+    if (!table) zfail(z, "duplicate sample");
+    for (uint64_t r = 0; r < regions; r++) {
+        for (uint64_t i = 0; i < count[r]; i++) {
+            uint64_t h = found[r * per + i], slot = (h >> 7) & (cap - 1);
+            while (table[slot] && table[slot] != h) slot = (slot + 1) & (cap - 1);
+            if (table[slot]) repeats++;
+            else table[slot] = h;
+        }
+    }
+    free(table);
+    free(found);
+    free(count);
+    return n ? (double)repeats / n : 0.0;
+}
+
+// Resolves z->pipeline == PIPELINE_AUTO for this input (and says why)
+static void pipeline_choose(ZirkaEncoder* z, const uint8_t* buffer) {
+    uint64_t filesize = z->filesize;
+    char why[192];
+    z->pipeline = PIPELINE_NUCLEAR;
+    if (z->tar || z->shards > 0 || z->join == JOIN_HASH) {
+        snprintf(why, sizeof(why), "--tar, --shards and --join hash need it");
+    } else {
+        // Would the temp devices hold either?
+        ExecPlan plan;
+        int shards = z->shards;
+        plan_build(z, &plan, filesize, false);
+        bool nuclear_fits = plan.feasible;
+        z->pipeline = PIPELINE_BS;
+        z->shards = shards;
+        plan_build(z, &plan, filesize, false);
+        bool bs_fits = plan.feasible;
+        z->pipeline = PIPELINE_NUCLEAR;
+        z->shards = shards;
+        uint64_t index_bytes = z->index_entries * sizeof(DiskEntry);
+        if (!nuclear_fits && bs_fits) {
+            z->pipeline = PIPELINE_BS;
+            snprintf(why, sizeof(why), "only the index fits on the temp devices, not Nuclear's updates and rank map");
+        } else if (index_bytes + filesize > plan.ram_avail / 2) {
+            snprintf(why, sizeof(why), "index and input (%.2f GB) exceed half the RAM", (index_bytes + filesize) / 1024.0 / 1024.0 / 1024.0);
+        } else {
+            // Stage 4 of BS against Stage 3 of Nuclear plus its rank map read-back
+            double dup = sample_duplicates(z, buffer, filesize);
+            double n = (double)z->entry_count;
+            double bs_s = (1.0 - dup) * filesize * (1.0 / PLAN_HASH_RATE + (64 - __builtin_clzll(z->entry_count | 1)) / PLAN_SEARCH_RATE);
+            double nuclear_s = (index_bytes + 3.0 * dup * n * sizeof(RankUpdate) + 2.0 * filesize * sizeof(uint64_t)) / (z->disk_mbps * 1024.0 * 1024.0);
+            if (bs_s < nuclear_s) z->pipeline = PIPELINE_BS;
+            snprintf(why, sizeof(why), "%.1f%% of the sampled windows repeat: ~%.0fs of BS lookups against ~%.0fs of Nuclear ranking", 100.0 * dup, bs_s, nuclear_s);
+        }
+    }
+    zlog(z, "[Zirka 1-Pass] Engine: %s (auto: %s)\n", pipeline_names[z->pipeline], why);
+}
+
+// --- STAGE METRICS (JSON Report) & PROGRESS REPORTER ---
+// --metrics FILE records every stage and Nuclear sub-phase that runs: wall & CPU time, bytes read/written
+// (/proc/self/io), major/minor faults (getrusage), local/remote NUMA page allocations (numastat, system-wide) and,
+// when the kernel allows it (perf_event_paranoid), user-space PMU counters, remote-node loads among them. Inherited perf counters only report threads that have exited, so every OpenMP
+// thread opens its own set and a sample sums them (the team is reused from stage to stage).
+#define MAX_METRIC_STAGES 16
+#define MAX_PMU_THREADS 256
+#define PROGRESS_INTERVAL_NS 250000000L
+
+enum { PMU_CYCLES, PMU_INSTRUCTIONS, PMU_CACHE_MISSES, PMU_DTLB_MISSES, PMU_NODE_LOADS, PMU_NODE_MISSES, PMU_COUNT };
+static const char* pmu_names[PMU_COUNT] = { "cycles", "instructions", "cache_misses", "dtlb_load_misses", "node_loads", "node_load_misses" };
+
+typedef struct {
+    double wall, user, sys;
+    uint64_t rchar, wchar, read_bytes, write_bytes;
+    uint64_t majflt, minflt;
+    uint64_t numa_local, numa_other; // Pages allocated on the node the allocating thread ran on, or on another one (system-wide)
+    uint64_t pmu[PMU_COUNT];
+} MetricSample;
+
+typedef struct {
+    const char* name;
+    MetricSample d;
+    StageIo io;
+} StageMetric;
+
+typedef struct Metrics {
+    bool pmu_ok;
+    int pmu_fds[MAX_PMU_THREADS][PMU_COUNT];
+    StageMetric stages[MAX_METRIC_STAGES];
+    int stage_count;
+    MetricSample run_start, stage_start;
+} Metrics;
+
+
+static int pmu_open(uint32_t type, uint64_t config) {
+    struct perf_event_attr pe;
+    memset(&pe, 0, sizeof(pe));
+    pe.size = sizeof(pe);
+    pe.type = type;
+    pe.config = config;
+    pe.exclude_kernel = 1;
+    pe.exclude_hv = 1;
+    return (int)syscall(SYS_perf_event_open, &pe, 0, -1, -1, 0); // This thread, any CPU
+}
+
+static void metrics_sample(ZirkaEncoder* z, MetricSample* m) {
+    memset(m, 0, sizeof(*m));
+    m->wall = omp_get_wtime();
+    struct rusage ru;
+    if (getrusage(RUSAGE_SELF, &ru) == 0) {
+        m->user = ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6;
+        m->sys = ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+        m->majflt = ru.ru_majflt;
+        m->minflt = ru.ru_minflt;
+    }
+    FILE* f = fopen("/proc/self/io", "r");
+    if (f) {
+        char key[64];
+        unsigned long long v;
+        while (fscanf(f, "%63[^:]: %llu\n", key, &v) == 2) {
+            if (strcmp(key, "rchar") == 0) m->rchar = v;
+            else if (strcmp(key, "wchar") == 0) m->wchar = v;
+            else if (strcmp(key, "read_bytes") == 0) m->read_bytes = v;
+            else if (strcmp(key, "write_bytes") == 0) m->write_bytes = v;
+        }
+        fclose(f);
+    }
+    cpu_set_t nodes;
+    if (numa_read_list("/sys/devices/system/node/online", &nodes)) {
+        for (int n = 0; n < CPU_SETSIZE; n++) {
+            char path[96], key[64];
+            unsigned long long v;
+            if (!CPU_ISSET(n, &nodes)) continue;
+            snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/numastat", n);
+            if (!(f = fopen(path, "r"))) continue;
+            while (fscanf(f, "%63s %llu\n", key, &v) == 2) {
+                if (strcmp(key, "local_node") == 0) m->numa_local += v;
+                else if (strcmp(key, "other_node") == 0) m->numa_other += v;
+            }
+            fclose(f);
+        }
+    }
+    if (z->metrics->pmu_ok) {
+        for (int t = 0; t < MAX_PMU_THREADS; t++) for (int k = 0; k < PMU_COUNT; k++) {
+            uint64_t v;
+            if (z->metrics->pmu_fds[t][k] >= 0 && read(z->metrics->pmu_fds[t][k], &v, sizeof(v)) == sizeof(v)) m->pmu[k] += v;
+        }
+    }
+}
+
+static void metrics_init(ZirkaEncoder* z) {
+    z->metrics->stage_count = 0;
+    if (!z->metrics_path) return;
+    memset(z->metrics->pmu_fds, -1, sizeof(z->metrics->pmu_fds));
+    int opened = 0;
+    #pragma omp parallel reduction(+:opened)
+    {
+        int t = omp_get_thread_num();
+        if (t < MAX_PMU_THREADS) {
+            z->metrics->pmu_fds[t][PMU_CYCLES] = pmu_open(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES);
+            z->metrics->pmu_fds[t][PMU_INSTRUCTIONS] = pmu_open(PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS);
+            z->metrics->pmu_fds[t][PMU_CACHE_MISSES] = pmu_open(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+            z->metrics->pmu_fds[t][PMU_DTLB_MISSES] = pmu_open(PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16));
+            // Loads reaching memory, and the ones served by a remote node (cross-node traffic)
+            z->metrics->pmu_fds[t][PMU_NODE_LOADS] = pmu_open(PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_NODE | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_ACCESS << 16));
+            z->metrics->pmu_fds[t][PMU_NODE_MISSES] = pmu_open(PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_NODE | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16));
+            for (int k = 0; k < PMU_COUNT; k++) if (z->metrics->pmu_fds[t][k] >= 0) opened++;
+        }
+    }
+    z->metrics->pmu_ok = opened > 0;
+    if (!z->metrics->pmu_ok) zlog(z, "   [Metrics] PMU counters unavailable (perf_event_open refused), reporting time, I/O and faults only.\n");
+    metrics_sample(z, &z->metrics->run_start);
+}
+
+static void metrics_begin(ZirkaEncoder* z, const char* name) {
+    io_stage_begin(z);
+    z->stage_name = name;
+    if (!z->metrics_path) return;
+    metrics_sample(z, &z->metrics->stage_start);
+}
+
+static void metrics_delta(MetricSample* d, const MetricSample* a, const MetricSample* b) {
+    d->wall = b->wall - a->wall;
+    d->user = b->user - a->user;
+    d->sys = b->sys - a->sys;
+    d->rchar = b->rchar - a->rchar;
+    d->wchar = b->wchar - a->wchar;
+    d->read_bytes = b->read_bytes - a->read_bytes;
+    d->write_bytes = b->write_bytes - a->write_bytes;
+    d->majflt = b->majflt - a->majflt;
+    d->minflt = b->minflt - a->minflt;
+    d->numa_local = b->numa_local - a->numa_local;
+    d->numa_other = b->numa_other - a->numa_other;
+    for (int k = 0; k < PMU_COUNT; k++) d->pmu[k] = b->pmu[k] - a->pmu[k];
+}
+
+static void metrics_end(ZirkaEncoder* z) {
+    StageIo io;
+    io_stage_end(z, &io, z->stage_name);
+    if (!z->metrics_path || !z->stage_name || z->metrics->stage_count == MAX_METRIC_STAGES) { z->stage_name = NULL; return; }
+    MetricSample now;
+    metrics_sample(z, &now);
+    z->metrics->stages[z->metrics->stage_count].name = z->stage_name;
+    z->metrics->stages[z->metrics->stage_count].io = io;
+    metrics_delta(&z->metrics->stages[z->metrics->stage_count].d, &z->metrics->stage_start, &now);
+    z->metrics->stage_count++;
+    z->stage_name = NULL;
+}
+
+static void metrics_json_sample(const ZirkaEncoder* z, FILE* f, const MetricSample* d) {
+    fprintf(f, "\"wall_s\": %.3f, \"user_s\": %.3f, \"sys_s\": %.3f, ", d->wall, d->user, d->sys);
+    fprintf(f, "\"rchar\": %lu, \"wchar\": %lu, \"read_bytes\": %lu, \"write_bytes\": %lu, ", d->rchar, d->wchar, d->read_bytes, d->write_bytes);
+    fprintf(f, "\"major_faults\": %lu, \"minor_faults\": %lu, ", d->majflt, d->minflt);
+    fprintf(f, "\"numa_local_pages\": %lu, \"numa_remote_pages\": %lu, \"pmu\": ", d->numa_local, d->numa_other);
+    if (!z->metrics->pmu_ok) { fprintf(f, "null"); return; }
+    fprintf(f, "{");
+    for (int k = 0; k < PMU_COUNT; k++) fprintf(f, "%s\"%s\": %lu", k ? ", " : "", pmu_names[k], d->pmu[k]);
+    fprintf(f, "}");
+}
+
+static void json_string(FILE* f, const char* str) {
+    fputc('"', f);
+    for (; *str; str++) {
+        if (*str == '"' || *str == '\\') fprintf(f, "\\%c", *str);
+        else if ((unsigned char)*str < 0x20) fprintf(f, "\\u%04x", *str);
+        else fputc(*str, f);
+    }
+    fputc('"', f);
+}
+
+static void metrics_write(ZirkaEncoder* z) {
+    if (!z->metrics_path) return;
+    MetricSample now, total;
+    metrics_sample(z, &now);
+    metrics_delta(&total, &z->metrics->run_start, &now);
+    FILE* f = fopen(z->metrics_path, "w");
+    if (!f) { zwarn(z, "metrics"); return; }
+    fprintf(f, "{\n  \"version\": %d,\n  \"chunk_size\": %d,\n  \"pipeline\": ", VERSION, CHUNK_SIZE);
+    json_string(f, pipeline_titles[z->pipeline]);
+    fprintf(f, ",\n  \"engine\": \"%s\",\n  \"input\": ", pipeline_names[z->pipeline]);
+    json_string(f, z->name);
+    fprintf(f, ",\n  \"input_bytes\": %lu,\n  \"threads\": %d,\n  \"numa_nodes\": %d,\n  \"shards\": %d,\n  \"join\": \"%s\",\n  \"rss_limit\": %lu,\n", z->filesize, z->threads, z->numa->nodes, z->shards, join_names[z->join], z->rss_limit);
+    fprintf(f, "  \"index_entries\": %lu,\n  \"tar\": %s,\n", z->index_entries, z->tar ? "true" : "false");
+    fprintf(f, "  \"duplicates\": %lu,\n  \"updates_kept\": %lu,\n  \"updates_pruned\": %lu,\n  \"updates_rejected\": %lu,\n  \"run_windows\": %lu,\n  \"sort_tasks\": %d,\n  \"stages\": [\n", z->update_count, z->updates_kept, z->pruned, z->rejected, z->run_windows, z->total_tasks);
+    for (int i = 0; i < z->metrics->stage_count; i++) {
+        const StageIo* io = &z->metrics->stages[i].io;
+        fprintf(f, "    { \"name\": \"%s\", ", z->metrics->stages[i].name);
+        metrics_json_sample(z, f, &z->metrics->stages[i].d);
+        fprintf(f, ", \"io\": { \"bytes\": %lu, \"mb_per_s\": %.1f, \"queue_depth_avg\": %.2f, \"queue_depth_max\": %u }", io->bytes,
+                io->t_last > 0 ? io->bytes / 1048576.0 / io->t_last : 0.0, io->t_last > 0 ? io->qd_area / io->t_last : 0.0, io->qd_max);
+        fprintf(f, " }%s\n", i + 1 < z->metrics->stage_count ? "," : "");
+    }
+    fprintf(f, "  ],\n  \"io_block\": %lu,\n  \"io_engine\": \"%s\",\n  \"io_depth\": %d,\n  \"artifacts\": [\n", z->io_block, engine_names[z->io_engine], z->io_depth);
+    for (int i = 0; i < z->artifact_count; i++) {
+        const Artifact* a = z->artifacts[i];
+        fprintf(f, "    { \"name\": \"%s\", \"requests\": %lu", a->name, a->requests);
+        for (int b = BACKEND_MMAP; b < BACKEND_COUNT; b++) {
+            if ((a->used & (1u << b)) || a->read[b] || a->written[b]) fprintf(f, ", \"%s\": { \"read\": %lu, \"written\": %lu }", backend_names[b], a->read[b], a->written[b]);
+        }
+        fprintf(f, " }%s\n", i + 1 < z->artifact_count ? "," : "");
+    }
+    fprintf(f, "  ],\n  \"total\": { ");
+    metrics_json_sample(z, f, &total);
+    fprintf(f, " }\n}\n");
+    fclose(f);
+    zlog(z, "   [Metrics] Report written to %s\n", z->metrics_path);
+}
+
+// One thread samples a shared counter and prints (and calls the job's progress callback),
+// instead of every sort leaf entering an omp critical printf
+typedef struct ProgressReporter {
+    ZirkaEncoder* z;
+    const char* fmt;
+    long long* counter;
+    uint64_t total;
+    int stop;
+    pthread_t tid;
+} ProgressReporter;
+
+static void* progress_main(void* arg) {
+    ProgressReporter* p = (ProgressReporter*)arg;
+    struct timespec ts = { 0, PROGRESS_INTERVAL_NS };
+    for (;;) {
+        int stop;
+        long long done;
+        #pragma omp atomic read
+        stop = p->stop;
+        if (stop) break;
+        #pragma omp atomic read
+        done = *p->counter;
+        if (p->z->log) {
+            fprintf(p->z->log, p->fmt, p->total ? (double)done / p->total * 100.0 : 100.0);
+            fflush(p->z->log);
+        }
+        zprogress(p->z, done, p->total);
+        nanosleep(&ts, NULL);
+    }
+    return NULL;
+}
+
+static void progress_start(ZirkaEncoder* z, const char* fmt, long long* counter, uint64_t total) {
+    ProgressReporter* p = z->progress;
+    p->z = z;
+    p->fmt = fmt;
+    p->counter = counter;
+    p->total = total;
+    p->stop = 0;
+    if (pthread_create(&p->tid, NULL, progress_main, p) != 0) p->fmt = NULL;
+}
+
+static void progress_stop(ZirkaEncoder* z) {
+    ProgressReporter* p = z->progress;
+    if (!p->fmt) return;
+    #pragma omp atomic write
+    p->stop = 1;
+    pthread_join(p->tid, NULL);
+    p->fmt = NULL;
+}
+
+// --- FORMAT MARKER (Archives a v7 Decoder Cannot Read) ---
+// A v7 decoder knows literals and 13-byte tags only: long tags and LZ frames would come out as literals, a wrong file
+// restored without a word. Archives that use either start with a marker instead, ahead of the --lz framing too:
+//   [255]["ZIRKAV8\0"][4B Pippip of those 8 bytes][4B flags]
+// To a v7 decoder that is a valid tag copying from an offset of about 15 PB: it faults on the first token, before it
+// restores anything. The flags name the extensions used; a decoder refuses flags it does not know. Input bytes that
+// would read as a tag (a .zirka inside a tar, say) are escaped in marked archives and refused in v7 ones (see ESCAPED
+// LITERALS), so a v7 archive never starts with the marker and the decoder tells the two apart by the first 13 bytes.
+#define FORMAT_MAGIC "ZIRKAV8"   // 8 bytes with its NUL, read as a tag offset
+#define FORMAT_HEADER_SIZE 17
+#define FORMAT_TAG_SIZE 13       // Its leading tag, also the escape of a literal 255
+#define FORMAT_LONG_TAGS 1u      // Tags may carry a length (see MATCH EXTENSION)
+#define FORMAT_CHECKSUM 2u       // The archive ends with the checksum footer (see CONTENT CHECKSUM)
+#define FORMAT_LZ 4u             // The tag stream is framed (see BLOCK-PARALLEL LZ BACKEND)
+
+// The marker's leading tag: the one copying from offset FORMAT_MAGIC
+static void format_tag(uint8_t* tag) {
+    uint32_t chk[4];
+    tag[0] = MAGIC_BYTE;
+    memcpy(tag + 1, FORMAT_MAGIC, 8);
+    FNV1A_Pippip_Yurii_OOO_128bit_AES_TriXZi_Mikayla_forte((const char*)tag + 1, 8, 0, chk);
+    memcpy(tag + 9, &chk[0], 4);
+}
+
+// Writes the marker in front of the archive and returns its size
+static uint64_t format_write(ZirkaEncoder* z, FILE* f, uint32_t flags) {
+    uint8_t head[FORMAT_HEADER_SIZE];
+    format_tag(head);
+    memcpy(head + 13, &flags, 4);
+    if (fwrite(head, 1, FORMAT_HEADER_SIZE, f) != FORMAT_HEADER_SIZE) zfail(z, "archive write");
+    return FORMAT_HEADER_SIZE;
+}
+
+// --- BLOCK-PARALLEL LZ BACKEND (Framed Output, --lz) ---
+// Instead of a separate compressor pass over the finished .zirka, Stage 4 can hand its output to an in-tree LZ
+// (LZ4-style: 4-byte hash chains of one, 64 KB window, byte-aligned sequences) block by block as it produces it.
+// Blocks are compressed independently on a pool of worker threads while the encoder keeps going, and written in order:
+//   [format marker] "ZIRKALZ1" [4B block size] { [4B raw length][4B stored length][payload] }...
+// A payload whose stored length equals its raw length is stored uncompressed. The decoder recognizes the header,
+// decompresses batches of frames in parallel and resolves the tags of the restored stream as usual. The marker's
+// FORMAT_LZ flag announces the framing: a v7 archive whose first literals happen to spell the header stays plain.
+#define LZ_MAGIC "ZIRKALZ1"
+#define LZ_BLOCK (1U << 20)    // Raw bytes per frame
+#define LZ_HASH_BITS 14
+#define LZ_MIN_MATCH 4
+#define LZ_LAST_LITERALS 5     // Every block ends with literals, so the decoder knows where it stops
+#define LZ_MAX_OFFSET 65535
+
+
+static inline uint32_t lz_hash(const uint8_t* p) {
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+// One sequence: literals, then (unless mlen == 0, the last sequence) a match. Returns the new length, 0 when 'cap' is exceeded.
+static uint32_t lz_sequence(uint8_t* dst, uint32_t op, uint32_t cap, const uint8_t* lit, uint32_t nlit, uint32_t off, uint32_t mlen) {
+    if ((uint64_t)op + 1 + nlit / 255 + 1 + nlit + 2 + mlen / 255 + 1 > cap) return 0;
+    uint32_t ml = mlen ? mlen - LZ_MIN_MATCH : 0;
+    dst[op++] = (uint8_t)(((nlit < 15) ? nlit : 15) << 4 | ((ml < 15) ? ml : 15));
+    if (nlit >= 15) {
+        uint32_t r = nlit - 15;
+        for (; r >= 255; r -= 255) dst[op++] = 255;
+        dst[op++] = (uint8_t)r;
+    }
+    memcpy(dst + op, lit, nlit);
+    op += nlit;
+    if (!mlen) return op;
+    dst[op++] = (uint8_t)off;
+    dst[op++] = (uint8_t)(off >> 8);
+    if (ml >= 15) {
+        uint32_t r = ml - 15;
+        for (; r >= 255; r -= 255) dst[op++] = 255;
+        dst[op++] = (uint8_t)r;
+    }
+    return op;
+}
+
+// Compresses src[0, n) into dst (at most 'cap' bytes); 0 = does not fit, store it
+static uint32_t lz_compress(const uint8_t* src, uint32_t n, uint8_t* dst, uint32_t cap) {
+    uint32_t table[1 << LZ_HASH_BITS];
+    memset(table, 0, sizeof(table));
+    uint32_t ip = 1, anchor = 0, op = 0;
+    uint32_t limit = (n > LZ_LAST_LITERALS + 8) ? n - LZ_LAST_LITERALS - 8 : 0;
+    while (ip < limit) {
+        uint32_t h = lz_hash(src + ip), ref = table[h];
+        table[h] = ip;
+        if (ip - ref > LZ_MAX_OFFSET || memcmp(src + ip, src + ref, LZ_MIN_MATCH) != 0) {
+            ip += 1 + ((ip - anchor) >> 6); // Skip faster through incompressible runs
+            continue;
+        }
+        while (ip > anchor && ref > 0 && src[ip - 1] == src[ref - 1]) { ip--; ref--; }
+        uint32_t len = LZ_MIN_MATCH;
+        while (ip + len < n - LZ_LAST_LITERALS && src[ip + len] == src[ref + len]) len++;
+        op = lz_sequence(dst, op, cap, src + anchor, ip - anchor, ip - ref, len);
+        if (!op) return 0;
+        ip += len;
+        anchor = ip;
+        if (ip - 2 < limit) table[lz_hash(src + ip - 2)] = ip - 2;
+    }
+    op = lz_sequence(dst, op, cap, src + anchor, n - anchor, 0, 0);
+    return (op && op < n) ? op : 0;
+}
+
+// Encoder output: straight to the file, or through the frame pipeline
+enum { LZ_FREE, LZ_QUEUED, LZ_DONE };
+
+typedef struct {
+    uint8_t* raw;
+    uint8_t* comp;
+    uint32_t raw_len, comp_len; // comp_len 0 = stored
+    int state;
+} LzSlot;
+
+typedef struct OutStream {
+    ZirkaEncoder* z;
+    FILE* f;                    // The job's archive, closed by the job
+    bool lz;
+    LzSlot* slot;
+    int nslots, workers;
+    uint64_t seq, written;      // Block being filled, oldest block not written yet
+    int* fifo;
+    int fifo_head, fifo_count;
+    bool stop;
+    pthread_mutex_t lock;
+    pthread_cond_t work, done;
+    pthread_t* tids;
+    uint64_t raw_bytes, out_bytes;
+    uint8_t escape[FORMAT_TAG_SIZE]; // Stands for a literal 255 (see ESCAPED LITERALS)
+    uint64_t* esc;              // Literals of the run being written that take it
+    uint64_t esc_cap, escapes;
+} OutStream;
+
+static void* lz_worker(void* arg) {
+    OutStream* o = arg;
+    pthread_mutex_lock(&o->lock);
+    for (;;) {
+        while (o->fifo_count == 0 && !o->stop) pthread_cond_wait(&o->work, &o->lock);
+        if (o->fifo_count == 0) break;
+        LzSlot* sl = &o->slot[o->fifo[o->fifo_head]];
+        o->fifo_head = (o->fifo_head + 1) % o->nslots;
+        o->fifo_count--;
+        pthread_mutex_unlock(&o->lock);
+        sl->comp_len = lz_compress(sl->raw, sl->raw_len, sl->comp, sl->raw_len);
+        pthread_mutex_lock(&o->lock);
+        sl->state = LZ_DONE;
+        pthread_cond_broadcast(&o->done);
+    }
+    pthread_mutex_unlock(&o->lock);
+    return NULL;
+}
+
+static void out_open(ZirkaEncoder* z, OutStream* o, FILE* f, bool lz) {
+    memset(o, 0, sizeof(*o));
+    o->z = z;
+    o->f = f;
+    o->lz = lz;
+    format_tag(o->escape);
+    if (z->extend || lz) o->out_bytes = format_write(z, f, (z->extend ? FORMAT_LONG_TAGS | FORMAT_CHECKSUM : 0) | (lz ? FORMAT_LZ : 0));
+    if (!lz) return;
+    uint32_t block = LZ_BLOCK;
+    fwrite(LZ_MAGIC, 1, 8, o->f);
+    fwrite(&block, 4, 1, o->f);
+    o->out_bytes += 12;
+    o->workers = z->threads;
+    o->nslots = 2 * o->workers + 2;
+    o->slot = calloc(o->nslots, sizeof(LzSlot));
+    o->fifo = calloc(o->nslots, sizeof(int));
+    o->tids = calloc(o->workers, sizeof(pthread_t));
+    if (!o->slot || !o->fifo || !o->tids) zfail(z, "LZ slots");
+    for (int s = 0; s < o->nslots; s++) {
+        o->slot[s].raw = malloc(LZ_BLOCK);
+        o->slot[s].comp = malloc(LZ_BLOCK);
+        if (!o->slot[s].raw || !o->slot[s].comp) zfail(z, "LZ slots");
+    }
+    pthread_mutex_init(&o->lock, NULL);
+    pthread_cond_init(&o->work, NULL);
+    pthread_cond_init(&o->done, NULL);
+    for (int t = 0; t < o->workers; t++) {
+        if (pthread_create(&o->tids[t], NULL, lz_worker, o) != 0) { o->workers = t; zfail(z, "LZ worker"); }
+    }
+    z->out = o; // From here on a failing job must stop the workers (out_stop)
+}
+
+// Lets the workers finish what they hold, joins them and frees the slots (the frames not written yet are dropped)
+static void out_stop(OutStream* o) {
+    if (o->tids) {
+        pthread_mutex_lock(&o->lock);
+        o->stop = true;
+        o->fifo_count = 0;
+        pthread_cond_broadcast(&o->work);
+        pthread_mutex_unlock(&o->lock);
+        for (int t = 0; t < o->workers; t++) pthread_join(o->tids[t], NULL);
+    }
+    if (o->slot) for (int s = 0; s < o->nslots; s++) { free(o->slot[s].raw); free(o->slot[s].comp); }
+    free(o->slot);
+    free(o->fifo);
+    free(o->tids);
+    o->slot = NULL;
+    o->fifo = NULL;
+    o->tids = NULL;
+    if (o->z->out == o) o->z->out = NULL;
+}
+
+// Waits for the oldest queued block and writes its frame
+static void out_write_frame(OutStream* o) {
+    LzSlot* sl = &o->slot[o->written % o->nslots];
+    pthread_mutex_lock(&o->lock);
+    while (sl->state != LZ_DONE) pthread_cond_wait(&o->done, &o->lock);
+    pthread_mutex_unlock(&o->lock);
+    uint32_t stored = sl->comp_len ? sl->comp_len : sl->raw_len;
+    fwrite(&sl->raw_len, 4, 1, o->f);
+    fwrite(&stored, 4, 1, o->f);
+    fwrite(sl->comp_len ? sl->comp : sl->raw, 1, stored, o->f);
+    o->out_bytes += 8 + stored;
+    sl->raw_len = 0;
+    sl->state = LZ_FREE;
+    o->written++;
+}
+
+static void out_submit(OutStream* o) {
+    int s = (int)(o->seq % o->nslots);
+    pthread_mutex_lock(&o->lock);
+    o->slot[s].state = LZ_QUEUED;
+    o->fifo[(o->fifo_head + o->fifo_count) % o->nslots] = s;
+    o->fifo_count++;
+    pthread_cond_signal(&o->work);
+    pthread_mutex_unlock(&o->lock);
+    o->seq++;
+    while (o->written + o->nslots <= o->seq) out_write_frame(o); // The next slot is free once its previous block is out
+}
+
+static void out_write(OutStream* o, const void* p, uint64_t n) {
+    o->raw_bytes += n;
+    if (!o->lz) { fwrite(p, 1, n, o->f); o->out_bytes += n; return; }
+    const uint8_t* src = p;
+    while (n) {
+        LzSlot* sl = &o->slot[o->seq % o->nslots];
+        uint32_t take = (n < LZ_BLOCK - sl->raw_len) ? (uint32_t)n : LZ_BLOCK - sl->raw_len;
+        memcpy(sl->raw + sl->raw_len, src, take);
+        sl->raw_len += take;
+        src += take;
+        n -= take;
+        if (sl->raw_len == LZ_BLOCK) out_submit(o);
+    }
+}
+
+static void out_close(OutStream* o) {
+    if (o->lz) {
+        if (o->slot[o->seq % o->nslots].raw_len) out_submit(o);
+        while (o->written < o->seq) out_write_frame(o);
+        out_stop(o);
+        zlog(o->z, "   [LZ] %.1f MB of tag stream stored as %.1f MB (%lu frames, %d threads)\n", o->raw_bytes / 1048576.0, o->out_bytes / 1048576.0, o->seq, o->workers);
+    }
+    free(o->esc);
+    o->esc = NULL;
+    o->z->stats.output_bytes = o->out_bytes;
+    if (fflush(o->f) != 0 || ferror(o->f)) zfail(o->z, "archive write");
+}
+
+// --- MATCH EXTENSION (Variable-Length Tags) ---
+// A verified 4096-byte match is grown forward (16 bytes per SSE2 compare) as long as the bytes agree, and backward
+// into the literals not written yet, then emitted as one tag instead of one 13-byte tag per 4096-byte step:
+//   [255][8B offset][4B Pippip(offset)]                          CHUNK_SIZE bytes (the v7 tag, unchanged)
+//   [255][8B offset][4B Pippip(offset, length)][4B length]       'length' bytes, more than CHUNK_SIZE
+// The decoder tries the short form first; a long tag whose checksum would pass as a short one is never emitted.
+// The archive starts with the format marker, so that a v7 decoder stops instead of taking long tags for literals.
+// The source never overlaps the destination (offset + length <= position): one memcpy per tag when decoding.
+#define LONG_TAG_SIZE 17
+#define MATCH_LEN_MAX 0xFFFFFFFFULL
+
+
+static inline uint64_t match_forward(const uint8_t* a, const uint8_t* b, uint64_t max) {
+    uint64_t n = 0;
+    while (n + 16 <= max) {
+        uint32_t eq = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(a + n)), _mm_loadu_si128((const __m128i*)(b + n))));
+        if (eq != 0xFFFF) return n + __builtin_ctz(~eq);
+        n += 16;
+    }
+    while (n < max && a[n] == b[n]) n++;
+    return n;
+}
+
+// Grows a verified hit the way Stage 4 emits it: forward while the bytes agree (the source ends before the destination
+// starts), then back into the literals pending since 'lit_start', moving '*pos' and '*match_off' along. Returns the length.
+static uint64_t match_extend(const ZirkaEncoder* z, const uint8_t* buffer, uint64_t* pos, uint64_t* match_off, uint64_t lit_start) {
+    uint64_t p = *pos, m = *match_off, len = CHUNK_SIZE;
+    if (!z->extend) return len;
+    uint64_t max = p - m;
+    if (max > z->filesize - p) max = z->filesize - p;
+    if (max > MATCH_LEN_MAX) max = MATCH_LEN_MAX;
+    len += match_forward(buffer + p + len, buffer + m + len, max - len);
+    while (p > lit_start && m > 0 && m + len < p && len < MATCH_LEN_MAX && buffer[p - 1] == buffer[m - 1]) {
+        p--; m--; len++;
+    }
+    *pos = p;
+    *match_off = m;
+    return len;
+}
+
+static inline uint32_t tag_check(uint64_t off, uint64_t len) {
+    uint32_t chk[4];
+    if (len == CHUNK_SIZE) {
+        FNV1A_Pippip_Yurii_OOO_128bit_AES_TriXZi_Mikayla_forte((const char *)&off, 8, 0, chk);
+    } else {
+        uint8_t key[12];
+        uint32_t len32 = (uint32_t)len;
+        memcpy(key, &off, 8);
+        memcpy(key + 8, &len32, 4);
+        FNV1A_Pippip_Yurii_OOO_128bit_AES_TriXZi_Mikayla_forte((const char *)key, 12, 0, chk);
+    }
+    return chk[0];
+}
+
+// How many bytes the tag for 'len' bytes at 'off' covers (a colliding long tag gives up its last byte), and its checksum
+static uint64_t tag_length(uint64_t off, uint64_t len, uint32_t* chk) {
+    *chk = tag_check(off, len);
+    while (len > CHUNK_SIZE && *chk == tag_check(off, CHUNK_SIZE)) *chk = tag_check(off, --len);
+    return len;
+}
+
+// Builds the tag for 'len' bytes at 'off' ('*bytes' of it) and returns how many bytes it covers
+static uint64_t build_tag(uint64_t off, uint64_t len, uint8_t* tag, uint64_t* bytes) {
+    uint32_t chk;
+    len = tag_length(off, len, &chk);
+    uint32_t len32 = (uint32_t)len;
+    tag[0] = MAGIC_BYTE;
+    memcpy(tag + 1, &off, 8);
+    memcpy(tag + 9, &chk, 4);
+    memcpy(tag + 13, &len32, 4);
+    *bytes = (len > CHUNK_SIZE) ? LONG_TAG_SIZE : LONG_TAG_SIZE - 4;
+    return len;
+}
+
+// --- BATCHED VERIFICATION (Locality-Sorted Paranoia Check) ---
+// Stage 4 used to memcmp every rank hit against its master inside the serial loop: one random read, possibly gigabytes
+// back into the input, per tag (a major fault each with a cold page cache). Now every bucket is verified while Nuclear
+// Phase 3 applies it: its updates (sorted by position) are cut into diagonal segments (pos, target) .. (pos + L - 1,
+// target + L - 1), the segments are ordered by master offset, and the team checks them in ascending master order with
+// the input ahead prefetched. One segment costs L + CHUNK_SIZE - 1 byte compares instead of L x CHUNK_SIZE: every window
+// not crossing a mismatching byte is a duplicate. Rejected positions go back to NULL_RANK, so Stage 4 trusts every hit.
+#define VERIFY_PREFETCH (1ULL << 20) // Input read ahead (MADV_WILLNEED) of the masters being compared, per thread
+
+typedef struct {
+    uint64_t pos;
+    uint64_t target;
+    uint64_t len;
+} VerifySegment;
+
+// LSD radix sort by target, 11 bits per pass (only as many passes as the largest target needs); the result ends up in 'seg'
+static void sort_segments(VerifySegment* seg, VerifySegment* tmp, uint64_t count, uint64_t max_target) {
+    uint64_t hist[2048];
+    for (int shift = 0; shift < 64 && (max_target >> shift); shift += 11) {
+        memset(hist, 0, sizeof(hist));
+        for (uint64_t i = 0; i < count; i++) hist[(seg[i].target >> shift) & 2047]++;
+        for (uint64_t d = 0, sum = 0; d < 2048; d++) { uint64_t c = hist[d]; hist[d] = sum; sum += c; }
+        for (uint64_t i = 0; i < count; i++) tmp[hist[(seg[i].target >> shift) & 2047]++] = seg[i];
+        memcpy(seg, tmp, count * sizeof(VerifySegment));
+    }
+}
+
+// Verifies the run of bucket 'b' (window[i] = rank[w0 + i]), returns the rejected updates. 'seg' has room for two runs.
+static uint64_t verify_run(ZirkaEncoder* z, const RankUpdate* run, uint64_t n, uint64_t* window, uint64_t w0, VerifySegment* seg) {
+    const uint8_t* buffer = z->buffer;
+    uint64_t filesize = z->filesize;
+    uint64_t page = (uint64_t)sysconf(_SC_PAGESIZE);
+    uint64_t count = 0, max_target = 0;
+    for (uint64_t i = 0; i < n; i++) {
+        if (count && run[i].pos == seg[count - 1].pos + seg[count - 1].len && run[i].target == seg[count - 1].target + seg[count - 1].len) {
+            seg[count - 1].len++;
+            continue;
+        }
+        seg[count].pos = run[i].pos;
+        seg[count].target = run[i].target;
+        seg[count].len = 1;
+        if (run[i].target > max_target) max_target = run[i].target;
+        count++;
+    }
+    sort_segments(seg, seg + n, count, max_target);
+
+    uint64_t rejected = 0;
+    #pragma omp parallel reduction(+:rejected)
+    {
+        uint64_t fetched = 0; // This thread's prefetch mark
+        #pragma omp for schedule(dynamic, 16)
+        for (uint64_t k = 0; k < count; k++) {
+            uint64_t pos = seg[k].pos, target = seg[k].target, len = seg[k].len;
+            uint64_t span = len + CHUNK_SIZE - 1; // Bytes the segment's windows cover
+            if (z->mapped && target + span > fetched) {
+                uint64_t from = (target > fetched ? target : fetched) & ~(page - 1);
+                fetched = target + span + VERIFY_PREFETCH;
+                if (fetched > filesize) fetched = filesize;
+                madvise((uint8_t*)buffer + from, fetched - from, MADV_WILLNEED);
+            }
+            if (target + CHUNK_SIZE > pos) { // Must be a backward reference (the same for the whole diagonal)
+                for (uint64_t i = 0; i < len; i++) window[pos + i - w0] = NULL_RANK;
+                rejected += len;
+                continue;
+            }
+            // Window i is good unless one of the bytes [i, i + CHUNK_SIZE) differs
+            uint64_t at = 0, clear = 0; // Windows below 'clear' are settled
+            while (at < span) {
+                at += match_forward(buffer + pos + at, buffer + target + at, span - at);
+                if (at == span) break;
+                uint64_t first = (at + 1 > CHUNK_SIZE) ? at + 1 - CHUNK_SIZE : 0;
+                if (first < clear) first = clear;
+                uint64_t last = (at < len) ? at + 1 : len;
+                for (uint64_t i = first; i < last; i++) window[pos + i - w0] = NULL_RANK;
+                if (last > first) rejected += last - first;
+                clear = last;
+                at++;
+            }
+        }
+    }
+    return rejected;
+}
+
+// --- SEEK INDEX (--seekable) ---
+// Restoring one member of a huge archive should not mean restoring everything in front of it. With --seekable the
+// encoder also writes <file>.zirka.idx, a list of checkpoints where the decoder may start parsing the tag stream:
+//   "ZIRKAIX1" [8B interval] { [8B restored offset][8B tag-stream offset] }... [8B restored size][8B tag-stream size]
+// One checkpoint per 'interval' restored bytes (the first tag or literal at or after each multiple). Tag-stream
+// offsets count bytes before --lz framing. The archive itself is unchanged, so any decoder still reads it.
+#define SEEK_MAGIC "ZIRKAIX1"
+#define SEEK_INTERVAL_DEFAULT (256ULL * 1024)
+
+
+typedef struct {
+    ZirkaEncoder* z;
+    FILE* f;            // The job's index file, NULL = no index
+    uint64_t interval;
+    uint64_t next, count;
+} SeekIndex;
+
+static void seek_open(ZirkaEncoder* z, SeekIndex* s, FILE* f) {
+    memset(s, 0, sizeof(*s));
+    s->z = z;
+    if (!z->seek_interval || !f) return;
+    s->f = f;
+    s->interval = z->seek_interval;
+    fwrite(SEEK_MAGIC, 1, 8, s->f);
+    fwrite(&s->interval, 8, 1, s->f);
+}
+
+// Records the checkpoints falling into [from, to) of the input, whose first byte is at 'stream' in the tag stream.
+// A literal run may take several; a tag only ever gets one, at its start (call with to = from + 1).
+static inline void seek_mark(SeekIndex* s, uint64_t from, uint64_t to, uint64_t stream) {
+    while (s->f && s->next < to) {
+        uint64_t at = (s->next > from) ? s->next : from;
+        uint64_t point[2] = { at, stream + (at - from) };
+        fwrite(point, 8, 2, s->f);
+        s->count++;
+        s->next = (at / s->interval + 1) * s->interval;
+    }
+}
+
+static void seek_close(SeekIndex* s, uint64_t filesize, uint64_t stream) {
+    if (!s->f) return;
+    uint64_t point[2] = { filesize, stream };
+    fwrite(point, 8, 2, s->f);
+    if (fflush(s->f) != 0 || ferror(s->f)) zfail(s->z, "seek index write");
+    zlog(s->z, "   [Seek] %lu checkpoints, one per %lu KB restored.\n", s->count, s->interval >> 10);
+}
+
+// --- ESCAPED LITERALS (Input That Reads as Tags) ---
+// A literal 255 whose next 12 stream bytes end with the Pippip of the 8 before them reads as a tag, and with long tags
+// so do 16 bytes checking as offset and length: a .zirka inside the input would restore as garbage, or fault. Marked
+// archives store such a literal as the format marker's leading tag, which the decoder takes for one literal 255 (no
+// file reaches its offset). What a literal reads as depends on the bytes after it, escapes included, so every run is
+// decided backward before it is written, with the tag that follows it as lookahead; a 255 whose 16 bytes run past
+// that tag into what is not written yet is escaped when long tags are on. v7 archives (--no-extend) have no escape:
+// the encoder refuses input holding a valid v7 tag there rather than write an archive that cannot be restored.
+
+// Whether the stream bytes 'v' after a literal 255 ('n' known, 'more' when unknown ones follow) may read as a tag
+static bool reads_as_tag(const uint8_t* v, int n, bool more, bool ext) {
+    uint32_t chk[4], stored;
+    if (n < 12) return more;
+    memcpy(&stored, v + 8, 4);
+    FNV1A_Pippip_Yurii_OOO_128bit_AES_TriXZi_Mikayla_forte((const char*)v, 8, 0, chk);
+    if (chk[0] == stored) return true;
+    if (!ext) return false;
+    if (n < 16) return more;
+    uint8_t key[12];
+    memcpy(key, v, 8);
+    memcpy(key + 8, v + 12, 4);
+    FNV1A_Pippip_Yurii_OOO_128bit_AES_TriXZi_Mikayla_forte((const char*)key, 12, 0, chk);
+    return chk[0] == stored;
+}
+
+// Writes the literals buffer[from, to), followed in the stream by the 'next_n' bytes at 'next' (NULL: the stream ends)
+static void emit_literals(OutStream* o, SeekIndex* s, const uint8_t* buffer, uint64_t from, uint64_t to, const uint8_t* next, uint64_t next_n) {
+    ZirkaEncoder* z = o->z;
+    uint64_t ne = 0; // Escaped literals, last first
+    for (uint64_t q = to; q > from; ) {
+        const uint8_t* hit = memrchr(buffer + from, MAGIC_BYTE, q - from);
+        if (!hit) break;
+        q = hit - buffer;
+        uint8_t v[16];
+        int n = 0;
+        uint64_t e = ne;
+        for (uint64_t k = q + 1; n < 16 && k < to; k++) {
+            if (e && o->esc[e - 1] == k) {
+                for (int i = 0; i < FORMAT_TAG_SIZE && n < 16; i++) v[n++] = o->escape[i];
+                e--;
+            } else v[n++] = buffer[k];
+        }
+        for (uint64_t i = 0; n < 16 && i < next_n; i++) v[n++] = next[i];
+        if (!reads_as_tag(v, n, next != NULL, z->extend)) continue;
+        if (!z->extend && !o->lz) { errno = ENOTSUP; zfail(z, "--no-extend: the input holds a v7 tag as data, which a v7 archive cannot store"); }
+        if (ne == o->esc_cap) {
+            o->esc_cap = o->esc_cap ? 2 * o->esc_cap : 64;
+            o->esc = realloc(o->esc, o->esc_cap * sizeof(uint64_t));
+            if (!o->esc) zfail(z, "malloc");
+        }
+        o->esc[ne++] = q;
+    }
+    o->escapes += ne;
+    uint64_t at = from;
+    while (ne) {
+        uint64_t q = o->esc[--ne];
+        seek_mark(s, at, q, o->raw_bytes);
+        if (q > at) out_write(o, buffer + at, q - at);
+        seek_mark(s, q, q + 1, o->raw_bytes);
+        out_write(o, o->escape, FORMAT_TAG_SIZE);
+        at = q + 1;
+    }
+    seek_mark(s, at, to, o->raw_bytes);
+    if (to > at) out_write(o, buffer + at, to - at);
+}
+
+// --- CONTENT CHECKSUM (Parallel Tree Hash, --verify) ---
+// Stage 1 already streams every input byte through the team, so it also hashes the file in TREE_LEAF pieces
+// (Pippip-128 per leaf, leaves in parallel); the root is Pippip-128 over the leaf hashes, the file size and the leaf size.
+// The archive ends with a footer holding the root, and the decoder hashes its output the same way while it restores:
+// checking a restore costs no extra pass over either file. The format marker announces the footer, so the decoder never
+// guesses from the last bytes of a tag stream; archives for v7 decoders (--no-extend) carry neither.
+#define TREE_LEAF (64ULL * 1024)
+#define SUM_MAGIC "ZIRKASUM"
+#define SUM_FOOTER_SIZE 32 // [8B magic][16B root][4B leaf size][4B Pippip of the 28 bytes before]
+
+static void tree_init(ZirkaEncoder* z) {
+    z->tree_leaves = (z->filesize + TREE_LEAF - 1) / TREE_LEAF;
+    free(z->tree);
+    z->tree = malloc((z->tree_leaves + 1) * 2 * sizeof(uint64_t)); // + the sizes the root covers
+    if (!z->tree) zfail(z, "checksum leaves");
+    z->tree_done = 0;
+}
+
+// Hashes the leaves of the Stage 1 block at entry 'w0' ('src', 'wn' windows; the last block runs on to the end of
+// the file). Called by every thread of a team. Blocks that do not continue the leaves hashed so far are left to tree_root().
+static void tree_leaves(ZirkaEncoder* z, const uint8_t* src, uint64_t w0, uint64_t wn) {
+    uint64_t end = (w0 + wn >= z->entry_count) ? z->filesize : w0 + wn;
+    if (w0 != z->tree_done * TREE_LEAF || (end % TREE_LEAF && end != z->filesize)) return;
+    uint64_t last = (end + TREE_LEAF - 1) / TREE_LEAF;
+    #pragma omp for schedule(dynamic, 1)
+    for (uint64_t k = z->tree_done; k < last; k++) {
+        uint64_t from = k * TREE_LEAF, to = (from + TREE_LEAF < end) ? from + TREE_LEAF : end;
+        FNV1A_Pippip_Yurii_OOO_128bit_AES_TriXZi_Mikayla_forte((const char*)src + (from - w0), to - from, 0, z->tree + 2 * k);
+    }
+    #pragma omp single
+    z->tree_done = last;
+}
+
+// The root; leaves Stage 1 did not hash (a resumed run) are hashed from the input now
+static void tree_root(ZirkaEncoder* z, uint64_t root[2]) {
+    if (z->tree_done < z->tree_leaves) {
+        uint64_t w0 = z->tree_done * TREE_LEAF;
+        zlog(z, "   Checksum: hashing %.1f MB of input Stage 1 did not...\n", (z->filesize - w0) / 1048576.0);
+        #pragma omp parallel
+        tree_leaves(z, z->buffer + w0, w0, z->entry_count > w0 ? z->entry_count - w0 : 0);
+    }
+    z->tree[2 * z->tree_leaves] = z->filesize;
+    z->tree[2 * z->tree_leaves + 1] = TREE_LEAF;
+    FNV1A_Pippip_Yurii_OOO_128bit_AES_TriXZi_Mikayla_forte((const char*)z->tree, (z->tree_leaves + 1) * 2 * sizeof(uint64_t), 0, root);
+}
+
+// Appends the footer behind everything out_close() wrote
+static void write_checksum(ZirkaEncoder* z, FILE* f) {
+    uint8_t footer[SUM_FOOTER_SIZE];
+    uint32_t leaf = TREE_LEAF, chk[4];
+    tree_root(z, z->stats.checksum);
+    memcpy(footer, SUM_MAGIC, 8);
+    memcpy(footer + 8, z->stats.checksum, 16);
+    memcpy(footer + 24, &leaf, 4);
+    FNV1A_Pippip_Yurii_OOO_128bit_AES_TriXZi_Mikayla_forte((const char*)footer, 28, 0, chk);
+    memcpy(footer + 28, &chk[0], 4);
+    if (fwrite(footer, 1, SUM_FOOTER_SIZE, f) != SUM_FOOTER_SIZE || fflush(f) != 0) zfail(z, "archive write");
+    z->stats.output_bytes += SUM_FOOTER_SIZE;
+    zlog(z, "   Checksum: %016lx%016lx (tree of %lu leaves of %llu KB, checked by FastUnzirka --verify)\n", z->stats.checksum[1], z->stats.checksum[0], z->tree_leaves, TREE_LEAF >> 10);
+}
+
+// File jobs create their outputs only when Stage 4 starts: a --plan run or a refused plan leaves nothing behind
+static void open_outputs(ZirkaEncoder* z) {
+    if (z->fout) return;
+    z->fout = fopen(z->out_path, "wb");
+    if (!z->fout) zfail(z, z->out_path);
+    if (!z->seek_interval) return;
+    char idx_path[1100];
+    snprintf(idx_path, sizeof(idx_path), "%s.idx", z->out_path);
+    z->fidx = fopen(idx_path, "wb");
+    if (!z->fidx) zfail(z, idx_path);
+}
+
+// --- TAR-AWARE INDEXING (--tar) ---
+// In a tar archive the data of every member starts on a 512-byte block, so a file stored twice shows up as two copies
+// starting at block boundaries. With --tar the member headers are walked first (ustar/GNU fields, base-256 sizes, pax
+// 'size' records) and Stage 1 only indexes the windows that start on a data block of a member: one position in 512,
+// so the index and its sort shrink about 512x while duplicates across members are still found (Stage 4 grows every
+// hit both ways as usual). Header blocks, pax records and GNU long names are never indexed; they stay literals unless
+// a hit grows over them. From a header that does not parse to the next block that holds one, every window is indexed,
+// like without --tar; so is all of an input that does not start with a header.
+// The index is compact: entry c belongs to window layout_window(c), without --tar simply window c.
+// Only the Nuclear pipeline reads a compact index (the others take an entry's place for its window).
+#define TAR_BLOCK 512
+
+typedef struct {
+    uint64_t start, end;   // Windows [start, end),
+    uint64_t step;         // every 'step'-th one from 'start' (1: all of them, TAR_BLOCK: a member's data blocks)
+    uint64_t first;        // Index entries of the spans before
+} IndexSpan;
+
+typedef struct IndexLayout {
+    IndexSpan* span;
+    uint64_t n, cap;
+    uint64_t members;      // Tar headers walked
+    uint64_t dense;        // Windows indexed at every position
+} IndexLayout;
+
+static void layout_add(ZirkaEncoder* z, IndexLayout* l, uint64_t start, uint64_t end, uint64_t step) {
+    if (end > z->entry_count) end = z->entry_count;
+    if (start >= end) return;
+    if (l->n == l->cap) {
+        l->cap = l->cap ? 2 * l->cap : 1024;
+        l->span = (IndexSpan*)realloc(l->span, l->cap * sizeof(IndexSpan));
+        if (!l->span) zfail(z, "index layout");
+    }
+    uint64_t first = l->n ? l->span[l->n - 1].first + (l->span[l->n - 1].end - l->span[l->n - 1].start + l->span[l->n - 1].step - 1) / l->span[l->n - 1].step : 0;
+    l->span[l->n++] = (IndexSpan){ start, end, step, first };
+    if (step == 1) l->dense += end - start;
+    z->index_entries = first + (end - start + step - 1) / step;
+}
+
+// The window of index entry c
+static inline uint64_t layout_window(const IndexLayout* l, uint64_t c) {
+    uint64_t lo = 0, hi = l->n - 1;
+    while (lo < hi) {
+        uint64_t mid = (lo + hi + 1) / 2;
+        if (l->span[mid].first <= c) lo = mid; else hi = mid - 1;
+    }
+    return l->span[lo].start + (c - l->span[lo].first) * l->span[lo].step;
+}
+
+// Index entries of the windows before w
+static uint64_t layout_count(const IndexLayout* l, uint64_t w) {
+    uint64_t lo = 0, hi = l->n;
+    while (lo < hi) {
+        uint64_t mid = (lo + hi) / 2;
+        if (l->span[mid].start < w) lo = mid + 1; else hi = mid;
+    }
+    if (lo == 0) return 0;
+    const IndexSpan* sp = &l->span[lo - 1];
+    uint64_t end = (w < sp->end) ? w : sp->end;
+    return sp->first + (end - sp->start + sp->step - 1) / sp->step;
+}
+
+// Octal, space or NUL terminated, or base-256 when the first byte has its top bit set (GNU, 8 GB and more)
+static bool tar_number(const uint8_t* f, int len, uint64_t* out) {
+    uint64_t v = 0;
+    int i = 0;
+    if (f[0] & 0x80) {
+        if (f[0] != 0x80) return false; // Negative or beyond 64 bits
+        for (i = 1; i < len; i++) {
+            if (v >> 56) return false;
+            v = (v << 8) | f[i];
+        }
+        *out = v;
+        return true;
+    }
+    while (i < len && f[i] == ' ') i++;
+    for (; i < len && f[i] >= '0' && f[i] <= '7'; i++) {
+        if (v >> 60) return false;
+        v = (v << 3) | (f[i] - '0');
+    }
+    if (i < len && f[i] != ' ' && f[i] != 0) return false;
+    *out = v;
+    return true;
+}
+
+// A header block: its checksum (the sum of its bytes, the checksum field counted as spaces) must match
+static bool tar_header(const uint8_t* h, uint64_t* size) {
+    uint64_t sum = 0, chk;
+    for (int i = 0; i < TAR_BLOCK; i++) sum += (i >= 148 && i < 156) ? ' ' : h[i];
+    return tar_number(h + 148, 8, &chk) && chk == sum && tar_number(h + 124, 12, size);
+}
+
+static bool tar_zero(const uint8_t* h) {
+    for (int i = 0; i < TAR_BLOCK; i++) if (h[i]) return false;
+    return true;
+}
+
+// The "size" record of a pax extended header ("LEN size=VALUE\n"), which overrides the size of the next member
+static bool tar_pax_size(const uint8_t* p, uint64_t n, uint64_t* size) {
+    bool found = false;
+    while (n) {
+        uint64_t len = 0, i = 0;
+        while (i < n && i < 20 && p[i] >= '0' && p[i] <= '9') len = len * 10 + (p[i++] - '0');
+        if (i == 0 || len > n || len < i + 2 || p[i] != ' ' || p[len - 1] != '\n') return found;
+        if (len - i - 2 > 5 && memcmp(p + i + 1, "size=", 5) == 0) {
+            uint64_t v = 0, k = i + 6;
+            for (; k < len - 1 && p[k] >= '0' && p[k] <= '9' && v < (1ULL << 59); k++) v = v * 10 + (p[k] - '0');
+            if (k == len - 1) { *size = v; found = true; }
+        }
+        p += len;
+        n -= len;
+    }
+    return found;
+}
+
+// Builds z->layout: every window, or (--tar) the member data blocks
+static void layout_build(ZirkaEncoder* z) {
+    IndexLayout* l = z->layout;
+    const uint8_t* b = z->buffer;
+    uint64_t filesize = z->filesize, off = 0, size, pax = UINT64_MAX;
+    l->n = l->members = l->dense = 0;
+    z->index_entries = 0;
+    if (!z->tar || filesize < TAR_BLOCK || !tar_header(b, &size)) {
+        if (z->tar) zlog(z, "   [Tar] The input does not start with a tar header, every window is indexed.\n");
+        layout_add(z, l, 0, z->entry_count, 1);
+        return;
     }
+    while (off + TAR_BLOCK <= filesize) {
+        const uint8_t* h = b + off;
+        if (tar_zero(h)) { off += TAR_BLOCK; continue; } // End of archive (or padding before a concatenated one)
+        uint64_t data = off + TAR_BLOCK;
+        bool ok = tar_header(h, &size);
+        if (ok && pax != UINT64_MAX) size = pax;
+        if (!ok || size > filesize - data) {
+            // Not a member we can follow: index every window up to the next header on a block boundary
+            uint64_t from = off;
+            do off += TAR_BLOCK; while (off + TAR_BLOCK <= filesize && (tar_zero(b + off) || !tar_header(b + off, &size)));
+            layout_add(z, l, from, off, 1);
+            pax = UINT64_MAX;
+            continue;
+        }
+        pax = UINT64_MAX;
+        l->members++;
+        uint8_t type = h[156];
+        if (type == 'x') tar_pax_size(b + data, size, &pax);
+        else if (type >= '1' && type <= '6') size = 0; // Links, devices, directories and FIFOs have no data blocks
+        else if (type != 'g' && type != 'L' && type != 'K') layout_add(z, l, data, data + size, TAR_BLOCK);
+        off = data + (size + TAR_BLOCK - 1) / TAR_BLOCK * TAR_BLOCK;
+    }
+    zlog(z, "   [Tar] %lu members: %lu of %lu windows indexed (%.2f%%), %lu of them outside the member data\n", l->members, z->index_entries,
+         z->entry_count, z->entry_count ? 100.0 * z->index_entries / z->entry_count : 0.0, l->dense);
+}
 
-    // 4. ENCODE (Serial Dependency on Window Slide)
-    printf("4. Encoding...\n");
-    char out_name[512]; snprintf(out_name, 512, "%s.zirka", argv[1]);
-    FILE* fout = fopen(out_name, "wb");
+// --- LOW-ENTROPY RUNS (Zero Fill Kept Out of the Index) ---
+// A run of L zeros used to put L - 4095 windows with one hash into the index: one giant group for the gather, then
+// L updates to bucket, sort, verify and apply, all for tags Stage 4 could have found alone. Stage 1 now compares every
+// byte j with byte j + RUN_PERIOD (SSE2, 16 at a time) while it hashes, and leaves out each window w whose bytes
+// [w - RUN_PERIOD, w + CHUNK_SIZE) repeat at that distance: its content is that of window w - RUN_PERIOD, so the first
+// RUN_PERIOD windows of the run still stand for all the others in the index. This catches constant runs and patterns
+// of period 2, 3, 4, 6, 8, 12, 16, 24 and 48 (UTF-16 blanks, solid RGB/RGBA pixels, repeated records). Shards simply
+// skip those windows; the monolithic index (one entry per position) gives them a key no other window has.
+// Stage 4 runs the same scan along 'pos' and takes a window left out from the start of its run (verified, never
+// overlapping), the copy the full index would have found: the archive does not change, no tag or format is added.
+// Only the Nuclear pipeline knows about the windows left out; the others still index them all.
+#define RUN_PERIOD 48      // The least common multiple of the periods caught
+#define RUN_KEY UINT64_MAX // h2 of a window left out of the monolithic index (h1 = its offset: a group of one)
 
-    uint64_t pos = 0;
-    uint64_t prcnt = 0;
-    while(pos < filesize) {
-        if (pos > entry_count - 1) {
-            fwrite(buffer + pos, 1, filesize - pos, fout);
-            break;
-        }
+typedef struct {
+    uint64_t next;         // Next position compared
+    uint64_t start;        // First position of the current stretch of equal compares
+} RunScan;
+
+typedef struct {
+    uint64_t w0, w1;       // Windows [w0, w1) left out
+} RunSpan;
+
+typedef struct {
+    RunSpan* span;
+    uint64_t n, cap;
+} RunSpans;
+
+// The stretch of equal compares [start, end) makes windows [start + RUN_PERIOD, end + RUN_PERIOD - CHUNK_SIZE] redundant
+static void run_span_add(ZirkaEncoder* z, RunSpans* out, uint64_t start, uint64_t end) {
+    if (!out || end - start < CHUNK_SIZE) return;
+    if (out->n == out->cap) {
+        out->cap = out->cap ? 2 * out->cap : 64;
+        out->span = (RunSpan*)realloc(out->span, out->cap * sizeof(RunSpan));
+        if (!out->span) zfail(z, "run spans");
+    }
+    out->span[out->n++] = (RunSpan){ start + RUN_PERIOD, end + RUN_PERIOD - CHUNK_SIZE + 1 };
+}
+
+// Compares the positions up to 'end' ('p' holds the bytes from position p0 on, through end + RUN_PERIOD).
+// The stretches that end on the way go to 'out' (NULL: only the state is kept).
+static void run_scan(ZirkaEncoder* z, RunScan* s, const uint8_t* p, uint64_t p0, uint64_t end, RunSpans* out) {
+    uint64_t j = s->next;
+    if (end <= j) return;
+    for (; j + 16 <= end; j += 16) {
+        const uint8_t* a = p + (j - p0);
+        uint32_t ne = ~(uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)a), _mm_loadu_si128((const __m128i*)(a + RUN_PERIOD)))) & 0xFFFF;
+        if (!ne) continue;
+        run_span_add(z, out, s->start, j + __builtin_ctz(ne));
+        s->start = j + 32 - __builtin_clz(ne); // Past the last difference
+    }
+    for (; j < end; j++) {
+        if (p[j - p0] != p[j - p0 + RUN_PERIOD]) { run_span_add(z, out, s->start, j); s->start = j + 1; }
+    }
+    s->next = end;
+}
+
+// Stage 1: the windows of block [w0, w0 + wn) left out ('src' holds the block and the CHUNK_SIZE - 1 bytes after it),
+// sorted and clipped to the block. Blocks must come in order; returns how many of them the index layout holds.
+static uint64_t run_block(ZirkaEncoder* z, RunScan* s, const uint8_t* src, uint64_t w0, uint64_t wn, RunSpans* out) {
+    out->n = 0;
+    run_scan(z, s, src, w0, w0 + wn + CHUNK_SIZE - 1 - RUN_PERIOD, out);
+    run_span_add(z, out, s->start, s->next); // The stretch still open at the end of the block
+    uint64_t kept = 0, total = 0;
+    for (uint64_t i = 0; i < out->n; i++) {
+        RunSpan r = out->span[i];
+        if (r.w0 < w0) r.w0 = w0;
+        if (r.w1 > w0 + wn) r.w1 = w0 + wn;
+        if (r.w0 >= r.w1) continue;
+        out->span[kept++] = r;
+        total += layout_count(z->layout, r.w1) - layout_count(z->layout, r.w0);
+    }
+    out->n = kept;
+    return total;
+}
+
+static inline bool run_covers(const RunSpans* r, uint64_t w) {
+    uint64_t lo = 0, hi = r->n;
+    while (lo < hi) {
+        uint64_t mid = (lo + hi) / 2;
+        if (r->span[mid].w1 <= w) lo = mid + 1; else hi = mid;
+    }
+    return lo < r->n && r->span[lo].w0 <= w;
+}
+
+// Stage 4: the source of window 'pos' if Stage 1 left it out, else NULL_RANK. 'pos' only moves forward.
+// The start of the run comes first (right for any period that divides the distance), then the first position of
+// the same phase, which the repetition guarantees once it lies CHUNK_SIZE back. Closer to the start, the window of
+// the same phase among the first RUN_PERIOD ones has the same content, so its rank (if the rank map block 'rank' at
+// 'rank_lo' still holds it) is a source too: a run met before elsewhere. That position goes to 'read' (may be NULL).
+static uint64_t run_source(ZirkaEncoder* z, RunScan* s, const uint8_t* buffer, uint64_t pos, const uint64_t* rank, uint64_t rank_lo, uint64_t* read) {
+    if (pos < RUN_PERIOD || pos + CHUNK_SIZE > z->filesize) return NULL_RANK;
+    run_scan(z, s, buffer, 0, pos + CHUNK_SIZE - RUN_PERIOD, NULL);
+    if (s->start > pos - RUN_PERIOD) return NULL_RANK;
+    uint64_t src = s->start;
+    if (pos - src >= CHUNK_SIZE && memcmp(buffer + pos, buffer + src, CHUNK_SIZE) == 0) return src;
+    src += (pos - src) % RUN_PERIOD;
+    if (pos - src >= CHUNK_SIZE) return (memcmp(buffer + pos, buffer + src, CHUNK_SIZE) == 0) ? src : NULL_RANK;
+    if (src < rank_lo) return NULL_RANK;
+    if (read) *read = src;
+    return rank[src - rank_lo];
+}
+
+// --- BLOCK-ALIGNED REFERENCES (--align-refs) ---
+// The decoder's --reflink shares a match's blocks with its source when the two lie a whole number of file system blocks
+// apart. Every duplicate points to the first occurrence of its content, wherever that lies; with --align-refs Stage 4
+// remembers, per source, the last block-aligned position that copied it, and a later block-aligned duplicate of the same
+// source copies from there instead (the same window, verified when that copy was found). The table is direct-mapped:
+// a collision only costs one tag its alignment.
+#define ALIGN_BLOCK 4096 // The file system block --reflink shares
+#define ALIGN_SLOTS (1u << 20)
+typedef struct { uint64_t source, copy; } AlignSlot;
+
+static uint64_t align_source(AlignSlot* table, uint64_t pos, uint64_t match_off, uint64_t* moved) {
+    if (pos % ALIGN_BLOCK != 0 || match_off % ALIGN_BLOCK == 0) return match_off;
+    AlignSlot* s = &table[(match_off * 0x9E3779B97F4A7C15ULL) >> 44]; // 20 bits
+    uint64_t src = match_off;
+    if (s->source == match_off && s->copy + CHUNK_SIZE <= pos) { src = s->copy; (*moved)++; }
+    s->source = match_off; // Slot 0 never matches: offset 0 is aligned
+    s->copy = pos;
+    return src;
+}
+
+// --- PARSE-AWARE PRUNING (Nuclear Phase 2) ---
+// Stage 4 only reads the rank of the positions its greedy parse lands on, and every tag skips at least the CHUNK_SIZE - 1
+// positions after its start: inside a duplicate region nearly all updates are gathered, sorted, verified and applied for
+// a parse that jumps over them. Once a bucket is sorted its updates are known in position order, so the sort replays
+// Stage 4's parse over it (the same hit check, extension, tag length, low-entropy runs and --align-refs, carried from
+// bucket to bucket) and writes back only the updates the parse lands on, plus those run_source() reads near the start of
+// a low-entropy run. Under every tag it keeps one resync point per CHUNK_SIZE bytes (the position's own update, else the
+// source shifted along the tag): wherever Stage 4 might leave the replayed path (a resumed sort starts without the state
+// before it), it is back on a tag within CHUNK_SIZE bytes. Every update kept is still verified when applied, so the
+// replay only decides how well the file compresses, never whether it restores.
+typedef struct {
+    uint64_t next, lit_start;            // Where the parse goes on, and the literals pending there
+    uint64_t tag_pos, tag_src, tag_end;  // Its last tag (a hit at tag_pos on tag_src, covering up to tag_end)
+    RunScan runs;
+    AlignSlot* align;
+    uint64_t* kept;                      // Per position modulo CHUNK_SIZE: the last one kept
+    uint64_t tags, resyncs, made;        // 'made': resync points with no update of their own
+} ParseReplay;
+
+static inline uint64_t replay_keep(ParseReplay* pr, RankUpdate* run, uint64_t k, uint64_t pos, uint64_t src) {
+    pr->kept[pos % CHUNK_SIZE] = pos;
+    run[k++] = (RankUpdate){ pos, src };
+    return k;
+}
+
+// Positions [from, to) of the bucket at 'base' lie under the last tag: only its resync points stay in the rank map
+static uint64_t replay_shadow(ParseReplay* pr, RankUpdate* run, uint64_t k, const uint64_t* slot, uint64_t base, uint64_t from, uint64_t to) {
+    uint64_t q = pr->tag_pos + (from - pr->tag_pos + CHUNK_SIZE - 1) / CHUNK_SIZE * CHUNK_SIZE;
+    for (; q < to && q + CHUNK_SIZE <= pr->tag_end; q += CHUNK_SIZE) {
+        if (slot[q - base] != NULL_RANK) k = replay_keep(pr, run, k, q, slot[q - base]);
+        else { k = replay_keep(pr, run, k, q, pr->tag_src + (q - pr->tag_pos)); pr->made++; }
+        pr->resyncs++;
+    }
+    return k;
+}
 
-        uint64_t my_rank = rank[pos];
-        bool found = false;
-        uint64_t match_offset = 0;
-
-        if (my_rank > 0) {
-            DiskEntry candidate = index[my_rank - 1];
-            DiskEntry me = index[my_rank];
-
-            // Hash Check
-            if (candidate.h1 == me.h1 && candidate.h2 == me.h2) {
-                // Content Verify
-                if (memcmp(buffer + pos, buffer + candidate.offset, CHUNK_SIZE) == 0) {
-                     if (candidate.offset < pos) {
-                        found = true;
-                        match_offset = candidate.offset;
-                     }
+// The targets of positions [base, end) are in 'slot' (one per position, the CHUNK_SIZE positions before 'base' in front of
+// it); 'run' holds the k updates kept of [from, base). Appends the ones kept here and returns the new count; 'slot' keeps
+// the rank map without pruning.
+static uint64_t parse_prune(ZirkaEncoder* z, ParseReplay* pr, RankUpdate* run, uint64_t k, uint64_t from, uint64_t base, uint64_t end, uint64_t* slot) {
+    const uint8_t* buffer = z->buffer;
+    uint64_t front = (base > CHUNK_SIZE) ? base - CHUNK_SIZE : 0;
+    uint64_t block = z->io_block / sizeof(uint64_t); // Stage 4 reads the rank map in blocks of this many positions
+    uint64_t pos = (pr->next > base) ? pr->next : base, moved;
+    if (pos > base) k = replay_shadow(pr, run, k, slot, base, base, (pos < end) ? pos : end);
+
+    while (pos < end) {
+        uint64_t src = slot[pos - base];
+        if (src != NULL_RANK) {
+            // The check the batched verification makes: a backward copy of the whole window
+            if (src + CHUNK_SIZE <= pos && match_forward(buffer + pos, buffer + src, CHUNK_SIZE) == CHUNK_SIZE) {
+                k = replay_keep(pr, run, k, pos, src);
+            } else {
+                slot[pos - base] = src = NULL_RANK;
+                z->rejected++;
+            }
+        }
+        if (src == NULL_RANK) {
+            uint64_t lo = pos - pos % block; // What run_source() sees of the rank map: Stage 4's current block
+            if (lo < front) lo = front;
+            uint64_t read = NULL_RANK;
+            src = run_source(z, &pr->runs, buffer, pos, slot + ((int64_t)lo - (int64_t)base), lo, &read);
+            if (src != NULL_RANK && read != NULL_RANK) { // A rank Stage 4 reads off the parse: verified and kept as well
+                if (src + CHUNK_SIZE > read || match_forward(buffer + read, buffer + src, CHUNK_SIZE) != CHUNK_SIZE) {
+                    slot[read - base] = src = NULL_RANK;
+                    z->rejected++;
+                } else if (pr->kept[read % CHUNK_SIZE] != read && read >= from) { // Within CHUNK_SIZE back: a short insertion
+                    uint64_t i = k++;
+                    for (; i > 0 && run[i - 1].pos > read; i--) run[i] = run[i - 1];
+                    run[i] = (RankUpdate){ read, src };
+                    pr->kept[read % CHUNK_SIZE] = read;
                 }
             }
+            if (src == NULL_RANK) { pos++; continue; }
         }
+        if (pr->align) src = align_source(pr->align, pos, src, &moved);
+        uint64_t p = pos, m = src;
+        uint32_t chk;
+        uint64_t len = match_extend(z, buffer, &p, &m, pr->lit_start);
+        len = tag_length(m, len, &chk);
+        pr->tag_pos = pos;
+        pr->tag_src = src;
+        pr->tag_end = pr->lit_start = p + len;
+        pr->tags++;
+        k = replay_shadow(pr, run, k, slot, base, pos + 1, (pr->tag_end < end) ? pr->tag_end : end);
+        pos = pr->tag_end;
+    }
+    pr->next = pos;
+    memmove(slot - CHUNK_SIZE, slot + (end - base) - CHUNK_SIZE, CHUNK_SIZE * sizeof(uint64_t)); // In front of the next pane
+    return k;
+}
 
-        prcnt++;
-        if (found) {
-            fputc(MAGIC_BYTE, fout);
-            fwrite(&match_offset, 8, 1, fout);
-            uint32_t h = calc_fnv_off(match_offset); 
-            fwrite(&h, 4, 1, fout);
-            pos += CHUNK_SIZE;
-        } else {
-            fputc(buffer[pos], fout);
-            pos++;
-        }
-        
-        if (prcnt == 7*1024) {printf("\r   Encoded: %.1f%%", (double)pos/filesize*100.0); prcnt = 0;}
+// --- MATCH LOOKUP (Stage 4 of rankmap, first and bs) ---
+// Nuclear's rank map only holds verified sources; the other pipelines hand Stage 4 a candidate to verify here.
+// Every source ends before 'pos' starts, as Nuclear's batched verification demands (see BATCHED VERIFICATION).
+typedef struct {
+    int pipeline;
+    const DiskEntry* index;  // Sorted; bs has every offset of a group turned into the group's first one
+    uint64_t count;
+    const uint64_t* rank;    // Per window: the first occurrence (first) or the window's entry in the index (rankmap)
+} MatchLookup;
+
+static uint64_t lookup_match(const MatchLookup* lk, const uint8_t* buffer, uint64_t pos) {
+    if (pos >= lk->count) return NULL_RANK;
+    uint64_t src = NULL_RANK;
+    if (lk->pipeline == PIPELINE_FIRST) {
+        src = lk->rank[pos];
+    } else if (lk->pipeline == PIPELINE_RANKMAP) {
+        // The previous occurrence sits right before us in the index; step back past those that overlap 'pos'
+        uint64_t r = lk->rank[pos];
+        const DiskEntry* me = &lk->index[r];
+        while (r > 0 && lk->index[r - 1].h2 == me->h2 && lk->index[r - 1].h1 == me->h1 && lk->index[r - 1].offset + CHUNK_SIZE > pos) r--;
+        if (r > 0 && lk->index[r - 1].h2 == me->h2 && lk->index[r - 1].h1 == me->h1) src = lk->index[r - 1].offset;
+    } else {
+        uint64_t h[2];
+        #ifdef eXdupe
+        FNV1A_Pippip_Yurii_OOO_128bit_AES_TriXZi_Mikayla_forte((const char*)buffer + pos, CHUNK_SIZE, 0, h); // As Stage 1 hashed it
+        #else
+        uint64_t digest[3];
+        sha1_sum(buffer + pos, CHUNK_SIZE, (uint8_t*)digest);
+        h[0] = digest[0]; h[1] = digest[1];
+        #endif
+        int64_t off = find_match_binary((DiskEntry*)lk->index, lk->count, h[0], h[1], pos);
+        if (off >= 0) src = (uint64_t)off;
     }
+    if (src == NULL_RANK || src + CHUNK_SIZE > pos || memcmp(buffer + pos, buffer + src, CHUNK_SIZE) != 0) return NULL_RANK;
+    return src;
+}
 
-    printf("\nDone.\n");
-    fclose(fout);
-    free(buffer);
-    
-    munmap(index, entry_count * sizeof(DiskEntry));
-    munmap(rank, entry_count * sizeof(uint64_t));
-    //unlink("zirka_index.tmp");
-    //unlink("zirka_rank.tmp");
-    
-    return 0;
-#endif
+// --- THE JOB (zirka_encode_file / _fd / _buffer) ---
+// The pipeline over one input: z->in_fd (mapped here) or the caller's z->buffer, into z->fout (and z->fidx).
+// Every failure goes through zfail(), which closes what the job opened and unwinds to encode_guarded().
+static int encode_job(ZirkaEncoder* z) {
+    const char* filename = z->name;
+    uint64_t filesize = z->filesize;
+    z->entry_count = (filesize >= CHUNK_SIZE) ? (filesize - CHUNK_SIZE + 1) : 0;
+
+    zlog(z, "[Zirka 1-Pass] File: %s (%.2f GB)\n", filename, filesize / 1024.0 / 1024.0 / 1024.0);
+    if (z->rss_limit)
+    zlog(z, "[Zirka 1-Pass] Zero-RAM Mode: Input is memory-mapped, RSS governed to %.2f GB (windows of %.0f MB).\n", z->rss_limit / 1024.0 / 1024.0 / 1024.0, z->rss_limit / 2 / 1048576.0);
+    else
+    zlog(z, "[Zirka 1-Pass] Zero-RAM Mode: Input is %s (OS manages paging).\n", z->buffer ? "the caller's buffer" : "memory-mapped");
+    print_temp_layout(z);
+    numa_bind(z);
+
+    // 2. MMAP THE INPUT (Zero-RAM Magic), unless the caller handed us its buffer
+    // PROT_READ: We only read. MAP_PRIVATE: Changes (if any) stay local.
+    if (!z->buffer) {
+        void* map = mmap(NULL, filesize, PROT_READ, MAP_PRIVATE, z->in_fd, 0);
+        if (map == MAP_FAILED) zfail(z, "mmap input failed");
+        z->buffer = map;
+        z->mapped = true;
+        // Hint to OS: We will read this sequentially (speeds up Hashing phase)
+        #ifdef __linux__
+        madvise(map, filesize, MADV_SEQUENTIAL);
+        #endif
+    }
+    const uint8_t* buffer = z->buffer;
 
-#ifdef rankmapSERIAL
-    // --- STAGE 3: BUILD RANK MAP (NUCLEAR OPTION) ---
-    printf("3. Building Rank Map (8x Filesize using MMAP, Nuclear Mode: Sequential I/O)...\n");
-    
-    // 1. Create the Rank Map (initially empty)
-    uint64_t* rank = create_mmap_file("zirka_rank.tmp", filesize * sizeof(uint64_t));
-    
-    // OPTIMIZATION: Huge Pages for random access speed later
-    #ifdef __linux__
-    madvise(rank, filesize * sizeof(uint64_t), MADV_HUGEPAGE);
-    #endif
+    // The map stays valid without the descriptor; Stage 1 streams the file through the storage layer instead.
+    Artifact art_input;
+    artifact_open_input(z, &art_input, z->mapped ? z->in_fd : -1, filesize, buffer);
+    layout_build(z);
+// 1. OPEN FILE & GET SIZE ]
 
-    // Initialize to NULL
-    #pragma omp parallel for
-    for(uint64_t i = 0; i < filesize; i++) rank[i] = NULL_RANK;
+    // 0. RESUME CHECK
+    RunManifest manifest;
+    uint64_t resume_stage = STAGE_NONE;
+    int shards_requested = z->shards;
+    if (z->resume) resume_stage = manifest_load(z, &manifest, &z->sb);
+    if (resume_stage != STAGE_NONE) z->shards = (int)manifest.shards;
+    // Validate the temp files the manifest vouches for, falling back to the latest stage they still support
+    if (resume_stage >= STAGE_RANKED && !temp_artifact_matches(z, &z->tmp_rank, "zirka_rank.tmp", filesize * sizeof(uint64_t))) {
+        zlog(z, "   [Resume] zirka_rank.tmp is missing or truncated, starting from scratch.\n");
+        resume_stage = STAGE_NONE;
+    }
+    if (resume_stage >= STAGE_GATHERED && resume_stage < STAGE_RANKED && (!z->bucket_fill || !temp_artifact_matches(z, &z->tmp_updates, "zirka_updates.tmp", z->entry_count * sizeof(RankUpdate)))) {
+        zlog(z, "   [Resume] zirka_updates.tmp is missing or truncated, %s.\n", z->shards ? "starting from scratch" : "resuming after the index sort");
+        resume_stage = z->shards ? STAGE_NONE : STAGE_SORTED;
+    }
+    if (resume_stage >= STAGE_HASHED && resume_stage < STAGE_GATHERED && z->shards) {
+        if (!shards_match(z, z->shards, manifest.shards_done, z->index_entries - z->run_windows - manifest.entries_done) ||
+            (manifest.shards_done && (!z->bucket_fill || !temp_artifact_matches(z, &z->tmp_updates, "zirka_updates.tmp", z->entry_count * sizeof(RankUpdate))))) {
+            zlog(z, "   [Resume] Shard files are missing or truncated, starting from scratch.\n");
+            resume_stage = STAGE_NONE;
+        }
+    } else if (resume_stage >= STAGE_HASHED && resume_stage < STAGE_RANKED && !z->shards && !temp_artifact_matches(z, &z->tmp_index, "zirka_index.tmp", z->index_entries * sizeof(DiskEntry))) {
+        zlog(z, "   [Resume] zirka_index.tmp is missing or truncated, starting from scratch.\n");
+        resume_stage = STAGE_NONE;
+    }
+    if (resume_stage == STAGE_NONE) z->shards = shards_requested;
+    z->pipeline = (resume_stage != STAGE_NONE) ? (int)manifest.pipeline : z->pipeline_requested;
+    if (z->pipeline == PIPELINE_AUTO) pipeline_choose(z, buffer);
+
+    // 0. PLAN (Refuse up front rather than fail in Stage 3)
+    ExecPlan plan;
+    plan_build(z, &plan, filesize, resume_stage != STAGE_NONE);
+    plan_print(&plan, filesize);
+    if (z->plan_only || !plan.feasible) snprintf(z->error, sizeof(z->error), "the execution plan does not fit the temp devices");
+    if (z->plan_only || (!plan.feasible && !z->force)) {
+        artifact_close(&art_input);
+        return plan.feasible ? ZIRKA_OK : ZIRKA_INFEASIBLE;
+    }
 
-    // --- NUCLEAR PHASE 1: GATHER UPDATES (Sequential Write) ---
-    printf("   [Nuclear] Gathering duplicates (16x Filesize using MMAP)...\n");
-    
-    // Create a temporary buffer for updates. 
-    // Max possible updates = entry_count (worst case).
-    RankUpdate* updates = create_mmap_file("zirka_updates.tmp", entry_count * sizeof(RankUpdate));
-    update_count = 0;
+    if (resume_stage == STAGE_NONE) manifest_init(z, &manifest, &z->sb, z->shards);
+    manifest_commit(z, &manifest, resume_stage);
+    metrics_init(z);
 
-    #pragma omp parallel for schedule(dynamic, 4096)
-    for (uint64_t i = 0; i < entry_count; i++) {
-        // Skip if not the "Group Leader" (First of identical hashes)
-        if (i > 0) {
-            if (index[i].h2 == index[i-1].h2 && index[i].h1 == index[i-1].h1) continue;
+    // 1. CREATE DISK INDEX
+    tree_init(z);
+    DiskEntry* index = NULL;
+    Artifact art_index = { 0 }, art_updates = { 0 }, art_rank = { 0 };
+    ShardSet shards;
+    if (resume_stage >= STAGE_HASHED && resume_stage < STAGE_RANKED && !z->shards) {
+        if (!artifact_open(z, &art_index, &z->tmp_index, "zirka_index.tmp", z->index_entries * sizeof(DiskEntry), false)) zfail(z, "zirka_index.tmp");
+        artifact_access(&art_index, ACCESS_RANDOM);
+        index = (DiskEntry*)art_index.map;
+    }
+    if (resume_stage == STAGE_HASHED && z->shards) shards_open(z, &shards, z->shards, manifest.shards_done, false);
+    double t_start;
+    if (resume_stage >= STAGE_HASHED) {
+    zlog(z, "1. Creating Index... skipped (resumed)\n");
+    } else if (z->shards) {
+    zlog(z, "1. Creating Index (24x Filesize in %d hash-partitioned shards, %lu entries)...\n", z->shards, z->index_entries);
+    shards_open(z, &shards, z->shards, 0, true);
+    zlog(z, "   Hashing & scattering (Parallel Pippip, per-thread write-combining buffers)...\n");
+    metrics_begin(z, "hash");
+    t_start = omp_get_wtime();
+    // Input blocks (plus the CHUNK_SIZE bytes the last windows reach into) are read ahead while the team hashes
+    IoReader in;
+    io_reader_start(&in, &art_input, 0, z->entry_count, z->io_block, CHUNK_SIZE);
+    const uint8_t* src = NULL;
+    uint64_t w0 = 0, wn = 0, left_out = 0, c0 = 0, c1 = 0;
+    RunScan scan = { 0, 0 };
+    RunSpans runs = { NULL, 0, 0 };
+    z->run_windows = 0;
+    #pragma omp parallel
+    {
+        ShardWriter writer;
+        shard_writer_init(&writer, &shards);
+        for (;;) {
+            #pragma omp single
+            {
+            zprogress(z, w0 + wn, z->entry_count);
+            src = io_reader_next(&in, &w0, &wn);
+            left_out = (src && z->pipeline == PIPELINE_NUCLEAR) ? run_block(z, &scan, src, w0, wn, &runs) : 0;
+            z->run_windows += left_out;
+            c0 = layout_count(z->layout, w0);
+            c1 = layout_count(z->layout, w0 + wn);
+            }
+            if (!src) break;
+            #pragma omp for schedule(dynamic, 4096)
+            for(uint64_t c=c0; c<c1; c++) {
+                uint64_t w = layout_window(z->layout, c);
+                if (left_out && run_covers(&runs, w)) continue;
+                uint64_t hash_out[2];
+                FNV1A_Pippip_Yurii_OOO_128bit_AES_TriXZi_Mikayla_forte ((const char *) (src + (w - w0)), CHUNK_SIZE, 0, hash_out);
+                DiskEntry e = { hash_out[0], hash_out[1], w };
+                shard_push(&writer, &e);
+            }
+            tree_leaves(z, src, w0, wn);
+        }
+        shard_writer_done(&writer);
+    }
+    io_queue_free(&in.q);
+    free(runs.span);
+    zlog(z, "   Hashed in %.2fs\n", omp_get_wtime() - t_start);
+    if (z->run_windows) zlog(z, "   Low-entropy runs: %lu windows left out of the index (%.1f%%)\n", z->run_windows, 100.0 * z->run_windows / z->index_entries);
+    for (int sh = 0; sh < z->shards; sh++) if (fdatasync(shards.fds[sh]) == -1) zwarn(z, "shard sync");
+    metrics_end(z);
+    manifest_commit(z, &manifest, STAGE_HASHED);
+    } else {
+    zlog(z, "1. Creating Index (24x Filesize, %lu entries, written in %lu MB blocks)...\n", z->index_entries, z->io_block >> 20);
+    artifact_open(z, &art_index, &z->tmp_index, "zirka_index.tmp", z->index_entries * sizeof(DiskEntry), true);
+    artifact_access(&art_index, ACCESS_SEQ_WRITE);
+        #ifdef eXdupe
+    zlog(z, "   Hashing (Parallel Pippip, taking 128bits=16bytes)...\n");
+        #else
+    zlog(z, "   Hashing (Parallel SHA1, taking 128bits=16bytes)...\n");
+        #endif
+    metrics_begin(z, "hash");
+    t_start = omp_get_wtime();
+    // Pipelined: input blocks are read ahead and index blocks written behind while the team hashes the current one
+    // (in whole checksum leaves)
+    uint64_t blk = io_block_elems(z, sizeof(DiskEntry)) / TREE_LEAF * TREE_LEAF;
+    if (!blk) blk = TREE_LEAF;
+    IoReader in;
+    IoWriter out;
+    io_reader_start(&in, &art_input, 0, z->entry_count, blk, CHUNK_SIZE);
+    io_writer_start(z, &out, z->io_depth, blk * sizeof(DiskEntry));
+    const uint8_t* src;
+    uint64_t w0, wn;
+    RunScan scan = { 0, 0 };
+    RunSpans runs = { NULL, 0, 0 };
+    z->run_windows = 0;
+    while ((src = io_reader_next(&in, &w0, &wn))) {
+    DiskEntry* block = (DiskEntry*)io_writer_buffer(&out);
+    uint64_t left_out = (z->pipeline == PIPELINE_NUCLEAR) ? run_block(z, &scan, src, w0, wn, &runs) : 0;
+    z->run_windows += left_out;
+    uint64_t c0 = layout_count(z->layout, w0), c1 = layout_count(z->layout, w0 + wn);
+    // OMP Parallel Hashing
+    #pragma omp parallel for
+    for(uint64_t c=c0; c<c1; c++) {
+        uint64_t w = layout_window(z->layout, c), i = w - w0;
+        DiskEntry* e = &block[c - c0];
+        if (left_out && run_covers(&runs, w)) {
+            *e = (DiskEntry){ w, RUN_KEY, w };
+            continue;
         }
+        uint64_t hash_out[3]; // 2 for 16 bytes, 3 for 24
+        //uint8_t digest[SHA1_DIGEST_SIZE];
 
-        uint64_t group_start = i;
-        // Since we sorted by Hash+Offset, this is the absolute first occurrence
-        uint64_t master_offset = index[group_start].offset; 
+        //FNV1A_Pippip_128((char*)buffer + i, CHUNK_SIZE, 0, hash_out);
+        #ifdef eXdupe
+        //void FNV1A_Pippip_Yurii_OOO_128bit_AES_TriXZi_Mikayla_forte (const char *str, size_t wrdlen, uint32_t seed, void *output) {
+        FNV1A_Pippip_Yurii_OOO_128bit_AES_TriXZi_Mikayla_forte ((const char *) (src + i), CHUNK_SIZE, 0, hash_out);
+        #else
+        sha1_sum((src + i), CHUNK_SIZE, (uint8_t *)hash_out);
+        #endif
 
-        // Scan the group to find duplicates
-        uint64_t look = group_start + 1;
-        uint64_t local_dupes = 0;
-        
-        // Count first to reserve space atomically
-        uint64_t temp_look = look;
-        while (temp_look < entry_count && 
-               index[temp_look].h2 == index[group_start].h2 && 
-               index[temp_look].h1 == index[group_start].h1) {
-            local_dupes++;
-            temp_look++;
+        e->h1 = hash_out[0];
+        e->h2 = hash_out[1];
+        e->offset = w;
+    }
+    #pragma omp parallel
+    tree_leaves(z, src, w0, wn);
+    if (c1 > c0) io_writer_submit(&out, &art_index, (c1 - c0) * sizeof(DiskEntry), c0 * sizeof(DiskEntry));
+    zprogress(z, w0 + wn, z->entry_count);
+    }
+    io_queue_free(&in.q);
+    io_queue_free(&out.q);
+    free(runs.span);
+    zlog(z, "   Hashed in %.2fs\n", omp_get_wtime() - t_start);
+    if (z->run_windows) zlog(z, "   Low-entropy runs: %lu windows left out of the index (%.1f%%)\n", z->run_windows, 100.0 * z->run_windows / z->index_entries);
+    artifact_sync(&art_index);
+    metrics_end(z);
+    manifest_commit(z, &manifest, STAGE_HASHED);
+    }
+
+    // 2. PARALLEL DISK SORT
+    if (resume_stage >= STAGE_SORTED) {
+    zlog(z, "2. Sorting Disk Index... skipped (resumed)\n");
+    } else if (z->shards) {
+    // Sharded: sort (or hash-join) each shard on its own (in RAM when it fits) and gather its duplicates right away, then delete it
+    bool join = (z->join == JOIN_HASH);
+    JoinTable jt = { NULL, 0, 0 };
+    zlog(z, "2. %s Shards & Gathering Duplicates (one shard at a time, %.2f GB RAM budget)...\n", join ? "Hash-Joining" : "Sorting", z->shard_ram / 1024.0 / 1024.0 / 1024.0);
+    t_start = omp_get_wtime();
+    if (!artifact_open(z, &art_updates, &z->tmp_updates, "zirka_updates.tmp", z->entry_count * sizeof(RankUpdate), manifest.shards_done == 0)) zfail(z, "zirka_updates.tmp");
+    if (manifest.shards_done == 0) { z->update_count = 0; buckets_init(z, z->shard_ram); }
+    artifact_access(&art_updates, ACCESS_SEQ_WRITE);
+    z->sorted_so_far = manifest.entries_done;
+    if (join) join_init(z, &jt, &shards, manifest.shards_done);
+    metrics_begin(z, join ? "join_gather_shards" : "sort_gather_shards");
+    progress_start(z, join ? "   Join Progress = %.1f%%\r" : "   Sort Progress = %.1f%%\r", &z->sorted_so_far, z->index_entries - z->run_windows);
+    for (int sh = manifest.shards_done; sh < z->shards; sh++) {
+        uint64_t count;
+        bool in_ram;
+        DiskEntry* data = shard_load(&shards, sh, &count, &in_ram);
+        z->gov_sort = !in_ram;
+        if (join) join_shard(z, &jt, data, count, &art_updates);
+        else {
+        samplesort_index(z, data, count);
+        // A shard too big for RAM is mapped: walk it in windows like the monolithic index
+        GovStream gov_shard = { in_ram ? NULL : data, count * sizeof(DiskEntry), 0 };
+        uint64_t win = governor_window(z, count, sizeof(DiskEntry) + sizeof(RankUpdate));
+        for (uint64_t w0 = 0; w0 < count; w0 += win) {
+            uint64_t w1 = (w0 + win < count) ? w0 + win : count;
+            gather_updates(data, w0, w1, count, &art_updates);
+            governor_advance(z, &gov_shard, w1 * sizeof(DiskEntry), win * sizeof(DiskEntry));
+        }
         }
+        artifact_sync(&art_updates);
+        manifest.shards_done = sh + 1;
+        manifest.entries_done += count;
+        manifest_commit(z, &manifest, STAGE_HASHED);
+        shard_release(&shards, sh, data, in_ram); // Deleted once the manifest no longer needs it
+    }
+    shards_close(&shards);
+    free(jt.slot);
+    progress_stop(z);
+    metrics_end(z);
+            zlog(z, join ? "   Join Progress = %.1f%%\n" : "   Sort Progress = %.1f%%\n", 100.0);
+    zlog(z, "   %s & gathered in %.2fs\n", join ? "Joined" : "Sorted", omp_get_wtime() - t_start);
+    if (!join) zlog(z, "   Sort jobs run: %d\n", z->total_tasks);
+    manifest_commit(z, &manifest, STAGE_GATHERED);
+    resume_stage = STAGE_GATHERED; // Stage 3 continues from the gathered updates log
+    } else {
+    zlog(z, "2. Sorting Disk Index (Parallel Samplesort)...\n");
+    artifact_access(&art_index, ACCESS_RANDOM); // Sorted in place through the mapping
+    index = (DiskEntry*)art_index.map;
+    t_start = omp_get_wtime();
+    z->sorted_so_far = 0;
+    z->gov_sort = true;
+    metrics_begin(z, "sort");
+    progress_start(z, "   Sort Progress = %.1f%%\r", &z->sorted_so_far, z->index_entries);
+    samplesort_index(z, index, z->index_entries);
+    progress_stop(z);
+    metrics_end(z);
+            zlog(z, "   Sort Progress = %.1f%%\n", 100.0);
+    zlog(z, "   Sorted in %.2fs\n", omp_get_wtime() - t_start);
+    //printf("   Max threads executed simultaneously: %d\n", g_max_threads_used);
+    zlog(z, "   Sort jobs run: %d\n", z->total_tasks);
+    artifact_sync(&art_index);
+    manifest_commit(z, &manifest, STAGE_SORTED);
+    }
 
-        if (local_dupes > 0) {
-            uint64_t my_write_idx;
-            #pragma omp atomic capture
-            { my_write_idx = update_count; update_count += local_dupes; }
-
-            // Write the updates: "At position [duplicate], point to [master]"
-            while (look < entry_count && 
-                   index[look].h2 == index[group_start].h2 && 
-                   index[look].h1 == index[group_start].h1) {
-                
-                updates[my_write_idx].pos = index[look].offset; 
-                updates[my_write_idx].target = master_offset;   
-                
-                my_write_idx++;
-                look++;
+    // --- STAGE 3 (rankmap, first, bs): THE SORTED INDEX LINKED IN PLACE ---
+    // The sort's offset tie-breaker puts every group of identical hashes in offset order, its first occurrence in front
+    MatchLookup lookup = { z->pipeline, index, z->entry_count, NULL };
+    if (z->pipeline != PIPELINE_NUCLEAR) {
+    metrics_begin(z, "rank_map");
+    if (z->pipeline == PIPELINE_BS) {
+    zlog(z, "3. Linking duplicates to their first occurrence (Binary Search Mode, no rank map)...\n");
+    } else {
+    zlog(z, "3. Building Rank Map (8x Filesize using MMAP, %s)...\n", z->pipeline == PIPELINE_FIRST ? "first occurrences" : "index positions");
+    artifact_open(z, &art_rank, &z->tmp_rank, "zirka_rank.tmp", z->entry_count * sizeof(uint64_t), true);
+    artifact_access(&art_rank, ACCESS_RANDOM);
+    lookup.rank = (const uint64_t*)art_rank.map;
+    // OPTIMIZATION: Use Huge Pages if available to reduce TLB misses during random writes
+    madvise(art_rank.map, z->entry_count * sizeof(uint64_t), MADV_HUGEPAGE);
+    }
+    uint64_t* rank = (uint64_t*)art_rank.map;
+    uint64_t linked = 0;
+    if (z->pipeline == PIPELINE_RANKMAP) {
+        #pragma omp parallel for reduction(+:linked)
+        for(uint64_t i=0; i<z->entry_count; i++) {
+            rank[index[i].offset] = (uint64_t)i;
+            if (i > 0 && index[i].h2 == index[i-1].h2 && index[i].h1 == index[i-1].h1) linked++;
+        }
+    } else {
+        if (rank) {
+        #pragma omp parallel for
+        for(uint64_t i = 0; i < z->entry_count; i++) rank[i] = NULL_RANK;
+        }
+        // Each group is linked by its first entry (the others only compare hashes, which nobody writes)
+        #pragma omp parallel for schedule(dynamic, 4096) reduction(+:linked)
+        for (uint64_t i = 0; i < z->entry_count; i++) {
+            if (i > 0 && index[i].h2 == index[i-1].h2 && index[i].h1 == index[i-1].h1) continue;
+            uint64_t master_offset = index[i].offset;
+            for (uint64_t j = i + 1; j < z->entry_count && index[j].h2 == index[i].h2 && index[j].h1 == index[i].h1; j++) {
+                if (rank) rank[index[j].offset] = master_offset;
+                else index[j].offset = master_offset; // bs: whichever entry the search lands on answers with the master
+                linked++;
             }
         }
     }
-    printf("   [Nuclear] Found %lu duplicates to link.\n", update_count);
+    z->update_count = linked;
+    zlog(z, "   %lu duplicate windows linked.\n", linked);
+    metrics_end(z);
+    if (z->pipeline == PIPELINE_FIRST) { // The rank map is all Stage 4 needs
+    artifact_close(&art_index);
+    remove_temp_artifact(&z->tmp_index, "zirka_index.tmp");
+    }
+    } else {
+    // --- STAGE 3: BUILD RANK MAP (NUCLEAR OPTION) ---
+    if (resume_stage >= STAGE_RANKED) {
+    zlog(z, "3. Building Rank Map... skipped (resumed)\n");
+    if (!artifact_open(z, &art_rank, &z->tmp_rank, "zirka_rank.tmp", filesize * sizeof(uint64_t), false)) zfail(z, "zirka_rank.tmp");
+    } else {
+    zlog(z, "3. Building Rank Map (8x Filesize, Nuclear Mode: Sequential I/O)...\n");
+    
+    // --- NUCLEAR PHASE 1: GATHER UPDATES (Sequential Write) ---
+    // Max possible updates = entry_count (worst case).
+    if (resume_stage >= STAGE_GATHERED) {
+    zlog(z, "   [Nuclear] Gathering duplicates... %s (%lu duplicates)\n", z->shards ? "done per shard" : "skipped (resumed)", z->update_count);
+    if (!art_updates.td && !artifact_open(z, &art_updates, &z->tmp_updates, "zirka_updates.tmp", z->entry_count * sizeof(RankUpdate), false)) zfail(z, "zirka_updates.tmp");
+    } else {
+    zlog(z, "   [Nuclear] Gathering duplicates (16x Filesize, index scanned in %lu MB blocks)...\n", z->io_block >> 20);
+    
+    // Create a temporary buffer for updates. 
+    artifact_open(z, &art_updates, &z->tmp_updates, "zirka_updates.tmp", z->entry_count * sizeof(RankUpdate), true);
+    artifact_access(&art_updates, ACCESS_SEQ_WRITE);
+    artifact_access(&art_index, ACCESS_SEQ_SCAN);
+    index = NULL;
+    z->update_count = 0;
+    buckets_init(z, z->shard_ram);
+
+    metrics_begin(z, "nuclear_gather");
+    // Whole blocks of the sorted index, read ahead while the team gathers the current one.
+    // The hash group cut by the end of a block is carried over (copied) and gathered once the next blocks complete it.
+    IoReader rd;
+    io_reader_start(&rd, &art_index, 0, z->index_entries * sizeof(DiskEntry), io_block_elems(z, sizeof(DiskEntry)) * sizeof(DiskEntry), 0);
+    DiskEntry* carry = NULL;
+    uint64_t carry_n = 0, carry_cap = 0;
+    const uint8_t* src;
+    uint64_t off, bytes;
+    while ((src = io_reader_next(&rd, &off, &bytes))) {
+        const DiskEntry* block = (const DiskEntry*)src;
+        uint64_t n = bytes / sizeof(DiskEntry), from = 0, end = n;
+        bool last = off + bytes == z->index_entries * sizeof(DiskEntry);
+        if (carry_n) {
+            while (from < n && block[from].h2 == carry[0].h2 && block[from].h1 == carry[0].h1) from++;
+        }
+        if (!last) { // Groups led before 'end' are complete in this block
+            while (end > from && block[end - 1].h2 == block[n - 1].h2 && block[end - 1].h1 == block[n - 1].h1) end--;
+        }
+        // Carry += block[0, from) (the rest of the carried group) and block[end, n) (the group cut by this block)
+        uint64_t grow = from + (n - end);
+        if (carry_n + grow > carry_cap) {
+            carry_cap = (carry_n + grow) * 2;
+            carry = realloc(carry, carry_cap * sizeof(DiskEntry));
+            if (!carry) zfail(z, "gather carry");
+        }
+        memcpy(carry + carry_n, block, from * sizeof(DiskEntry));
+        carry_n += from;
+        if (from == n && !last) continue; // The carried group runs on
+        if (carry_n) gather_updates(carry, 0, 1, carry_n, &art_updates);
+        carry_n = 0;
+        gather_updates(block, from, end, n, &art_updates);
+        memcpy(carry, block + end, (n - end) * sizeof(DiskEntry));
+        carry_n = n - end;
+        zprogress(z, off + bytes, z->index_entries * sizeof(DiskEntry));
+    }
+    io_queue_free(&rd.q);
+    free(carry);
+    zlog(z, "   [Nuclear] Found %lu duplicates to link (%lu range buckets).\n", z->update_count, z->bucket_count);
+    artifact_sync(&art_updates);
+    metrics_end(z);
+    manifest_commit(z, &manifest, STAGE_GATHERED);
+    }
 
     // --- NUCLEAR PHASE 2: SORT UPDATES (Transforms Random I/O to Sequential) ---
-    if (update_count > 0) {
-        printf("   [Nuclear] Sorting updates by file position...\n");
-        SortedSoFar = 0;
-        #pragma omp parallel
-        {
-            #pragma omp single nowait
-            omp_quicksort_updates(updates, 0, update_count - 1);
+    // Bucket by bucket (each one covers its own position range): read its region, counting sort in RAM, write it back
+    artifact_access(&art_updates, ACCESS_SEQ_SCAN);
+    if (z->update_count > 0 && resume_stage < STAGE_UPDATES_SORTED) {
+        zlog(z, "   [Nuclear] Sorting updates by file position (%lu range buckets, counting sort in RAM)...\n", z->bucket_count);
+        uint64_t first = (resume_stage == STAGE_GATHERED) ? manifest.buckets_done : 0;
+        z->sorted_so_far = 0;
+        if (first == 0) z->pruned = z->rejected = 0;
+        for (uint64_t b = 0; b < first; b++) z->sorted_so_far += z->bucket_fill[b];
+        metrics_begin(z, "nuclear_sort");
+        progress_start(z, "   Sort Progress = %.1f%%\r", &z->sorted_so_far, z->update_count);
+        // Runs and slots are sized from the longest run, not from the span: a sparse bucket is sorted a pane at a time
+        uint64_t span = 1ULL << z->bucket_shift, max_fill = buckets_max_fill(z);
+        int pane_shift = bucket_pane_shift(z);
+        if (max_fill * sizeof(RankUpdate) + (sizeof(uint64_t) << pane_shift) >= span * sizeof(uint64_t)) pane_shift = z->bucket_shift;
+        uint64_t pane = 1ULL << pane_shift, panes = span >> pane_shift;
+        uint64_t cap = max_fill + (z->prune ? span / CHUNK_SIZE + 2 * panes : 0); // The replay adds at most a resync point per chunk
+        if (cap > span) cap = span;
+        RankUpdate* grouped = NULL;
+        uint64_t* pane_fill = NULL;
+        if (panes > 1 && (!(grouped = malloc(max_fill * sizeof(RankUpdate))) || !(pane_fill = malloc(2 * panes * sizeof(uint64_t))))) zfail(z, "bucket panes");
+        uint64_t slots = CHUNK_SIZE + pane; // The pruning parse looks CHUNK_SIZE positions back
+        uint64_t* slot = malloc(slots * sizeof(uint64_t));
+        if (slot) numa_touch(z, slot, slots * sizeof(uint64_t));
+        if (!slot) zfail(z, "bucket slots");
+        for (uint64_t i = 0; i < CHUNK_SIZE; i++) slot[i] = NULL_RANK;
+        ParseReplay replay = { 0 };
+        if (first > 0) { // The replay picks up where the manifest left it (the rank map before it is not known)
+            replay.next = manifest.parse_next;
+            replay.lit_start = manifest.parse_lit;
+            replay.tag_pos = manifest.parse_tag[0];
+            replay.tag_src = manifest.parse_tag[1];
+            replay.tag_end = manifest.parse_tag[2];
+        }
+        if (z->prune && z->align_refs && !(replay.align = calloc(ALIGN_SLOTS, sizeof(AlignSlot)))) zfail(z, "malloc");
+        if (z->prune && !(replay.kept = malloc(CHUNK_SIZE * sizeof(uint64_t)))) zfail(z, "malloc");
+        if (replay.kept) memset(replay.kept, 0xFF, CHUNK_SIZE * sizeof(uint64_t)); // NULL_RANK: none kept yet
+        // Three runs in RAM: bucket b+1 is read while b is sorted and b-1 is written back
+        IoQueue bq;
+        io_queue_init(z, &bq, BUCKET_RUNS, cap * sizeof(RankUpdate));
+        if (first < z->bucket_count) io_queue_submit(&bq, first % BUCKET_RUNS, &art_updates, z->bucket_fill[first] * sizeof(RankUpdate), bucket_run(z, first), false);
+        for (uint64_t b = first; b < z->bucket_count; b++) {
+            if (b + 1 < z->bucket_count) {
+                io_queue_wait(&bq, (b + 1) % BUCKET_RUNS);
+                io_queue_submit(&bq, (b + 1) % BUCKET_RUNS, &art_updates, z->bucket_fill[b + 1] * sizeof(RankUpdate), bucket_run(z, b + 1), false);
+            }
+            RankUpdate* run = (RankUpdate*)io_queue_wait(&bq, b % BUCKET_RUNS);
+            uint64_t gathered = z->bucket_fill[b], base = b << z->bucket_shift, k = 0;
+            uint64_t made = replay.made, rejected = z->rejected;
+            const RankUpdate* in = run;
+            if (panes > 1) {
+                bucket_panes(run, gathered, base, pane_shift, panes, grouped, pane_fill, pane_fill + panes);
+                in = grouped;
+            }
+            for (uint64_t p = 0, at = 0; p < panes && base + (p << pane_shift) < z->entry_count; p++) {
+                uint64_t lo = base + (p << pane_shift), hi = (z->entry_count - lo < pane) ? z->entry_count : lo + pane;
+                uint64_t n = (panes > 1) ? pane_fill[p] : gathered;
+                uint64_t sorted = bucket_sort(z, in + at, n, lo, hi - lo, slot + CHUNK_SIZE, run + k);
+                k = z->prune ? parse_prune(z, &replay, run, k, base, lo, hi, slot + CHUNK_SIZE) : k + sorted;
+                at += n;
+            }
+            if (z->prune) {
+                z->pruned += gathered - (k - (replay.made - made)) - (z->rejected - rejected); // The resync points made up are not in the log
+                if (z->mapped) governor_release(z, (void*)z->buffer, 0, (base + span < z->entry_count) ? base + span : z->entry_count);
+            }
+            z->bucket_fill[b] = k;
+            io_queue_submit(&bq, b % BUCKET_RUNS, &art_updates, z->bucket_fill[b] * sizeof(RankUpdate), bucket_run(z, b), true);
+            #pragma omp atomic
+            z->sorted_so_far += gathered;
+            if ((b + 1) % BUCKET_COMMIT_EVERY == 0 && b + 1 < z->bucket_count) {
+                for (int s = 0; s < BUCKET_RUNS; s++) io_queue_wait(&bq, s);
+                artifact_sync(&art_updates);
+                manifest.buckets_done = b + 1;
+                manifest.parse_next = replay.next;
+                manifest.parse_lit = replay.lit_start;
+                manifest.parse_tag[0] = replay.tag_pos;
+                manifest.parse_tag[1] = replay.tag_src;
+                manifest.parse_tag[2] = replay.tag_end;
+                manifest_commit(z, &manifest, STAGE_GATHERED);
+            }
         }
-            printf ("   Sort Progress = %.1f%%\n", 100.0);
+        io_queue_free(&bq);
+        free(slot);
+        free(grouped);
+        free(pane_fill);
+        free(replay.align);
+        free(replay.kept);
+        progress_stop(z);
+            zlog(z, "   Sort Progress = %.1f%%\n", 100.0);
+        if (z->prune) {
+            uint64_t kept = 0;
+            for (uint64_t b = 0; b < z->bucket_count; b++) kept += z->bucket_fill[b];
+            zlog(z, "   [Nuclear] Parse-aware pruning: %lu updates written back for %lu tags replayed (%lu resync points).\n", kept, replay.tags, replay.resyncs);
+        }
+        artifact_sync(&art_updates);
+        metrics_end(z);
+        manifest_commit(z, &manifest, STAGE_UPDATES_SORTED);
+    }
 
-        // --- NUCLEAR PHASE 3: APPLY UPDATES (Monotonic Write) ---
-        printf("   [Nuclear] Applying updates to Rank Map...\n");
+    // 1. Create the Rank Map (initially empty)
+    metrics_begin(z, "nuclear_apply");
+    artifact_open(z, &art_rank, &z->tmp_rank, "zirka_rank.tmp", filesize * sizeof(uint64_t), true);
+    artifact_access(&art_rank, ACCESS_SEQ_WRITE);
+
+    // --- NUCLEAR PHASE 3: APPLY UPDATES (Monotonic Write) ---
+    // One pane at a time: its positions of the rank map are initialized to NULL in RAM, the part of its bucket's run that falls
+    // in it is applied, the window is written. The next run is read while this one is applied, the previous window is still being written.
+    if (z->update_count > 0) zlog(z, "   [Nuclear] Applying and verifying updates to Rank Map (masters compared in offset order)...\n");
+    uint64_t span = 1ULL << z->bucket_shift, pane = 1ULL << bucket_pane_shift(z);
+    uint64_t linked = 0, rejected_unapplied = z->rejected; // Those the pruning parse already turned down
+    z->updates_kept = 0;
+    VerifySegment* seg = NULL;
+    uint64_t seg_cap = 0;
+    IoQueue uq;
+    IoWriter rw;
+    io_queue_init(z, &uq, 2, buckets_max_fill(z) * sizeof(RankUpdate));
+    io_writer_start(z, &rw, 2, pane * sizeof(uint64_t));
+    if (z->bucket_count) io_queue_submit(&uq, 0, &art_updates, z->bucket_fill[0] * sizeof(RankUpdate), bucket_run(z, 0), false);
+    const RankUpdate* run = NULL;
+    uint64_t at = 0, fill = 0;
+    for (uint64_t w0 = 0; w0 < filesize; w0 += pane) {
+        uint64_t w1 = (w0 + pane < filesize) ? w0 + pane : filesize;
+        uint64_t b = w0 >> z->bucket_shift;
+        if ((w0 & (span - 1)) == 0) { // The first pane of bucket b
+            if (b + 1 < z->bucket_count) {
+                io_queue_wait(&uq, (b + 1) % 2);
+                io_queue_submit(&uq, (b + 1) % 2, &art_updates, z->bucket_fill[b + 1] * sizeof(RankUpdate), bucket_run(z, b + 1), false);
+            }
+            at = 0;
+            fill = (b < z->bucket_count) ? z->bucket_fill[b] : 0;
+            if (fill) run = (const RankUpdate*)io_queue_wait(&uq, b % 2);
+        }
+        uint64_t* window = (uint64_t*)io_writer_buffer(&rw);
         #pragma omp parallel for schedule(static)
-        for (uint64_t i = 0; i < update_count; i++) {
-            rank[updates[i].pos] = updates[i].target;
+        for(uint64_t i = 0; i < w1 - w0; i++) window[i] = NULL_RANK;
+        uint64_t n = 0;
+        while (at + n < fill && run[at + n].pos < w1) n++;
+        if (n) {
+            #pragma omp parallel for schedule(static)
+            for (uint64_t i = at; i < at + n; i++) {
+                window[run[i].pos - w0] = run[i].target;
+            }
+            if (n > seg_cap) {
+                seg_cap = n;
+                free(seg);
+                seg = malloc(2 * seg_cap * sizeof(VerifySegment));
+                if (!seg) zfail(z, "verify segments");
+            }
+            z->updates_kept += n;
+            uint64_t rejected = verify_run(z, run + at, n, window, w0, seg);
+            z->rejected += rejected;
+            linked += n - rejected;
+            at += n;
         }
+        // The masters are anywhere below the window: under --rss-limit drop what the checks of the bucket faulted in
+        if (z->mapped && fill && ((w1 & (span - 1)) == 0 || w1 == filesize)) governor_release(z, (void*)buffer, 0, w1);
+        io_writer_submit(&rw, &art_rank, (w1 - w0) * sizeof(uint64_t), w0 * sizeof(uint64_t));
+        zprogress(z, w1, filesize);
     }
+    io_queue_free(&uq);
+    io_queue_free(&rw.q);
+    free(seg);
+    if (z->prune && z->update_count > 0) zlog(z, "   [Nuclear] Pruned: %lu updates off the parse's path dropped unverified (%lu on it rejected by the replay's check).\n", z->pruned, rejected_unapplied);
+    if (z->update_count > 0) zlog(z, "   [Nuclear] Verified: %lu duplicates linked, %lu rejected (overlapping sources or hash collisions).\n", linked, z->rejected - rejected_unapplied);
+    artifact_sync(&art_rank);
+    metrics_end(z);
+    manifest_commit(z, &manifest, STAGE_RANKED);
 
     // Clean up temporary updates file
-    munmap(updates, entry_count * sizeof(RankUpdate));
-    unlink("zirka_updates.tmp"); // Uncomment to delete temp file
+    artifact_close(&art_updates);
+    remove_temp_artifact(&z->tmp_updates, "zirka_updates.tmp");
 
     // Free the Index (We don't need it anymore for Encoding!)
-    munmap(index, entry_count * sizeof(DiskEntry));
-    unlink("zirka_index.tmp");
+    if (art_index.td) {
+    artifact_close(&art_index);
+    remove_temp_artifact(&z->tmp_index, "zirka_index.tmp");
+    }
+    }
+    }
 
     // --- STAGE 4: ENCODER (CORRECT "FIRST OCCURRENCE" LOGIC) ---
-    printf("4. Encoding (Direct Rank Lookup)...\n");
-    char out_name[512]; snprintf(out_name, 512, "%s.zirka", argv[1]);
-    FILE* fout = fopen(out_name, "wb");
+    zlog(z, "4. Encoding (Direct Rank Lookup)...\n");
+    metrics_begin(z, "encode");
+    open_outputs(z);
+    OutStream out;
+    out_open(z, &out, z->fout, z->lz); // --lz: frames are compressed on all the job's threads while the loop runs
+    SeekIndex seek;
+    seek_open(z, &seek, z->fidx);
     uint64_t pos = 0;
-    uint64_t prcnt = 0;
-    uint32_t chk[4];
+    uint64_t lit_start = 0; // Literals [lit_start, pos) are written when the next tag (or the end) comes
+    uint64_t next_progress = 1*1024*1024;
+    uint64_t tags = 0, long_tags = 0;
+    // The input moves forward with 'pos'; matches reach back into it, dropped pages simply fault back in
+    // (a caller's buffer is not ours to drop: it may be anonymous memory)
+    GovStream gov_in = { z->mapped ? (void*)buffer : NULL, filesize, 0 };
+    uint64_t win = governor_window(z, filesize, 1);
+    uint64_t gov_mark = 0;
+    // Nuclear's rank map is read ahead of 'pos', --io-depth blocks in flight (lookups only move forward)
+    IoReader rank_rd;
+    const uint64_t* rank = NULL;
+    uint64_t rank_lo = 0, rank_hi = 0;
+    if (z->pipeline == PIPELINE_NUCLEAR) {
+    artifact_access(&art_rank, ACCESS_SEQ_SCAN);
+    io_reader_start(&rank_rd, &art_rank, 0, filesize * sizeof(uint64_t), z->io_block, 0);
+    }
+    RunScan runs = { 0, 0 }; // Finds the windows Stage 1 left out again (see LOW-ENTROPY RUNS)
+    AlignSlot* align = z->align_refs ? calloc(ALIGN_SLOTS, sizeof(AlignSlot)) : NULL;
+    uint64_t aligned = 0;
+    if (z->align_refs && !align) zfail(z, "malloc");
     
     while(pos < filesize) {
+        if (pos >= gov_mark) {
+            governor_advance(z, &gov_in, pos > win ? pos - win : 0, 2 * win);
+            gov_mark = pos + win;
+        }
+        uint64_t match_off;
+        if (z->pipeline == PIPELINE_NUCLEAR) {
+        while (pos >= rank_hi) {
+            uint64_t off, bytes;
+            rank = (const uint64_t*)io_reader_next(&rank_rd, &off, &bytes);
+            rank_lo = off / sizeof(uint64_t);
+            rank_hi = (off + bytes) / sizeof(uint64_t);
+        }
         // Direct Lookup: rank[pos] contains the OFFSET of the duplicate
-        uint64_t match_off = rank[pos];
+        match_off = rank[pos - rank_lo];
+        if (match_off == NULL_RANK) match_off = run_source(z, &runs, buffer, pos, rank, rank_lo, NULL);
+        } else match_off = lookup_match(&lookup, buffer, pos);
 
+        // Every hit is a backward reference with verified content (see BATCHED VERIFICATION, LOW-ENTROPY RUNS)
         if (match_off != NULL_RANK) {
-            // Safety: It must be a backward reference
-            if (match_off + CHUNK_SIZE <= pos) {
-                // Verify content (Paranoia check)
-                if (memcmp(buffer + pos, buffer + match_off, CHUNK_SIZE) == 0) {
-                    fputc(MAGIC_BYTE, fout);
-                    fwrite(&match_off, 8, 1, fout);
-                    //uint32_t chk = calc_fnv_off(match_off);
-                    FNV1A_Pippip_Yurii_OOO_128bit_AES_TriXZi_Mikayla_forte((const char *)&match_off, 8, 0, chk);
-
-                    fwrite(&chk, 4, 1, fout);
-                    pos += CHUNK_SIZE;
-                    
-                    // Progress Update
-                    prcnt += CHUNK_SIZE;
-                    if (prcnt >= 1*1024*1024) { 
-                        printf("\r   Encoded: %.1f%%", (double)pos/filesize*100.0); 
-                        prcnt = 0; 
-                    }
-                    continue;
-                }
-            }
+            if (align) match_off = align_source(align, pos, match_off, &aligned);
+            uint64_t len = match_extend(z, buffer, &pos, &match_off, lit_start);
+            uint8_t tag[LONG_TAG_SIZE];
+            uint64_t tag_bytes;
+            len = build_tag(match_off, len, tag, &tag_bytes);
+            emit_literals(&out, &seek, buffer, lit_start, pos, tag, tag_bytes);
+            seek_mark(&seek, pos, pos + 1, out.raw_bytes);
+            out_write(&out, tag, tag_bytes);
+            tags++;
+            if (len > CHUNK_SIZE) long_tags++;
+            pos += len;
+            lit_start = pos;
+        } else {
+            // Literal
+            pos++;
         }
-        
-        // Literal
-        fputc(buffer[pos], fout);
-        pos++;
-        
-        // Progress Update (for literals)
-        prcnt++;
-        if (prcnt >= 1*1024*1024) { 
-            printf("\r   Encoded: %.1f%%", (double)pos/filesize*100.0); 
-            prcnt = 0; 
+
+        // Progress Update
+        if (pos >= next_progress) {
+            zlog(z, "\r   Encoded: %.1f%%", (double)pos/filesize*100.0); 
+            zprogress(z, pos, filesize);
+            next_progress = pos + 1*1024*1024;
         }
     }
-
-    printf("\r   Encoded: %.1f%%\n", 100.0); 
-    printf("Done.\n");
-    fclose(fout);
+    emit_literals(&out, &seek, buffer, lit_start, pos, NULL, 0);
+    seek_close(&seek, filesize, out.raw_bytes);
+
+    zlog(z, "\r   Encoded: %.1f%%\n", 100.0); 
+    zlog(z, "   Tags: %lu (%lu extended past %d bytes)\n", tags, long_tags, CHUNK_SIZE);
+    if (out.escapes) zlog(z, "   [Escape] %lu literal bytes would have read as tags and were escaped.\n", out.escapes);
+    if (align) zlog(z, "   [Align] %lu tags moved to a source a whole number of blocks back.\n", aligned);
+    free(align);
+    out_close(&out);
+    if (z->extend) write_checksum(z, z->fout);
+    z->stats.input_bytes = filesize;
+    z->stats.duplicates = z->update_count - z->rejected + z->run_windows;
+    z->stats.tags = tags;
+    z->stats.long_tags = long_tags;
+    if (z->rss_limit) zlog(z, "   [Governor] %.2f GB of mapped pages released during the run.\n", z->gov_released / 1024.0 / 1024.0 / 1024.0);
+    zlog(z, "Done.\n");
+    metrics_end(z);
     //free(buffer);
-    munmap(buffer, filesize);
+    artifact_close(&art_input); // Unmaps the input, unless it is the caller's buffer
+
+    if (z->pipeline == PIPELINE_NUCLEAR) io_queue_free(&rank_rd.q);
+    // The manifest goes first: a kill from here on leaves stray temp files, never a manifest vouching for deleted ones
+    char manifest_file[1024];
+    manifest_path(z, manifest_file, sizeof(manifest_file));
+    unlink(manifest_file);
+    if (art_rank.td) {
+    artifact_close(&art_rank);
+    remove_temp_artifact(&z->tmp_rank, "zirka_rank.tmp");
+    }
+    if (art_index.td) { // rankmap and bs looked matches up in it
+    artifact_close(&art_index);
+    remove_temp_artifact(&z->tmp_index, "zirka_index.tmp");
+    }
+    artifact_report(z);
+    metrics_write(z);
+    return ZIRKA_OK;
+}
 
-    munmap(rank, filesize * sizeof(uint64_t));
-    unlink("zirka_rank.tmp");
-    return 0;
-#endif
+// --- LIBRARY API (libzirka.h) ---
+static unsigned g_encoder_serial = 0; // Makes the generated temp prefixes unique within the process
+
+// Called by zfail() on the job's thread before it unwinds: whatever the job still has open is closed (its frames are
+// still alive), the I/O in flight is drained first. The outputs are closed by the zirka_encode_*() call.
+static void encoder_abort(ZirkaEncoder* z) {
+    char path[1024];
+    progress_stop(z);
+    for (int i = 0; i < MAX_QUEUES; i++) if (z->queues[i]) io_queue_free(z->queues[i]);
+    if (z->out) out_stop(z->out);
+    if (z->shard_set) {
+        ShardSet* set = z->shard_set;
+        for (int s = 0; z->own_prefix && s < set->count; s++) if (set->fds[s] != -1) { shard_path(z, path, s); unlink(path); }
+        shards_close(set);
+    }
+    for (int i = 0; i < z->artifact_count; i++) {
+        Artifact* a = z->artifacts[i];
+        artifact_close(a);
+        if (z->own_prefix && a->td->prefix == z->tmp_prefix) remove_temp_artifact(a->td, a->name);
+    }
+    z->artifact_count = 0;
+    if (z->own_prefix) { manifest_path(z, path, sizeof(path)); unlink(path); }
+}
 
-#ifdef BS
-    // 3. ENCODE (Using Binary Search instead of Rank Map)
-    printf("3. Encoding (Binary Search Mode)...\n");
-    char out_name[512]; snprintf(out_name, 512, "%s.zirka", argv[1]);
-    FILE* fout = fopen(out_name, "wb");
+// The temp directories: "." unless the pool or the per-artifact lists say otherwise (see plan_temp_layout).
+// Resolved on the first job, from fresh copies each time a previous attempt failed halfway.
+static void encoder_layout(ZirkaEncoder* z) {
+    TempDirs here = { { "." }, 1, z->tmp_prefix };
+    z->tmp_index = z->tmp_updates = z->tmp_rank = here;
+    for (int i = 0; i < 4; i++) {
+        free(z->tmp_parsed[i]);
+        z->tmp_parsed[i] = z->tmp_lists[i] ? strdup(z->tmp_lists[i]) : NULL;
+        if (z->tmp_lists[i] && !z->tmp_parsed[i]) zfail(z, "temp directories");
+    }
+    // The pool is planned first, explicit per-artifact directories override it
+    if (z->tmp_parsed[0]) plan_temp_layout(z, z->tmp_parsed[0]);
+    if (z->tmp_parsed[1]) parse_tmp_dirs(&z->tmp_index, z->tmp_parsed[1]);
+    if (z->tmp_parsed[2]) parse_tmp_dirs(&z->tmp_updates, z->tmp_parsed[2]);
+    if (z->tmp_parsed[3]) parse_tmp_dirs(&z->tmp_rank, z->tmp_parsed[3]);
+    z->tmp_index.prefix = z->tmp_updates.prefix = z->tmp_rank.prefix = z->tmp_prefix;
+    z->layout_done = true;
+}
 
+// Runs one job on the calling thread with the encoder's thread count; a zfail() lands back here
+static int encode_guarded(ZirkaEncoder* z) {
+    z->owner = pthread_self();
+    z->failing = false;
+    z->error[0] = 0;
+    memset(&z->stats, 0, sizeof(z->stats));
+    z->max_threads_used = z->total_tasks = 0;
+    z->sorted_so_far = 0;
+    z->entry_count = z->update_count = z->rejected = z->updates_kept = z->pruned = 0;
+    z->shards = z->shards_requested;
+    z->pipeline = z->pipeline_requested;
+    z->gov_released = 0;
+    z->gov_sort = false;
+    z->artifact_count = 0;
+    memset(z->queues, 0, sizeof(z->queues));
+    z->shard_set = NULL;
+    z->out = NULL;
+    z->stage_name = NULL;
+    z->mapped = false;
+    int saved_threads = omp_get_max_threads();
+    int rc = ZIRKA_ERROR;
+    if (setjmp(z->fail) == 0) {
+        z->armed = true;
+        if (!z->layout_done) encoder_layout(z);
+        omp_set_num_threads(z->threads); // Only for this thread's parallel regions: other jobs keep their own count
+        rc = encode_job(z);
+    }
+    z->armed = false;
+    numa_unbind(z);
+    omp_set_num_threads(saved_threads);
+    z->artifact_count = 0;
+    return rc;
+}
 
-// Make all duplicates to point to the first of them [
-    uint64_t prcnt = 0;
-    // 4.1 Initialize Rank Map to NULL
+// A job refused before it starts (input not readable, outputs not creatable)
+static int encoder_refuse(ZirkaEncoder* z, const char* what) {
+    snprintf(z->error, sizeof(z->error), "%s: %s", what, strerror(errno));
+    return ZIRKA_ERROR;
+}
 
-    // 4.2 Fill Rank Map based on "First Occurrence"
-    for (uint64_t i = 0; i < entry_count; i++) {
-        uint64_t group_start = i;
+// Closes the outputs of a job; a failed final write fails a job that had succeeded
+static int encoder_finish(ZirkaEncoder* z, int rc) {
+    FILE* f[2] = { z->fidx, z->fout };
+    for (int i = 0; i < 2; i++) {
+        if (f[i] && fclose(f[i]) != 0 && rc == ZIRKA_OK) rc = encoder_refuse(z, "archive close");
+    }
+    z->fidx = z->fout = NULL;
+    z->buffer = NULL;
+    z->mapped = false;
+    z->in_fd = -1;
+    z->out_dir[0] = 0;
+    z->out_path[0] = 0;
+    return rc;
+}
 
-        prcnt++;
-        if (prcnt == 17*1024) {printf("\rDone: %.1f%%", (double)i/entry_count*100.0); prcnt = 0;}
-        
-        // Find all records with identical hashes
-        while (i + 1 < entry_count && 
-               index[i+1].h2 == index[group_start].h2 && 
-               index[i+1].h1 == index[group_start].h1) {
-            i++;
-        }
+ZIRKA_API void zirka_encode_defaults(ZirkaEncodeOptions* opt) {
+    memset(opt, 0, sizeof(*opt));
+    opt->stripe_mb = STRIPE_UNIT >> 20;
+    opt->disk_mbps = PLAN_DISK_MBPS;
+    opt->shards = ZIRKA_SHARDS_AUTO;
+    opt->extend = true;
+    opt->prune = true;
+    opt->io = backend_names[BACKEND_AUTO];
+    opt->io_block_mb = IO_BLOCK >> 20;
+    opt->io_engine = engine_names[ENGINE_AUTO];
+    opt->io_depth = IO_DEPTH;
+    opt->numa = numa_names[NUMA_AUTO];
+    opt->join = join_names[JOIN_SORT];
+    opt->engine = pipeline_names[PIPELINE_DEFAULT];
+}
 
-        uint64_t group_size = (i - group_start) + 1;
+ZIRKA_API ZirkaEncoder* zirka_encoder_new(const ZirkaEncodeOptions* opt) {
+    ZirkaEncodeOptions def;
+    if (!opt) { zirka_encode_defaults(&def); opt = &def; }
+    int backend = opt->io ? parse_io_backend(opt->io) : BACKEND_AUTO;
+    int engine = opt->io_engine ? ENGINE_COUNT : ENGINE_AUTO;
+    for (int e = 0; opt->io_engine && e < ENGINE_COUNT; e++) if (strcmp(opt->io_engine, engine_names[e]) == 0) engine = e;
+    int numa = opt->numa ? NUMA_MODES : NUMA_AUTO;
+    for (int m = 0; opt->numa && m < NUMA_MODES; m++) if (strcmp(opt->numa, numa_names[m]) == 0) numa = m;
+    int join = opt->join ? JOIN_MODES : JOIN_SORT;
+    for (int m = 0; opt->join && m < JOIN_MODES; m++) if (strcmp(opt->join, join_names[m]) == 0) join = m;
+    int pipeline = opt->engine ? PIPELINES : PIPELINE_DEFAULT;
+    for (int p = 0; opt->engine && p < PIPELINES; p++) if (strcmp(opt->engine, pipeline_names[p]) == 0) pipeline = p;
+    int shards = opt->shards;
+    bool nuclear_only = opt->tar || shards > 0 || join == JOIN_HASH;
+    if (pipeline == PIPELINES || (nuclear_only && pipeline != PIPELINE_AUTO && pipeline != PIPELINE_NUCLEAR) || join == JOIN_MODES || (join == JOIN_HASH && shards == 0) || opt->stripe_mb == 0 || backend < 0 || opt->io_block_mb == 0 || engine == ENGINE_COUNT || numa == NUMA_MODES || opt->io_depth < 1 || opt->io_depth > IO_DEPTH_MAX ||
+        (opt->rss_limit && opt->rss_limit < GOV_MIN_LIMIT) || (shards != SHARDS_AUTO && (shards < 0 || shards == 1 || shards > 65536 || (shards & (shards - 1)))) ||
+        (opt->resume && !opt->tmp_prefix)) return NULL;
+
+    ZirkaEncoder* z = calloc(1, sizeof(*z));
+    if (!z) return NULL;
+    pthread_mutex_init(&z->stage_io_lock, NULL);
+    z->metrics = calloc(1, sizeof(Metrics));
+    z->progress = calloc(1, sizeof(ProgressReporter));
+    z->numa = calloc(1, sizeof(NumaLayout));
+    z->layout = calloc(1, sizeof(IndexLayout));
+    bool oom = !z->metrics || !z->progress || !z->numa || !z->layout;
+    const char* lists[4] = { opt->tmp, opt->tmp_index, opt->tmp_updates, opt->tmp_rank };
+    for (int i = 0; i < 4; i++) if (lists[i] && !(z->tmp_lists[i] = strdup(lists[i]))) oom = true;
+    if (opt->metrics_path && !(z->metrics_path = strdup(opt->metrics_path))) oom = true;
+    if (oom) { zirka_encoder_free(z); return NULL; }
+
+    z->log = opt->log;
+    z->progress_fn = opt->progress;
+    z->progress_user = opt->progress_user;
+    z->threads = (opt->threads > 0) ? opt->threads : omp_get_max_threads();
+    if (opt->tmp_prefix) snprintf(z->tmp_prefix, sizeof(z->tmp_prefix), "%s", opt->tmp_prefix);
+    else {
+        snprintf(z->tmp_prefix, sizeof(z->tmp_prefix), "%d.%u.", (int)getpid(), __atomic_fetch_add(&g_encoder_serial, 1, __ATOMIC_RELAXED));
+        z->own_prefix = true;
+    }
+    z->stripe_unit = opt->stripe_mb << 20;
+    z->disk_mbps = opt->disk_mbps;
+    z->shards_requested = shards;
+    z->join = join;
+    z->pipeline_requested = pipeline;
+    z->rss_limit = opt->rss_limit;
+    z->extend = opt->extend;
+    z->lz = opt->lz;
+    z->tar = opt->tar;
+    z->align_refs = opt->align_refs;
+    z->prune = opt->prune;
+    z->seek_interval = opt->seek_kb << 10;
+    z->io_backend = backend;
+    z->io_engine = engine;
+    z->io_depth = opt->io_depth;
+    z->io_block = opt->io_block_mb << 20;
+    z->numa_mode = numa;
+    z->resume = opt->resume;
+    z->plan_only = opt->plan_only;
+    z->force = opt->force;
+    z->in_fd = -1;
+    // Blocks in flight come out of the RSS ceiling too (a reader and a writer per stage)
+    while (z->rss_limit && 2 * z->io_depth * z->io_block > z->rss_limit / 2) {
+        if (z->io_depth > 2) z->io_depth /= 2;
+        else if (z->io_block > (1ULL << 20)) z->io_block /= 2;
+        else break;
+    }
+    return z;
+}
 
-        // Logic: If there is more than one, we have duplicates
-        if (group_size > 1) {
-            // Because our sort tie-breaker was 'offset', index[group_start] is the FIRST appearance
-            uint64_t master_offset = index[group_start].offset;
+ZIRKA_API void zirka_encoder_free(ZirkaEncoder* z) {
+    if (!z) return;
+    for (int i = 0; i < 4; i++) { free(z->tmp_lists[i]); free(z->tmp_parsed[i]); }
+    free(z->metrics_path);
+    free(z->metrics);
+    free(z->progress);
+    free(z->numa);
+    if (z->layout) free(z->layout->span);
+    free(z->layout);
+    free(z->bucket_fill);
+    free(z->tree);
+    pthread_mutex_destroy(&z->stage_io_lock);
+    free(z);
+}
 
-            // Map every subsequent appearance back to the master_offset
-            for (uint64_t j = group_start + 1; j <= i; j++) {
-                index[j].offset = master_offset;
-            }
-        }
+ZIRKA_API int zirka_encode_file(ZirkaEncoder* z, const char* path) {
+    z->in_fd = open(path, O_RDONLY);
+    if (z->in_fd == -1) return encoder_refuse(z, "Open input failed");
+    if (fstat(z->in_fd, &z->sb) == -1) { encoder_refuse(z, "Stat failed"); close(z->in_fd); return encoder_finish(z, ZIRKA_ERROR); }
+    z->name = path;
+    z->filesize = z->sb.st_size;
+    z->buffer = NULL;
+    snprintf(z->out_path, sizeof(z->out_path), "%s.zirka", path);
+    // The output goes next to the input
+    snprintf(z->out_dir, sizeof(z->out_dir), "%s", path);
+    char* slash = strrchr(z->out_dir, '/');
+    if (slash) *slash = 0; else strcpy(z->out_dir, ".");
+    int rc = encode_guarded(z);
+    close(z->in_fd);
+    return encoder_finish(z, rc);
+}
+
+// The outputs of a descriptor or buffer job are duplicates of the caller's descriptors, written at their current offsets
+static int encoder_attach(ZirkaEncoder* z, int out_fd, int idx_fd) {
+    int fd = dup(out_fd);
+    if (fd == -1 || !(z->fout = fdopen(fd, "wb"))) { if (fd != -1) close(fd); return encoder_refuse(z, "archive descriptor"); }
+    if (idx_fd < 0 || !z->seek_interval) return ZIRKA_OK;
+    fd = dup(idx_fd);
+    if (fd == -1 || !(z->fidx = fdopen(fd, "wb"))) { if (fd != -1) close(fd); return encoder_refuse(z, "seek index descriptor"); }
+    return ZIRKA_OK;
+}
+
+ZIRKA_API int zirka_encode_fd(ZirkaEncoder* z, int in_fd, int out_fd, int idx_fd) {
+    if (fstat(in_fd, &z->sb) == -1) return encoder_refuse(z, "Stat failed");
+    if (encoder_attach(z, out_fd, idx_fd) != ZIRKA_OK) return encoder_finish(z, ZIRKA_ERROR);
+    z->name = "(descriptor)";
+    z->in_fd = in_fd;
+    z->filesize = z->sb.st_size;
+    z->buffer = NULL;
+    return encoder_finish(z, encode_guarded(z));
+}
+
+ZIRKA_API int zirka_encode_buffer(ZirkaEncoder* z, const void* data, uint64_t size, int out_fd, int idx_fd) {
+    if (z->resume || !data) { errno = EINVAL; return encoder_refuse(z, z->resume ? "resume needs a file or descriptor input" : "buffer"); }
+    if (encoder_attach(z, out_fd, idx_fd) != ZIRKA_OK) return encoder_finish(z, ZIRKA_ERROR);
+    memset(&z->sb, 0, sizeof(z->sb));
+    z->sb.st_size = size;
+    z->name = "(buffer)";
+    z->in_fd = -1;
+    z->filesize = size;
+    z->buffer = data;
+    return encoder_finish(z, encode_guarded(z));
+}
+
+ZIRKA_API const char* zirka_encoder_error(const ZirkaEncoder* z) { return z->error; }
+ZIRKA_API const ZirkaStats* zirka_encoder_stats(const ZirkaEncoder* z) { return &z->stats; }
+
+#ifndef ZIRKA_LIBRARY
+// "512M", "48G", "2048" (MB)
+static uint64_t parse_mem_size(const char* s) {
+    char* end;
+    uint64_t v = strtoull(s, &end, 10);
+    if (*end == 'G' || *end == 'g') return v << 30;
+    return v << 20;
+}
+
+int main(int argc, char* argv[]) {
+    char* filename = NULL;
+    ZirkaEncodeOptions opt;
+    zirka_encode_defaults(&opt);
+    opt.log = stdout;
+    opt.tmp_prefix = ""; // Fixed temp file names, so that --resume finds them
+    for (int a = 1; a < argc; a++) {
+        if (strcmp(argv[a], "--resume") == 0) opt.resume = true;
+        else if (strcmp(argv[a], "--tmp") == 0 && a + 1 < argc) opt.tmp = argv[++a];
+        else if (strcmp(argv[a], "--tmp-index") == 0 && a + 1 < argc) opt.tmp_index = argv[++a];
+        else if (strcmp(argv[a], "--tmp-updates") == 0 && a + 1 < argc) opt.tmp_updates = argv[++a];
+        else if (strcmp(argv[a], "--tmp-rank") == 0 && a + 1 < argc) opt.tmp_rank = argv[++a];
+        else if (strcmp(argv[a], "--stripe-mb") == 0 && a + 1 < argc) opt.stripe_mb = strtoull(argv[++a], NULL, 10);
+        else if (strcmp(argv[a], "--disk-mbps") == 0 && a + 1 < argc) opt.disk_mbps = atof(argv[++a]);
+        else if (strcmp(argv[a], "--shards") == 0 && a + 1 < argc) opt.shards = (strcmp(argv[++a], "auto") == 0) ? ZIRKA_SHARDS_AUTO : atoi(argv[a]);
+        else if (strcmp(argv[a], "--join") == 0 && a + 1 < argc) opt.join = argv[++a];
+        else if (strcmp(argv[a], "--engine") == 0 && a + 1 < argc) opt.engine = argv[++a];
+        else if (strcmp(argv[a], "--rss-limit") == 0 && a + 1 < argc) opt.rss_limit = parse_mem_size(argv[++a]);
+        else if (strcmp(argv[a], "--metrics") == 0 && a + 1 < argc) opt.metrics_path = argv[++a];
+        else if (strcmp(argv[a], "--no-extend") == 0) opt.extend = false;
+        else if (strcmp(argv[a], "--lz") == 0) opt.lz = true;
+        else if (strcmp(argv[a], "--tar") == 0) opt.tar = true;
+        else if (strcmp(argv[a], "--align-refs") == 0) opt.align_refs = true;
+        else if (strcmp(argv[a], "--no-prune") == 0) opt.prune = false;
+        else if (strcmp(argv[a], "--seekable") == 0) { if (!opt.seek_kb) opt.seek_kb = SEEK_INTERVAL_DEFAULT >> 10; }
+        else if (strcmp(argv[a], "--seek-kb") == 0 && a + 1 < argc) opt.seek_kb = strtoull(argv[++a], NULL, 10); // Implies --seekable
+        else if (strcmp(argv[a], "--io") == 0 && a + 1 < argc) opt.io = argv[++a];
+        else if (strcmp(argv[a], "--io-block-mb") == 0 && a + 1 < argc) opt.io_block_mb = strtoull(argv[++a], NULL, 10);
+        else if (strcmp(argv[a], "--io-engine") == 0 && a + 1 < argc) opt.io_engine = argv[++a];
+        else if (strcmp(argv[a], "--io-depth") == 0 && a + 1 < argc) opt.io_depth = atoi(argv[++a]);
+        else if (strcmp(argv[a], "--numa") == 0 && a + 1 < argc) opt.numa = argv[++a];
+        else if (strcmp(argv[a], "--plan") == 0) opt.plan_only = true;
+        else if (strcmp(argv[a], "--force") == 0) opt.force = true;
+        else filename = argv[a];
+    }
+    if (opt.rss_limit && opt.rss_limit < GOV_MIN_LIMIT) {
+        printf("--rss-limit: the governor needs at least %llu MB.\n", GOV_MIN_LIMIT >> 20);
+        return 1;
     }
+    ZirkaEncoder* z = filename ? zirka_encoder_new(&opt) : NULL;
+    if (!z) {
+        printf("Usage: %s [--plan] [--force] [--resume] [--tmp DIR,DIR,...] [--tmp-index DIR,DIR,...] [--tmp-updates DIR] [--tmp-rank DIR] [--stripe-mb N] [--disk-mbps N] [--shards auto|0|256|4096|...] [--join sort|hash] [--engine auto|nuclear|rankmap|first|bs] [--no-prune] [--rss-limit N[M|G]] [--metrics FILE.json] [--no-extend] [--lz] [--tar] [--align-refs] [--seekable] [--seek-kb N] [--io auto|mmap|pread|direct] [--io-block-mb N] [--io-engine auto|uring|threads] [--io-depth N] [--numa auto|on|off] <file>\n", argv[0]);
+        return 1;
+    }
+
+printf ("__________.__        __            \n");
+printf ("\\____    /|__|______|  | _______   \n");
+printf ("  /     / |  \\_  __ \\  |/ /\\__  \\  \n");
+printf (" /     /_ |  ||  | \\/    <  / __ \\_\n");
+printf ("/_______ \\|__||__|  |__|_ \\(____  /\n");
+printf ("        \\/               \\/     \\/ \n");
+printf ("Version %d++, Deduplication granularity %d\n", VERSION, CHUNK_SIZE);
+
+// [sanmayce@djudjeto v7+]$ echo -n Sanmayce> Sanmayce 
+// [sanmayce@djudjeto v7+]$ sha1sum Sanmayce 
+// 8ecfb9435b758ba69d424f0aa003f6e3dc5943b3  Sanmayce
+
+/*
+char Sanmayce[] = "Sanmayce";
+uint8_t hash_out20[32];
+        sha1_sum(Sanmayce, 8, (uint8_t *)hash_out20);
+for (int i=0; i<20; i++) printf("%02x", hash_out20[i]);
 printf("\n");
-// Make all duplicates to point to the first of them ]
+exit (1);
+*/
 
+// [sanmayce@djudjeto v7+]$ ./Zirka_v7 q
+// Version 7+, Deduplication granularity 384
+// 8ecfb9435b758ba69d424f0aa003f6e3dc5943b3
 
-    uint64_t pos = 0;
-    prcnt = 0;
-    while(pos < filesize) {
-        bool found = false;
-        uint64_t match_offset = 0;
+// malloc [
+/*
+    FILE* fin = fopen(argv[1], "rb");
+    if (!fin) { perror("Input error"); return 1; }
+    fseek(fin, 0, SEEK_END);
+    uint64_t filesize = ftell(fin);
+    fseek(fin, 0, SEEK_SET);
 
-        if (pos < entry_count) {
-            uint64_t h[2];
-            FNV1A_Pippip_128((char*)buffer + pos, CHUNK_SIZE, 0, h);
-            
-            int64_t best_off = find_match_binary(index, entry_count, h[0], h[1], pos);
-            
-            if (best_off != -1) {
-                // Verify content
-                if (memcmp(buffer + pos, buffer + best_off, CHUNK_SIZE) == 0) {
-                    found = true;
-                    match_offset = (uint64_t)best_off;
-                }
-            }
-        }
+    uint64_t entry_count = (filesize >= CHUNK_SIZE) ? (filesize - CHUNK_SIZE + 1) : 0;
 
-        prcnt++;
-        if (found) {
-            fputc(MAGIC_BYTE, fout);
-            fwrite(&match_offset, 8, 1, fout);
-            uint32_t h_chk = calc_fnv_off(match_offset); 
-            fwrite(&h_chk, 4, 1, fout);
-            pos += CHUNK_SIZE;
-        } else {
-            fputc(buffer[pos], fout);
-            pos++;
-        }
-        
-        if (prcnt == 7*1024) {printf("\r   Encoded: %.1f%%", (double)pos/filesize*100.0); prcnt = 0;}
-    }
+    char* filename = argv[1];
+    
+    printf("[Zirka 1-Pass] File: %s (%.2f GB)\n", filename, filesize / 1024.0 / 1024.0 / 1024.0);
+    printf("[Zirka 1-Pass] Hashing to temporary MMAP file (this will use 24x filesize = ~%lu GB disk space)...\n", 
+           (entry_count * sizeof(DiskEntry)) / 1024 / 1024 / 1024);
+*/
+// malloc ]
 
-    printf("\nDone.\n");
-    fclose(fout);
-    free(buffer);
-    munmap(index, entry_count * sizeof(DiskEntry));
-    //unlink("zirka_index.tmp");
-    return 0;
-#endif
+    int rc = zirka_encode_file(z, filename);
+    if (rc == ZIRKA_ERROR) fprintf(stderr, "%s\n", zirka_encoder_error(z));
+    zirka_encoder_free(z);
+    return rc;
 }
+#endif
 
 /*
 This breakdown highlights the architectural achievements of --Zirka v7--, emphasizing the original approaches that allow a consumer laptop to process terabyte-scale datasets without crashing.
@@ -0,0 +1,536 @@
+// ZirkaBench: a reproducible end-to-end benchmark of FastZirka/FastUnzirka on a synthetic corpus, for comparing
+// pipelines and options and for catching regressions on a plain Linux box (no private 25 GB tar needed).
+//
+// $ clang -O3 ZirkaBench.c -o ZirkaBench -lm
+// $ ./ZirkaBench --size 4G --dup 0.4 --dist exp:256M --zero 0.05 --run nuclear --run shards:"--shards 256 --join hash" --csv bench.csv --json bench.json
+// $ ./ZirkaBench --size 8G --tar 128K --dup 0.5 --run plain --run tar:--tar --csv tar.csv
+//
+// 1. The corpus (same seed, same bytes) is generated next to the archives, streamed to disk:
+//    --size N[K|M|G]       corpus size (default 256M)
+//    --dup F               fraction of the bytes copied from earlier in the corpus (default 0.3)
+//    --dup-len MIN:MAX     length of a copy, log-uniform (default 4K:1M)
+//    --dist D              where copies come from: uniform (anywhere before), exp:MEAN (exponential distance),
+//                          far (the first tenth of what is written so far); default uniform
+//    --zero F              fraction of the bytes in zero runs (default 0.02), --zero-len MIN:MAX (default 4K:1M)
+//    --tar MEAN            wrap the corpus in a ustar archive, members of MEAN bytes on average (exponential);
+//                          a copy is then a whole earlier member stored again, the way a tar of a source tree repeats
+//    --seed N, --corpus FILE (default zirka_bench.corpus in --dir), --gen-only, --keep
+// 2. Every --run LABEL[:ARGS] (default one run "default" without ARGS, --repeat N times each) encodes the corpus
+//    with ARGS and --metrics, decodes it (with --verify unless ARGS has --no-extend) and compares it with the corpus.
+//    Wall time, peak RSS and block I/O of both children come from wait4(); the per-stage wall times and I/O bytes
+//    from the encoder's JSON report.
+// 3. One CSV row per run (--csv), and (--json) the same plus the encoder's full report. The exit code is 1 if any
+//    round trip failed.
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <math.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+#define GEN_BUFFER (4ULL << 20)
+#define TAR_BLOCK 512
+#define TAR_RECORD 10240
+#define MAX_RUNS 64
+#define MAX_ARGS 64
+
+static void die(const char* what) {
+    fprintf(stderr, "ZirkaBench: %s: %s\n", what, errno ? strerror(errno) : "invalid");
+    exit(2);
+}
+
+// N with an optional K, M or G suffix
+static uint64_t parse_size(const char* s) {
+    char* end;
+    double v = strtod(s, &end);
+    if (end == s || v < 0) { errno = 0; die(s); }
+    if (*end == 'K' || *end == 'k') v *= 1024.0;
+    else if (*end == 'M' || *end == 'm') v *= 1048576.0;
+    else if (*end == 'G' || *end == 'g') v *= 1073741824.0;
+    return (uint64_t)v;
+}
+
+static void parse_range(const char* s, uint64_t* lo, uint64_t* hi) {
+    const char* colon = strchr(s, ':');
+    if (!colon) { errno = 0; die(s); }
+    *lo = parse_size(s);
+    *hi = parse_size(colon + 1);
+    if (*lo == 0 || *hi < *lo) { errno = 0; die(s); }
+}
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// --- CORPUS GENERATOR ---
+enum { DIST_UNIFORM, DIST_EXP, DIST_FAR };
+
+typedef struct {
+    uint64_t size, seed;
+    double dup, zero;
+    uint64_t dup_min, dup_max, zero_min, zero_max;
+    int dist;
+    double dist_mean;
+    uint64_t tar_mean;          // 0 = no tar structure
+} CorpusSpec;
+
+typedef struct {
+    int fd;
+    uint8_t* buf;
+    uint64_t used, pos;         // Bytes in 'buf', bytes written (flushed or not)
+    uint64_t rng;
+    uint64_t dup_bytes, zero_bytes;
+} Gen;
+
+static inline uint64_t gen_random(Gen* g) {
+    uint64_t x = (g->rng += 0x9E3779B97F4A7C15ULL);
+    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+    return x ^ (x >> 31);
+}
+
+static inline double gen_unit(Gen* g) { return (gen_random(g) >> 11) * (1.0 / 9007199254740992.0); }
+
+static uint64_t gen_loguniform(Gen* g, uint64_t lo, uint64_t hi) {
+    return (uint64_t)exp(log((double)lo) + gen_unit(g) * (log((double)hi) - log((double)lo)));
+}
+
+static void gen_flush(Gen* g) {
+    for (uint64_t done = 0; done < g->used; ) {
+        ssize_t n = write(g->fd, g->buf + done, g->used - done);
+        if (n <= 0) die("corpus write");
+        done += n;
+    }
+    g->used = 0;
+}
+
+static void gen_put(Gen* g, const uint8_t* p, uint64_t n) {
+    while (n) {
+        uint64_t k = (GEN_BUFFER - g->used < n) ? GEN_BUFFER - g->used : n;
+        memcpy(g->buf + g->used, p, k);
+        g->used += k; g->pos += k; p += k; n -= k;
+        if (g->used == GEN_BUFFER) gen_flush(g);
+    }
+}
+
+static void gen_fresh(Gen* g, uint64_t n) {
+    uint64_t word[512];
+    while (n) {
+        uint64_t k = (n < sizeof(word)) ? n : sizeof(word);
+        for (uint64_t i = 0; i < (k + 7) / 8; i++) word[i] = gen_random(g);
+        gen_put(g, (const uint8_t*)word, k);
+        n -= k;
+    }
+}
+
+static void gen_zeros(Gen* g, uint64_t n) {
+    static const uint8_t zero[65536];
+    g->zero_bytes += n;
+    while (n) {
+        uint64_t k = (n < sizeof(zero)) ? n : sizeof(zero);
+        gen_put(g, zero, k);
+        n -= k;
+    }
+}
+
+// Appends the 'n' bytes written at 'src' (src + n <= pos), read back from the file
+static void gen_copy(Gen* g, uint64_t src, uint64_t n) {
+    static uint8_t chunk[1 << 20];
+    gen_flush(g);
+    g->dup_bytes += n;
+    while (n) {
+        uint64_t k = (n < sizeof(chunk)) ? n : sizeof(chunk);
+        if (pread(g->fd, chunk, k, src) != (ssize_t)k) die("corpus read back");
+        gen_put(g, chunk, k);
+        src += k; n -= k;
+    }
+}
+
+// Where a copy of 'len' bytes comes from, given 'avail' bytes (or members) before it
+static uint64_t gen_source(Gen* g, const CorpusSpec* c, uint64_t avail, uint64_t len) {
+    uint64_t span = avail - len;
+    if (c->dist == DIST_EXP) {
+        uint64_t d = (uint64_t)(-log(1.0 - gen_unit(g)) * c->dist_mean);
+        return (d > span) ? 0 : span - d;
+    }
+    if (c->dist == DIST_FAR) span /= 10;
+    return (uint64_t)(gen_unit(g) * (span + 1));
+}
+
+// Fresh bytes with zero runs mixed in, until 'n' more bytes are written
+static void gen_content(Gen* g, const CorpusSpec* c, uint64_t n) {
+    uint64_t end = g->pos + n;
+    while (g->pos < end) {
+        uint64_t left = end - g->pos;
+        if (c->zero > 0 && c->zero * g->pos >= g->zero_bytes) {
+            uint64_t len = gen_loguniform(g, c->zero_min, c->zero_max);
+            gen_zeros(g, len < left ? len : left);
+        } else {
+            uint64_t len = gen_loguniform(g, c->dup_min, c->dup_max);
+            gen_fresh(g, len < left ? len : left);
+        }
+    }
+}
+
+// The dup and zero fractions are kept by deficit: the type furthest below its share comes next
+static void gen_flat(Gen* g, const CorpusSpec* c) {
+    while (g->pos < c->size) {
+        uint64_t left = c->size - g->pos;
+        double dup_short = c->dup * g->pos - g->dup_bytes, zero_short = c->zero * g->pos - g->zero_bytes;
+        if (dup_short > 0 && dup_short >= zero_short) {
+            uint64_t len = gen_loguniform(g, c->dup_min, c->dup_max);
+            if (len > left) len = left;
+            if (len <= g->pos) { gen_copy(g, gen_source(g, c, g->pos, len), len); continue; }
+        }
+        if (zero_short > 0) {
+            uint64_t len = gen_loguniform(g, c->zero_min, c->zero_max);
+            gen_zeros(g, len < left ? len : left);
+            continue;
+        }
+        uint64_t len = gen_loguniform(g, c->dup_min, c->dup_max);
+        gen_fresh(g, len < left ? len : left);
+    }
+}
+
+static void tar_octal(char* f, int len, uint64_t v) {
+    if (v >> (3 * (len - 1))) { // Too big for the octal field: GNU base-256
+        memset(f, 0, len);
+        f[0] = (char)0x80;
+        for (int i = len - 1; i > 0 && v; i--, v >>= 8) f[i] = (char)(v & 0xFF);
+        return;
+    }
+    snprintf(f, len, "%0*lo", len - 1, (unsigned long)v);
+}
+
+static void gen_tar_header(Gen* g, uint64_t member, uint64_t size) {
+    uint8_t h[TAR_BLOCK];
+    memset(h, 0, sizeof(h));
+    snprintf((char*)h, 100, "corpus/d%04lu/f%08lu.bin", (unsigned long)(member / 1000), (unsigned long)member);
+    tar_octal((char*)h + 100, 8, 0644);
+    tar_octal((char*)h + 108, 8, 1000);
+    tar_octal((char*)h + 116, 8, 1000);
+    tar_octal((char*)h + 124, 12, size);
+    tar_octal((char*)h + 136, 12, 1700000000 + member);
+    h[156] = '0';
+    memcpy(h + 257, "ustar", 6);
+    memcpy(h + 263, "00", 2);
+    memcpy(h + 265, "bench", 6);
+    memcpy(h + 297, "bench", 6);
+    uint64_t sum = 0;
+    memset(h + 148, ' ', 8);
+    for (int i = 0; i < TAR_BLOCK; i++) sum += h[i];
+    snprintf((char*)h + 148, 8, "%06lo", (unsigned long)sum);
+    h[155] = ' ';
+    gen_put(g, h, TAR_BLOCK);
+}
+
+static void gen_pad(Gen* g, uint64_t to) {
+    static const uint8_t zero[TAR_RECORD];
+    uint64_t n = (to - g->pos % to) % to;
+    gen_put(g, zero, n);
+}
+
+// Members until the corpus is full; a copy is a whole earlier member (its data) under a new name
+static void gen_tar(Gen* g, const CorpusSpec* c) {
+    uint64_t cap = 1024, count = 0;
+    uint64_t (*member)[2] = malloc(cap * sizeof(*member)); // Data offset and size
+    if (!member) die("members");
+    while (g->pos + 2 * TAR_BLOCK < c->size) {
+        uint64_t size = (uint64_t)(-log(1.0 - gen_unit(g)) * c->tar_mean), src = 0;
+        bool copy = count && c->dup * g->pos > g->dup_bytes;
+        if (copy) {
+            src = gen_source(g, c, count, 1);
+            size = member[src][1];
+        }
+        uint64_t room = c->size - g->pos - 2 * TAR_BLOCK;
+        room = (room > TAR_BLOCK) ? (room - TAR_BLOCK) / TAR_BLOCK * TAR_BLOCK : 0;
+        if (size > room) { size = room; copy = false; }
+        if (count == cap) {
+            cap *= 2;
+            member = realloc(member, cap * sizeof(*member));
+            if (!member) die("members");
+        }
+        gen_tar_header(g, count, size);
+        member[count][0] = g->pos;
+        member[count][1] = size;
+        if (copy) gen_copy(g, member[src][0], size);
+        else gen_content(g, c, size);
+        gen_pad(g, TAR_BLOCK);
+        count++;
+        if (!size && !room) break;
+    }
+    static const uint8_t end[2 * TAR_BLOCK];
+    gen_put(g, end, sizeof(end));
+    gen_pad(g, TAR_RECORD);
+    free(member);
+    printf("   %lu tar members\n", (unsigned long)count);
+}
+
+static void generate(const CorpusSpec* c, const char* path) {
+    Gen g;
+    memset(&g, 0, sizeof(g));
+    g.rng = c->seed;
+    g.buf = malloc(GEN_BUFFER);
+    g.fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0666);
+    if (!g.buf || g.fd == -1) die(path);
+    double t0 = now();
+    printf("[ZirkaBench] Generating %s (%.2f GB, seed %lu)...\n", path, c->size / 1073741824.0, (unsigned long)c->seed);
+    if (c->tar_mean) gen_tar(&g, c);
+    else gen_flat(&g, c);
+    gen_flush(&g);
+    if (fsync(g.fd) == -1) die("corpus sync");
+    close(g.fd);
+    free(g.buf);
+    printf("   %lu bytes in %.2fs: %.1f%% copies, %.1f%% zero runs\n", (unsigned long)g.pos, now() - t0,
+           g.pos ? 100.0 * g.dup_bytes / g.pos : 0.0, g.pos ? 100.0 * g.zero_bytes / g.pos : 0.0);
+}
+
+// --- DRIVER ---
+typedef struct {
+    char label[64];
+    char args[512];
+} RunSpec;
+
+typedef struct {
+    double secs;
+    uint64_t max_rss_kb, read_bytes, write_bytes;
+    int status;
+} ChildResult;
+
+// Runs argv with its output in 'log', measures it with wait4()
+static void run_child(char** argv, const char* log, ChildResult* r) {
+    double t0 = now();
+    pid_t pid = fork();
+    if (pid == -1) die("fork");
+    if (pid == 0) {
+        int fd = open(log, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+        if (fd != -1) { dup2(fd, 1); dup2(fd, 2); close(fd); }
+        execv(argv[0], argv);
+        perror(argv[0]);
+        _exit(127);
+    }
+    struct rusage ru;
+    int status;
+    if (wait4(pid, &status, 0, &ru) == -1) die("wait4");
+    r->secs = now() - t0;
+    r->max_rss_kb = ru.ru_maxrss;
+    r->read_bytes = (uint64_t)ru.ru_inblock * 512;
+    r->write_bytes = (uint64_t)ru.ru_oublock * 512;
+    r->status = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+}
+
+static bool same_files(const char* a, const char* b) {
+    static uint8_t x[1 << 20], y[1 << 20];
+    FILE* fa = fopen(a, "rb");
+    FILE* fb = fopen(b, "rb");
+    bool same = fa && fb;
+    while (same) {
+        size_t na = fread(x, 1, sizeof(x), fa), nb = fread(y, 1, sizeof(y), fb);
+        if (na != nb || memcmp(x, y, na)) same = false;
+        if (na < sizeof(x)) break;
+    }
+    if (fa) fclose(fa);
+    if (fb) fclose(fb);
+    return same;
+}
+
+static char* read_file(const char* path) {
+    FILE* f = fopen(path, "rb");
+    if (!f) return NULL;
+    fseek(f, 0, SEEK_END);
+    long n = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    char* s = malloc(n + 1);
+    if (s && fread(s, 1, n, f) != (size_t)n) { free(s); s = NULL; }
+    if (s) s[n] = 0;
+    fclose(f);
+    return s;
+}
+
+static uint64_t file_size(const char* path) {
+    struct stat st;
+    return stat(path, &st) == 0 ? (uint64_t)st.st_size : 0;
+}
+
+// "hash=1.234/56789;sort=..." from the "stages" array of the encoder's report: wall seconds / I/O bytes per stage
+static void stage_summary(const char* report, char* out, size_t size) {
+    out[0] = 0;
+    const char* p = report ? strstr(report, "\"stages\": [") : NULL;
+    const char* end = p ? strstr(p, "\n  ]") : NULL;
+    size_t used = 0;
+    while (p && end && (p = strstr(p, "{ \"name\": \"")) && p < end) {
+        p += 11;
+        const char* q = strchr(p, '"');
+        const char* wall = strstr(q, "\"wall_s\": ");
+        const char* io = strstr(q, "\"io\": { \"bytes\": ");
+        if (!q || !wall || !io) break;
+        used += snprintf(out + used, used < size ? size - used : 0, "%s%.*s=%.3f/%lu", used ? ";" : "", (int)(q - p), p,
+                         strtod(wall + 10, NULL), strtoul(io + 17, NULL, 10));
+        p = q;
+    }
+}
+
+static void usage(const char* self) {
+    printf("Usage: %s [--size N] [--seed N] [--dup F] [--dup-len MIN:MAX] [--dist uniform|exp:MEAN|far] [--zero F] [--zero-len MIN:MAX] [--tar MEAN] "
+           "[--dir DIR] [--corpus FILE] [--gen-only] [--keep] [--zirka PATH] [--unzirka PATH] [--run LABEL[:ARGS]]... [--repeat N] [--csv FILE] [--json FILE]\n", self);
+}
+
+int main(int argc, char* argv[]) {
+    CorpusSpec c = { 256ULL << 20, 1, 0.3, 0.02, 4096, 1 << 20, 4096, 1 << 20, DIST_UNIFORM, 0, 0 };
+    const char* dir = ".";
+    const char* corpus_arg = NULL;
+    const char* zirka = "./FastZirka_v7++_Final";
+    const char* unzirka = "./FastUnzirka_v7++_Final";
+    const char* csv_path = NULL;
+    const char* json_path = NULL;
+    bool gen_only = false, keep = false;
+    int repeat = 1, nruns = 0;
+    RunSpec runs[MAX_RUNS];
+    for (int a = 1; a < argc; a++) {
+        const char* o = argv[a];
+        const char* v = (a + 1 < argc) ? argv[a + 1] : NULL;
+        bool used = true;
+        if (strcmp(o, "--gen-only") == 0) { gen_only = true; continue; }
+        if (strcmp(o, "--keep") == 0) { keep = true; continue; }
+        if (!v) { usage(argv[0]); return 2; }
+        if (strcmp(o, "--size") == 0) c.size = parse_size(v);
+        else if (strcmp(o, "--seed") == 0) c.seed = strtoull(v, NULL, 10);
+        else if (strcmp(o, "--dup") == 0) c.dup = atof(v);
+        else if (strcmp(o, "--dup-len") == 0) parse_range(v, &c.dup_min, &c.dup_max);
+        else if (strcmp(o, "--zero") == 0) c.zero = atof(v);
+        else if (strcmp(o, "--zero-len") == 0) parse_range(v, &c.zero_min, &c.zero_max);
+        else if (strcmp(o, "--tar") == 0) c.tar_mean = parse_size(v);
+        else if (strcmp(o, "--dist") == 0) {
+            if (strcmp(v, "uniform") == 0) c.dist = DIST_UNIFORM;
+            else if (strcmp(v, "far") == 0) c.dist = DIST_FAR;
+            else if (strncmp(v, "exp:", 4) == 0) { c.dist = DIST_EXP; c.dist_mean = (double)parse_size(v + 4); }
+            else { usage(argv[0]); return 2; }
+        }
+        else if (strcmp(o, "--dir") == 0) dir = v;
+        else if (strcmp(o, "--corpus") == 0) corpus_arg = v;
+        else if (strcmp(o, "--zirka") == 0) zirka = v;
+        else if (strcmp(o, "--unzirka") == 0) unzirka = v;
+        else if (strcmp(o, "--repeat") == 0) repeat = atoi(v);
+        else if (strcmp(o, "--csv") == 0) csv_path = v;
+        else if (strcmp(o, "--json") == 0) json_path = v;
+        else if (strcmp(o, "--run") == 0 && nruns < MAX_RUNS) {
+            const char* colon = strchr(v, ':');
+            size_t n = colon ? (size_t)(colon - v) : strlen(v);
+            snprintf(runs[nruns].label, sizeof(runs[nruns].label), "%.*s", (int)n, v);
+            snprintf(runs[nruns].args, sizeof(runs[nruns].args), "%s", colon ? colon + 1 : "");
+            nruns++;
+        }
+        else used = false;
+        if (!used) { usage(argv[0]); return 2; }
+        a++;
+    }
+    if (c.dup < 0 || c.dup >= 1 || c.zero < 0 || c.dup + c.zero >= 1 || repeat < 1) { usage(argv[0]); return 2; }
+    if (nruns == 0) { snprintf(runs[0].label, sizeof(runs[0].label), "default"); runs[0].args[0] = 0; nruns = 1; }
+
+    char corpus[1024], archive[1100], restored[1200], idx[1200], report[1100], log[1100];
+    if (corpus_arg) snprintf(corpus, sizeof(corpus), "%s", corpus_arg);
+    else snprintf(corpus, sizeof(corpus), "%s/zirka_bench.corpus", dir);
+    snprintf(archive, sizeof(archive), "%s.zirka", corpus);
+    snprintf(restored, sizeof(restored), "%s.restored", archive);
+    snprintf(idx, sizeof(idx), "%s.idx", archive);
+    snprintf(report, sizeof(report), "%s/zirka_bench_metrics.json", dir);
+    snprintf(log, sizeof(log), "%s/zirka_bench.log", dir);
+
+    generate(&c, corpus);
+    if (gen_only) return 0;
+    uint64_t input = file_size(corpus);
+
+    FILE* csv = csv_path ? fopen(csv_path, "w") : NULL;
+    FILE* json = json_path ? fopen(json_path, "w") : NULL;
+    if ((csv_path && !csv) || (json_path && !json)) die(csv_path && !csv ? csv_path : json_path);
+    if (csv) fprintf(csv, "label,repeat,args,input_bytes,archive_bytes,ratio,encode_s,decode_s,encode_mb_s,decode_mb_s,encode_peak_rss_kb,decode_peak_rss_kb,"
+                          "encode_read_bytes,encode_write_bytes,decode_read_bytes,decode_write_bytes,roundtrip,stages\n");
+    if (json) {
+        fprintf(json, "{\n  \"corpus\": { \"bytes\": %lu, \"seed\": %lu, \"dup\": %.3f, \"dup_len\": [%lu, %lu], \"dist\": \"%s\", \"dist_mean\": %.0f, "
+                      "\"zero\": %.3f, \"zero_len\": [%lu, %lu], \"tar_mean\": %lu },\n  \"runs\": [",
+                (unsigned long)input, (unsigned long)c.seed, c.dup, (unsigned long)c.dup_min, (unsigned long)c.dup_max,
+                c.dist == DIST_EXP ? "exp" : c.dist == DIST_FAR ? "far" : "uniform", c.dist_mean, c.zero,
+                (unsigned long)c.zero_min, (unsigned long)c.zero_max, (unsigned long)c.tar_mean);
+    }
+
+    int failures = 0;
+    bool first = true;
+    for (int r = 0; r < nruns; r++) {
+        for (int rep = 0; rep < repeat; rep++) {
+            // Encoder: zirka ARGS... --metrics REPORT CORPUS
+            char args[512];
+            char* eargv[MAX_ARGS + 5];
+            int n = 0;
+            snprintf(args, sizeof(args), "%s", runs[r].args);
+            eargv[n++] = (char*)zirka;
+            for (char* t = strtok(args, " "); t && n < MAX_ARGS; t = strtok(NULL, " ")) eargv[n++] = t;
+            eargv[n++] = "--metrics";
+            eargv[n++] = report;
+            eargv[n++] = corpus;
+            eargv[n] = NULL;
+            unlink(report);
+            printf("[ZirkaBench] %s #%d: encoding%s%s...\n", runs[r].label, rep + 1, runs[r].args[0] ? " with " : "", runs[r].args);
+            ChildResult enc, dec = { 0, 0, 0, 0, -1 };
+            run_child(eargv, log, &enc);
+            uint64_t out = file_size(archive);
+            bool ok = false;
+            if (enc.status == 0) {
+                bool verify = !strstr(runs[r].args, "--no-extend"); // v7 archives carry no checksum
+                char* dargv[] = { (char*)unzirka, verify ? "--verify" : archive, verify ? archive : NULL, NULL };
+                run_child(dargv, log, &dec);
+                ok = dec.status == 0 && same_files(corpus, restored);
+            }
+            if (!ok) {
+                failures++;
+                printf("   ROUND TRIP FAILED (encoder %d, decoder %d), see %s\n", enc.status, dec.status, log);
+            }
+            char* rep_json = read_file(report);
+            char stages[2048];
+            stage_summary(rep_json, stages, sizeof(stages));
+            double ratio = out ? (double)input / out : 0.0;
+            printf("   %lu -> %lu bytes (%.2fx), encode %.2fs (%.0f MB/s, %lu MB RSS), decode %.2fs (%.0f MB/s, %lu MB RSS)\n",
+                   (unsigned long)input, (unsigned long)out, ratio, enc.secs, input / 1048576.0 / enc.secs, (unsigned long)(enc.max_rss_kb >> 10),
+                   dec.secs, dec.secs > 0 ? input / 1048576.0 / dec.secs : 0.0, (unsigned long)(dec.max_rss_kb >> 10));
+            if (csv) {
+                fprintf(csv, "%s,%d,\"%s\",%lu,%lu,%.4f,%.3f,%.3f,%.1f,%.1f,%lu,%lu,%lu,%lu,%lu,%lu,%s,%s\n", runs[r].label, rep + 1, runs[r].args,
+                        (unsigned long)input, (unsigned long)out, ratio, enc.secs, dec.secs, input / 1048576.0 / enc.secs,
+                        dec.secs > 0 ? input / 1048576.0 / dec.secs : 0.0, (unsigned long)enc.max_rss_kb, (unsigned long)dec.max_rss_kb,
+                        (unsigned long)enc.read_bytes, (unsigned long)enc.write_bytes, (unsigned long)dec.read_bytes, (unsigned long)dec.write_bytes,
+                        ok ? "ok" : "FAILED", stages);
+                fflush(csv);
+            }
+            if (json) {
+                fprintf(json, "%s\n    { \"label\": \"%s\", \"repeat\": %d, \"args\": \"%s\", \"archive_bytes\": %lu, \"ratio\": %.4f, \"roundtrip\": %s,\n",
+                        first ? "" : ",", runs[r].label, rep + 1, runs[r].args, (unsigned long)out, ratio, ok ? "true" : "false");
+                const ChildResult* cr[2] = { &enc, &dec };
+                for (int k = 0; k < 2; k++) {
+                    fprintf(json, "      \"%s\": { \"wall_s\": %.3f, \"peak_rss_kb\": %lu, \"read_bytes\": %lu, \"write_bytes\": %lu, \"exit\": %d },\n",
+                            k ? "decode" : "encode", cr[k]->secs, (unsigned long)cr[k]->max_rss_kb, (unsigned long)cr[k]->read_bytes,
+                            (unsigned long)cr[k]->write_bytes, cr[k]->status);
+                }
+                fprintf(json, "      \"encoder_report\": %s }", rep_json ? rep_json : "null");
+                first = false;
+            }
+            free(rep_json);
+            unlink(archive);
+            unlink(restored);
+            unlink(idx);
+        }
+    }
+    if (json) { fprintf(json, "\n  ]\n}\n"); fclose(json); }
+    if (csv) fclose(csv);
+    unlink(report);
+    if (!keep) unlink(corpus);
+    printf("[ZirkaBench] %d run(s), %d failed.\n", nruns * repeat, failures);
+    return failures ? 1 : 0;
+}
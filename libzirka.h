@@ -0,0 +1,143 @@
+// libzirka: the Zirka v7++ deduplicator as a library, for services that would otherwise spawn the CLIs
+// and shuttle data through temp files. The encoder lives in FastZirka_v7++_Final.c, the decoder in
+// FastUnzirka_v7++_Final.c; built with -DZIRKA_LIBRARY they lose their main() and only export this API:
+//
+// $ clang -O3 -msse4.2 -maes -fopenmp -fPIC -fvisibility=hidden -DZIRKA_LIBRARY -c FastZirka_v7++_Final.c
+// $ clang -O3 -msse4.2 -maes -fopenmp -fPIC -fvisibility=hidden -DZIRKA_LIBRARY -c FastUnzirka_v7++_Final.c
+// $ clang -shared -fopenmp FastZirka_v7++_Final.o FastUnzirka_v7++_Final.o -o libzirka.so
+//
+// Every job runs on its own context object, so several encoders and decoders may run at once on different threads
+// (one context must not be used by two threads at a time). Each job spreads its own work over 'threads' OpenMP threads.
+// An encoder needs the same temp disk space as the CLI; jobs sharing a temp directory are kept apart by 'tmp_prefix'.
+// A failing job returns ZIRKA_ERROR with a message; only I/O errors inside worker threads still end the process.
+#ifndef LIBZIRKA_H
+#define LIBZIRKA_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define ZIRKA_API __attribute__((visibility("default")))
+
+// Results (also the exit codes of the CLIs)
+#define ZIRKA_OK 0
+#define ZIRKA_ERROR 1
+#define ZIRKA_INFEASIBLE 2 // The execution plan does not fit the temp devices (see 'force')
+
+#define ZIRKA_SHARDS_AUTO -1
+
+// 'done' of 'total' units of 'stage' ("hash", "sort", "encode", "restore", ...). Called once per block of work or every
+// 250 ms from one of the job's threads, so it must be quick and thread-safe.
+typedef void (*zirka_progress_fn)(void* user, const char* stage, uint64_t done, uint64_t total);
+
+// --- Encoder ---
+typedef struct ZirkaEncoder ZirkaEncoder;
+
+typedef struct {
+    int threads;                 // OpenMP threads for this job, 0 = omp_get_max_threads()
+    FILE* log;                   // Stage reports as the CLI prints them, NULL = silent
+    zirka_progress_fn progress;  // May be NULL
+    void* progress_user;
+    // Temp artifacts (strings are copied)
+    const char* tmp;             // Pool "DIR,DIR,..." spread by the planner, NULL = "."
+    const char* tmp_index;       // Explicit per-artifact directories override the pool
+    const char* tmp_updates;
+    const char* tmp_rank;
+    const char* tmp_prefix;      // Prepended to every temp file name; NULL = unique per encoder (no resume across processes)
+    uint64_t stripe_mb;
+    double disk_mbps;            // Planner estimates only
+    int shards;                  // ZIRKA_SHARDS_AUTO, 0 (one index) or a power of two up to 65536
+    const char* join;            // Per shard: "sort" (samplesort, then gather) or "hash" (hash table of first offsets, needs shards)
+    const char* engine;          // Stages 3-4: "auto", "nuclear", "rankmap", "first" or "bs" (shards, "hash" and tar need "nuclear")
+    bool prune;                  // Nuclear: keep only the updates the encoding parse lands on (default true)
+    uint64_t rss_limit;          // Bytes, 0 = no governor, else at least 64 MB. Bounds the mapped input and temp files; the
+                                 // in-RAM buffers of a stage (I/O queues, update buckets, sort scratch) come on top
+    const char* metrics_path;    // JSON stage report, NULL = none
+    // Output
+    bool extend;                 // Long tags and the checksum footer, behind a format marker v7 decoders stop at (false: 13-byte tags only, readable by v7 decoders)
+    bool lz;                     // Block-parallel LZ frames
+    bool tar;                    // Index only the 512-byte data blocks of tar members (nuclear engine)
+    bool align_refs;             // Prefer sources a whole number of 4 KB blocks back, which a decoder can reflink
+    uint64_t seek_kb;            // Checkpoint spacing of the seek index, 0 = no index
+    // Storage layer
+    const char* io;              // "auto", "mmap", "pread" or "direct"
+    uint64_t io_block_mb;
+    const char* io_engine;       // "auto", "uring" or "threads"
+    int io_depth;
+    const char* numa;            // "auto" (pin the threads per node on multi-socket hosts), "on" or "off"
+    // Run control
+    bool resume;                 // Continue from the manifest of an interrupted run (file input and a fixed tmp_prefix)
+    bool plan_only;              // Print the plan, encode nothing
+    bool force;                  // Run even if the plan says the temp space is short
+} ZirkaEncodeOptions;
+
+typedef struct {
+    uint64_t input_bytes, output_bytes;
+    uint64_t duplicates;         // Windows found to repeat an earlier one, less those verification rejected (Nuclear's
+                                 // pruning drops the ones its parse never reads unverified, so they still count)
+    uint64_t tags, long_tags;
+    uint64_t checksum[2];        // Tree hash of the original file: stored by the encoder, recomputed by a verifying decode
+} ZirkaStats;
+
+ZIRKA_API void zirka_encode_defaults(ZirkaEncodeOptions* opt);
+ZIRKA_API ZirkaEncoder* zirka_encoder_new(const ZirkaEncodeOptions* opt); // NULL on invalid options or out of memory
+ZIRKA_API void zirka_encoder_free(ZirkaEncoder* z);
+
+// 'path' is encoded to 'path'.zirka (and 'path'.zirka.idx with seek_kb)
+ZIRKA_API int zirka_encode_file(ZirkaEncoder* z, const char* path);
+// The input is mapped, not read into memory; the archive (and the seek index, idx_fd -1 = none) is written at the
+// current offsets. The descriptors stay open and owned by the caller.
+ZIRKA_API int zirka_encode_fd(ZirkaEncoder* z, int in_fd, int out_fd, int idx_fd);
+// Encodes 'size' bytes at 'data' in place (never copied, never modified)
+ZIRKA_API int zirka_encode_buffer(ZirkaEncoder* z, const void* data, uint64_t size, int out_fd, int idx_fd);
+
+ZIRKA_API const char* zirka_encoder_error(const ZirkaEncoder* z);
+ZIRKA_API const ZirkaStats* zirka_encoder_stats(const ZirkaEncoder* z);
+
+// --- Decoder ---
+typedef struct ZirkaArchive ZirkaArchive;
+
+typedef struct {
+    int threads;                 // Threads decompressing --lz frames, 0 = omp_get_max_threads()
+    FILE* log;                   // NULL = silent
+    zirka_progress_fn progress;
+    void* progress_user;
+    bool verify;                 // Hash the output while restoring it and compare with the archive's checksum
+                                 // (ZIRKA_ERROR if it differs or the archive has none); full restores only
+    bool reflink;                // zirka_decode_fd: share block-aligned matches with their source (FICLONERANGE) and copy long
+                                 // literal runs by copy_file_range; falls back to copying wherever the file system refuses
+    uint64_t keep_limit;         // zirka_decode_stream: RAM for the output parts tags refer to, 0 = 1 GB; beyond it a temp file
+    const char* keep_dir;        // Directory of that temp file, NULL = "." (copied)
+} ZirkaDecodeOptions;
+
+ZIRKA_API void zirka_decode_defaults(ZirkaDecodeOptions* opt);
+// NULL on failure. A path also finds its seek index ('path'.idx); the fd and buffer stay owned by the caller.
+ZIRKA_API ZirkaArchive* zirka_open(const char* path, const ZirkaDecodeOptions* opt);
+ZIRKA_API ZirkaArchive* zirka_open_fd(int fd, const ZirkaDecodeOptions* opt);
+ZIRKA_API ZirkaArchive* zirka_open_buffer(const void* data, uint64_t size, const ZirkaDecodeOptions* opt);
+ZIRKA_API int zirka_use_index(ZirkaArchive* z, const char* idx_path); // Seek index of an fd or buffer archive
+ZIRKA_API void zirka_close(ZirkaArchive* z);
+
+// Restores the whole file into a regular file opened O_RDWR (written from offset 0, grown and mapped as needed)
+ZIRKA_API int zirka_decode_fd(ZirkaArchive* z, int out_fd);
+// Restores the whole file sequentially into any descriptor (pipe, socket, or a file at its current offset): the tag
+// stream is scanned first, and only the output ranges that tags copy from are kept, so memory follows those, not the file
+ZIRKA_API int zirka_decode_stream(ZirkaArchive* z, int out_fd);
+// Restores the whole file into 'cap' bytes at 'dst'; bytes restored, -1 on error
+ZIRKA_API int64_t zirka_decode_buffer(ZirkaArchive* z, void* dst, uint64_t cap);
+// Restores [start, start + len) only, parsing from the nearest checkpoint (see --seekable); ZIRKA_OK or ZIRKA_ERROR
+ZIRKA_API int zirka_read_range(ZirkaArchive* z, uint64_t start, uint64_t len, uint8_t* dst);
+ZIRKA_API int64_t zirka_restored_size(ZirkaArchive* z); // From the seek index (or one scan), -1 on error
+
+ZIRKA_API const char* zirka_archive_error(const ZirkaArchive* z);
+ZIRKA_API const ZirkaStats* zirka_archive_stats(const ZirkaArchive* z); // tags/long_tags/output_bytes/checksum of the last decode
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif